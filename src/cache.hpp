@@ -16,206 +16,859 @@
  *                                                                           *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-// This file defines the template class Cache, which is a fixed-size generic
+// This file defines the template class Cache, which is a bounded generic
 // cache that stores key-value pairs. Users will need to supply methods to load
-// and free elements in child classes. It also supports asynchronous pre-emptive
-// loading with C++11 threads.
+// and free elements in child classes. Elements are handed out as reference
+// counted handles, so that an element is only freed once it has been evicted
+// and is no longer in use. It also supports asynchronous pre-emptive
+// loading on a small pool of background loader threads. Which entries are
+// evicted when the cache is full is decided by a pluggable eviction policy.
 
 #ifndef CACHE_HPP
 #define CACHE_HPP
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
+#include <future>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
-#include <queue>
-#include <set>
 #include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "cancellation_token.hpp"
+
+// Interface for deciding which entry a Cache evicts when it is full. All
+// methods are called with the cache's lock held, so implementations need not
+// be thread-safe.
+template <typename K, typename Hash = std::hash<K>>
+class CacheEvictionPolicy {
+ public:
+  virtual ~CacheEvictionPolicy() {}
+  // Starts tracking a newly loaded key. cost is the time it took to load the
+  // value in seconds, and size is the value's size as reported by the cache.
+  virtual void Insert(const K& key, double cost, size_t size) = 0;
+  // Records a cache hit on a tracked key.
+  virtual void Touch(const K& key) = 0;
+  // Stops tracking and returns the key that should be evicted next. Never
+  // returns the most recently inserted key while other keys are tracked. Only
+  // called when at least one key is tracked.
+  virtual K Evict() = 0;
+  // Stops tracking all keys.
+  virtual void Clear() = 0;
+};
+
+// Evicts the least recently used key. All operations are O(1): keys are kept
+// in a hash map whose nodes are threaded onto a doubly linked list in order of
+// use.
+template <typename K, typename Hash = std::hash<K>>
+class LRUCacheEvictionPolicy : public CacheEvictionPolicy<K, Hash> {
+ public:
+  LRUCacheEvictionPolicy();
+  LRUCacheEvictionPolicy(const LRUCacheEvictionPolicy&) = delete;
+  LRUCacheEvictionPolicy& operator=(const LRUCacheEvictionPolicy&) = delete;
+
+  void Insert(const K& key, double cost, size_t size) override;
+  void Touch(const K& key) override;
+  K Evict() override;
+  void Clear() override;
+
+ private:
+  // A list node. Nodes live in _nodes, whose elements never move.
+  struct Node {
+    // Points to the key in _nodes.
+    const K* Key;
+    // Previous (more recently used) node.
+    Node* Prev;
+    // Next (less recently used) node.
+    Node* Next;
+  };
+
+  // All tracked keys.
+  std::unordered_map<K, Node, Hash> _nodes;
+  // Sentinel node. _head.Next is the most recently used node, and _head.Prev
+  // is the least recently used node.
+  Node _head;
+
+  // Removes a node from the list.
+  static void Unlink(Node* node);
+  // Inserts a node at the front of the list.
+  void LinkFront(Node* node);
+};
+
+// GreedyDual-Size-Frequency: evicts the key with the lowest value of
+//     L + frequency * cost / size,
+// where L is the value of the last evicted key. Entries that are cheap to
+// reload relative to the memory they take up go first, while entries that are
+// hit often or were expensive to load stay. L ages out entries that were
+// popular once but have not been used since. O(log n) per operation.
+template <typename K, typename Hash = std::hash<K>>
+class GDSFCacheEvictionPolicy : public CacheEvictionPolicy<K, Hash> {
+ public:
+  GDSFCacheEvictionPolicy();
+
+  void Insert(const K& key, double cost, size_t size) override;
+  void Touch(const K& key) override;
+  K Evict() override;
+  void Clear() override;
+
+ private:
+  // Tracked keys ordered by increasing value.
+  typedef std::multimap<double, const K*> ValueMap;
+
+  // Bookkeeping for a tracked key.
+  struct Entry {
+    // Time it took to load the value, in seconds.
+    double Cost;
+    // Size of the value.
+    size_t Size;
+    // Number of times the key has been inserted or hit.
+    int Frequency;
+    // Position of this key in _values.
+    typename ValueMap::iterator Position;
+  };
+
+  // All tracked keys.
+  std::unordered_map<K, Entry, Hash> _entries;
+  // Tracked keys ordered by value. Keys point into _entries.
+  ValueMap _values;
+  // Value of the last evicted key.
+  double _inflation;
+  // The most recently inserted key, or nullptr if it has been evicted.
+  const K* _last_inserted_key;
+
+  // Inserts a key into _values according to its current value.
+  void UpdatePosition(const K* key, Entry* entry);
+};
+
 // A generic cache that stores <key, value> pairs. The semantics for Load() and
-// Discard() are implemented in implementing child classes. Supports
-// asynchronous pre-emptive loading with C++11 threads. For performance,
-// multiple instances of Load() and Discard() may be executed at the same time,
-// so these latter MUST be thread-safe. The class assumes K and V are copy-able
-// and also cheap to copy; thus, they should be either primitive values or
-// pointers.
-template <typename K, typename V>
+// Discard() are implemented in implementing child classes. Prefetches requested
+// by Prepare() are executed by a bounded number of background loader threads
+// owned by the cache, in order of increasing priority value. Get() loads
+// missing values on the calling thread, or waits for the load already in
+// flight for the same key; each in-flight load has its own shared future, so
+// waiters are only woken up by the load they are waiting for. Prefetches that
+// are no longer wanted can be cancelled with CancelPrefetches(). For
+// performance, multiple instances of Load() and Discard() may be executed at
+// the same time, so these latter MUST be thread-safe. K is assumed to be
+// cheap to copy, hashable with Hash and comparable with operator==. V only
+// needs to be movable, so it can be a std::unique_ptr.
+//
+// Get() returns a Handle that pins the value. Evicting a pinned value only
+// removes it from the cache; Discard() is called and the value destroyed when
+// the last Handle to it is released, on whichever thread releases it.
+template <typename K, typename V, typename Hash = std::hash<K>>
 class Cache {
  public:
-  // Create a cache with the given maximum size.
-  explicit Cache(int size);
+  enum {
+    // Default priority of loads requested by Prepare(). Lower values are
+    // served first.
+    DEFAULT_PREFETCH_PRIORITY = 1,
+    // Default number of background loader threads.
+    DEFAULT_NUM_LOADER_THREADS = 2,
+    // Default maximum number of pending prefetch requests. When exceeded, the
+    // least urgent request is dropped.
+    DEFAULT_MAX_NUM_PENDING_PREFETCHES = 8,
+  };
+
+  // Eviction policy type for this cache.
+  typedef CacheEvictionPolicy<K, Hash> EvictionPolicy;
+  // A reference counted handle to a value that pins it in memory.
+  typedef std::shared_ptr<V> Handle;
+
+  // Create a cache with the given maximum size, served by the given number of
+  // background loader threads. If eviction_policy is nullptr, the least
+  // recently used entry is evicted.
+  explicit Cache(
+      int size, int num_loader_threads = DEFAULT_NUM_LOADER_THREADS,
+      std::unique_ptr<EvictionPolicy> eviction_policy = nullptr);
   // DOES NOT CLEAR CACHE because it cannot call the virtual function Discard.
-  // Child classes MUST call Clear() in their destructors. Waits for background
-  // loading threads to terminate first.
+  // Child classes MUST call Clear() in their destructors. Stops the background
+  // loader threads.
   virtual ~Cache();
-  // Retrieves an item. If the item is in the cache, simply returns it. If
-  // not, loads it using the Load() function defined in an implementation.
-  V Get(const K& key);
-  // Starts a new thread to load an item into the cache. Note that this puts a
-  // lock on this cache object, and calls to Get() while the asynchronous
-  // loading is in progress will block.
-  void Prepare(const K& key);
+  // Retrieves an item. If the item is in the cache, simply returns it. If it
+  // is being loaded by another thread, waits for that load to complete.
+  // Otherwise, loads it on the calling thread using the Load() function
+  // defined in an implementation. The returned handle keeps the value alive
+  // even if it is evicted. If Load() throws, the exception is propagated to
+  // the caller and nothing is cached; threads waiting for the same key load it
+  // again themselves.
+  Handle Get(const K& key);
+  // Same as Get(), but gives up once deadline has passed. If the item is
+  // loaded on the calling thread, LoadCancellable() is asked to stop at
+  // deadline, and an incomplete item is returned without being cached. If
+  // another thread is loading the item and does not finish by deadline,
+  // returns nullptr. *is_complete is set to whether the returned item is
+  // complete.
+  Handle Get(
+      const K& key, CancellationToken::Clock::time_point deadline,
+      bool* is_complete);
+  // Returns an item if it is in the cache, or nullptr otherwise. Unlike Get(),
+  // never loads the item or waits for a load in flight, so it never blocks on
+  // Load().
+  Handle TryGet(const K& key);
+  // Schedules an item to be loaded in the background. Pending requests are
+  // served in order of increasing priority, which is typically the distance
+  // from the current position; among requests with equal priority, the most
+  // recent is served first. Requests for keys that are already cached, being
+  // loaded or pending are collapsed into one.
+  void Prepare(const K& key, int priority = DEFAULT_PREFETCH_PRIORITY);
+  // Drops pending prefetches, and cancels prefetches being loaded, for keys
+  // that is_wanted returns false for. Loads that Get() is waiting for are
+  // never cancelled. The values of cancelled loads are not cached. is_wanted
+  // is called with the cache's lock held, so it must not use the cache.
+  void CancelPrefetches(const std::function<bool(const K&)>& is_wanted);
   // Returns the size of the cache.
   int GetSize() const;
-  // Clears the cache, calling Discard() on all existing elements. Waits for
-  // background loading threads to terminate first. MUST BE CALLED from the
-  // destructor of a child class.
+  // Limits the total size of cached values, as reported by GetValueSize(), to
+  // the given budget. This applies in addition to the limit on the number of
+  // entries. The most recently loaded entry is always kept, even if it alone
+  // exceeds the budget. 0 means no limit, which is the default.
+  void SetSizeBudget(size_t size_budget);
+  // Returns the size budget, or 0 if there is none.
+  size_t GetSizeBudget();
+  // Sets the maximum number of pending prefetch requests, for callers that
+  // prepare many small values at once. Must be at least 1.
+  void SetMaxNumPendingPrefetches(int max_num_pending_prefetches);
+  // Returns the total size of cached values. Evicted values that are still
+  // pinned by handles are not included.
+  size_t GetTotalValueSize();
+  // Clears the cache, calling Discard() on all existing elements. Drops
+  // pending prefetches and waits for ongoing loads to complete first, and
+  // waits for all handles to be released afterwards, so the calling thread
+  // must not hold any. MUST BE CALLED from the destructor of a child class.
   void Clear();
 
  protected:
   // Loads a new element. This should be overridden in child classes. MUST BE
   // THREAD-SAFE.
   virtual V Load(const K& key) = 0;
-  // Frees an element that has been evicted from the cache. This should be
-  // overridden in child classes. MUST BE THREAD-SAFE.
-  virtual void Discard(const K& key, const V& value) = 0;
+  // Loads a new element like Load(), but may stop early once token is
+  // cancelled and return an incomplete element, which is then not cached. The
+  // default implementation ignores token and calls Load(). MUST BE
+  // THREAD-SAFE.
+  virtual V LoadCancellable(const K& key, const CancellationToken& token);
+  // Frees resources held by an element that has been evicted from the cache
+  // and is no longer pinned, right before the element is destroyed. The
+  // default implementation does nothing, which suits values that clean up
+  // after themselves. MUST BE THREAD-SAFE.
+  virtual void Discard(const K& key, const V& value);
+  // Returns the size of an element, typically in bytes. This is used for the
+  // size budget and by size-aware eviction policies. The default
+  // implementation returns 1. MUST BE THREAD-SAFE.
+  virtual size_t GetValueSize(const K& key, const V& value) const;
 
  private:
+  // A request to load a key.
+  struct Request {
+    K Key;
+    int Priority;
+    // Increasing sequence number, used to serve recent requests first.
+    uint64_t Sequence;
+
+    // Returns true if this request should be served before other.
+    bool IsMoreUrgentThan(const Request& other) const {
+      if (Priority != other.Priority) {
+        return Priority < other.Priority;
+      }
+      return Sequence > other.Sequence;
+    }
+  };
+
   // A lock on this object. Calls to Get() and Prepare() will block for access.
   std::mutex _mutex;
+  // A cached value.
+  struct Entry {
+    Handle Value;
+    // Size of the value as reported by GetValueSize().
+    size_t Size;
+  };
+
   // A map from keys to values.
-  std::map<K, V> _map;
-  // A queue of loaded keys, in the order they were loaded. This is used for
-  // eviction.
-  std::queue<K> _queue;
+  std::unordered_map<K, Entry, Hash> _map;
+  // Decides which entries to evict.
+  std::unique_ptr<EvictionPolicy> _eviction_policy;
   // Max size of this cache.
   int _size;
-  // Keys that are being loaded by some thread.
-  std::set<K> _work_set;
-  // Condition variable used to broadcast work done.
+  // Max total size of cached values, or 0 if unlimited.
+  size_t _size_budget;
+  // Total size of cached values.
+  size_t _total_value_size;
+  // Maximum number of pending prefetch requests.
+  size_t _max_num_pending_prefetches;
+  // A load being executed by some thread.
+  struct LoadInFlight {
+    // Future result of the load, which is nullptr if the load is cancelled.
+    std::shared_future<Handle> Result;
+    // Token passed to LoadCancellable().
+    std::shared_ptr<CancellationToken> Token;
+    // Whether Get() is waiting for the load, which protects it from
+    // CancelPrefetches().
+    bool IsWaitedFor;
+  };
+  // Keys that are being loaded by some thread, mapped to their loads.
+  std::unordered_map<K, LoadInFlight, Hash> _loads_in_flight;
+  // Number of values that have been loaded and not yet destroyed, whether
+  // cached or only pinned by handles.
+  int _num_live_values;
+  // Requests waiting for a loader thread. Kept small by
+  // _max_num_pending_prefetches, so linear scans are fine.
+  std::vector<Request> _pending_requests;
+  // Sequence number for the next request.
+  uint64_t _next_request_sequence;
+  // Background loader threads.
+  std::vector<std::thread> _loader_threads;
+  // Set when the loader threads should exit.
+  bool _stopping;
+  // Condition variable used to signal Clear() that all loads are complete or
+  // all values have been destroyed.
   std::condition_variable _condition;
+  // Condition variable used to wake up loader threads.
+  std::condition_variable _loader_condition;
+
+  // Main loop of a loader thread.
+  void RunLoader();
+  // Loads a key that is neither cached nor being loaded, adds it to the cache
+  // unless token is cancelled by the end of the load, and fulfills the future
+  // that other threads may be waiting on. is_waited_for is true when called
+  // from Get(). If is_complete is not nullptr, it is set to whether the value
+  // was cached. Must be called with lock held; returns with lock released.
+  Handle LoadAndInsert(
+      const K& key, const std::shared_ptr<CancellationToken>& token,
+      bool is_waited_for, bool* is_complete,
+      std::unique_lock<std::mutex>* lock);
+  // Removes the pending prefetch request for a key, if any. Must be called
+  // with _mutex held.
+  void RemovePendingRequest(const K& key);
+  // Wraps a newly loaded value in a handle that calls Discard() when the last
+  // reference is released.
+  Handle NewHandle(const K& key, V&& value);
+  // Returns true if the cache holds too many entries or too large values.
+  // Must be called with _mutex held.
+  bool IsOverLimit() const;
 };
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  *                              Implementation                               *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-template <typename K, typename V>
-Cache<K, V>::Cache(int size)
-    : _size(size) {
+template <typename K, typename Hash>
+LRUCacheEvictionPolicy<K, Hash>::LRUCacheEvictionPolicy() {
+  _head.Key = nullptr;
+  _head.Prev = _head.Next = &_head;
+}
+
+template <typename K, typename Hash>
+void LRUCacheEvictionPolicy<K, Hash>::Insert(
+    const K& key, double /* cost */, size_t /* size */) {
+  auto result = _nodes.emplace(key, Node());
+  Node* node = &result.first->second;
+  if (result.second) {
+    node->Key = &result.first->first;
+  } else {
+    Unlink(node);
+  }
+  LinkFront(node);
 }
 
-template <typename K, typename V>
-Cache<K, V>::~Cache() {
+template <typename K, typename Hash>
+void LRUCacheEvictionPolicy<K, Hash>::Touch(const K& key) {
+  auto i = _nodes.find(key);
+  if (i != _nodes.end()) {
+    Unlink(&i->second);
+    LinkFront(&i->second);
+  }
 }
 
-template <typename K, typename V>
-V Cache<K, V>::Get(const K& key) {
-  for (;;) {
+template <typename K, typename Hash>
+K LRUCacheEvictionPolicy<K, Hash>::Evict() {
+  Node* node = _head.Prev;
+  assert(node != &_head);
+  const K key = *node->Key;
+  Unlink(node);
+  _nodes.erase(key);
+  return key;
+}
+
+template <typename K, typename Hash>
+void LRUCacheEvictionPolicy<K, Hash>::Clear() {
+  _nodes.clear();
+  _head.Prev = _head.Next = &_head;
+}
+
+template <typename K, typename Hash>
+void LRUCacheEvictionPolicy<K, Hash>::Unlink(Node* node) {
+  node->Prev->Next = node->Next;
+  node->Next->Prev = node->Prev;
+}
+
+template <typename K, typename Hash>
+void LRUCacheEvictionPolicy<K, Hash>::LinkFront(Node* node) {
+  node->Prev = &_head;
+  node->Next = _head.Next;
+  _head.Next->Prev = node;
+  _head.Next = node;
+}
+
+template <typename K, typename Hash>
+GDSFCacheEvictionPolicy<K, Hash>::GDSFCacheEvictionPolicy()
+    : _inflation(0.0), _last_inserted_key(nullptr) {}
+
+template <typename K, typename Hash>
+void GDSFCacheEvictionPolicy<K, Hash>::Insert(
+    const K& key, double cost, size_t size) {
+  auto result = _entries.emplace(key, Entry());
+  Entry* entry = &result.first->second;
+  if (result.second) {
+    entry->Frequency = 1;
+  } else {
+    _values.erase(entry->Position);
+    ++entry->Frequency;
+  }
+  entry->Cost = cost;
+  entry->Size = std::max<size_t>(size, 1);
+  _last_inserted_key = &result.first->first;
+  UpdatePosition(_last_inserted_key, entry);
+}
+
+template <typename K, typename Hash>
+void GDSFCacheEvictionPolicy<K, Hash>::Touch(const K& key) {
+  auto i = _entries.find(key);
+  if (i != _entries.end()) {
+    _values.erase(i->second.Position);
+    ++i->second.Frequency;
+    UpdatePosition(&i->first, &i->second);
+  }
+}
+
+template <typename K, typename Hash>
+K GDSFCacheEvictionPolicy<K, Hash>::Evict() {
+  assert(!_values.empty());
+  auto victim = _values.begin();
+  if ((victim->second == _last_inserted_key) && (_values.size() > 1)) {
+    ++victim;
+  }
+  _inflation = victim->first;
+  if (victim->second == _last_inserted_key) {
+    _last_inserted_key = nullptr;
+  }
+  const K key = *victim->second;
+  _values.erase(victim);
+  _entries.erase(key);
+  return key;
+}
+
+template <typename K, typename Hash>
+void GDSFCacheEvictionPolicy<K, Hash>::Clear() {
+  _values.clear();
+  _entries.clear();
+  _inflation = 0.0;
+  _last_inserted_key = nullptr;
+}
+
+template <typename K, typename Hash>
+void GDSFCacheEvictionPolicy<K, Hash>::UpdatePosition(
+    const K* key, Entry* entry) {
+  const double value =
+      _inflation + entry->Frequency * entry->Cost / entry->Size;
+  entry->Position = _values.emplace(value, key);
+}
+
+template <typename K, typename V, typename Hash>
+Cache<K, V, Hash>::Cache(
+    int size, int num_loader_threads,
+    std::unique_ptr<EvictionPolicy> eviction_policy)
+    : _eviction_policy(std::move(eviction_policy)),
+      _size(size),
+      _size_budget(0),
+      _total_value_size(0),
+      _max_num_pending_prefetches(DEFAULT_MAX_NUM_PENDING_PREFETCHES),
+      _num_live_values(0),
+      _next_request_sequence(0),
+      _stopping(false) {
+  assert(num_loader_threads > 0);
+  if (_eviction_policy == nullptr) {
+    _eviction_policy.reset(new LRUCacheEvictionPolicy<K, Hash>());
+  }
+  for (int i = 0; i < num_loader_threads; ++i) {
+    _loader_threads.push_back(std::thread(&Cache<K, V, Hash>::RunLoader, this));
+  }
+}
+
+template <typename K, typename V, typename Hash>
+Cache<K, V, Hash>::~Cache() {
+  {
     std::unique_lock<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _loader_condition.notify_all();
+  for (std::thread& loader_thread : _loader_threads) {
+    loader_thread.join();
+  }
+}
 
+template <typename K, typename V, typename Hash>
+typename Cache<K, V, Hash>::Handle Cache<K, V, Hash>::Get(const K& key) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (;;) {
     // 1. If key is already loaded, return the corresponding value.
     auto i = _map.find(key);
     if (i != _map.end()) {
-      return i->second;
+      _eviction_policy->Touch(key);
+      return i->second.Value;
     }
 
-    // 2. Otherwise, schedule loading and wait for a notification. Since the
-    // loading thread requires locking _mutex, it will not actually start
-    // running until after we release the lock in the following call to
-    // _condition.wait(). This is important because otherwise the loading might
-    // finish and notify before we start waiting, in which case we would end up
-    // waiting forever.
-    Prepare(key);
+    // 2. If another thread is loading key, wait for it. The result is
+    // returned even if it has been evicted in the meantime. If the load had
+    // already been cancelled, start over.
+    auto j = _loads_in_flight.find(key);
+    if (j != _loads_in_flight.end()) {
+      j->second.IsWaitedFor = true;
+      const std::shared_future<Handle> load = j->second.Result;
+      lock.unlock();
+      const Handle handle = load.get();
+      if (handle != nullptr) {
+        return handle;
+      }
+      lock.lock();
+      continue;
+    }
 
-    // 3. Wait for notification. This releases the mutex, which allows the
-    // loading thread to start.
-    _condition.wait(lock);
+    // 3. Otherwise, load it ourselves rather than wait for a loader thread,
+    // which may be busy with prefetches. A pending prefetch for the key is no
+    // longer needed.
+    RemovePendingRequest(key);
+    return LoadAndInsert(
+        key, std::make_shared<CancellationToken>(), true, nullptr, &lock);
   }
-
-  // 4. The notification could have come from the thread that is responsible
-  // for loading our key or another thread. Additionally, our key could have
-  // been evicted before we could acquire a lock and return its value. Either
-  // way, we go back to 1.
 }
 
-template <typename K, typename V>
-void Cache<K, V>::Prepare(const K& key) {
-  std::thread thread([=] (const K& key) {
-    {
-      std::unique_lock<std::mutex> lock(_mutex);
+template <typename K, typename V, typename Hash>
+typename Cache<K, V, Hash>::Handle Cache<K, V, Hash>::Get(
+    const K& key, CancellationToken::Clock::time_point deadline,
+    bool* is_complete) {
+  std::unique_lock<std::mutex> lock(_mutex);
 
-      // 1. If key is already in the cache or being loaded by another thread, no
-      // need to do extra work.
-      if (_map.count(key) || _work_set.count(key)) {
-        _condition.notify_all();
-        return;
-      }
-      // 2. Tell other threads we're going to load the key.
-      _work_set.insert(key);
+  // 1. If key is already loaded, return the corresponding value.
+  auto i = _map.find(key);
+  if (i != _map.end()) {
+    _eviction_policy->Touch(key);
+    *is_complete = true;
+    return i->second.Value;
+  }
+
+  // 2. If another thread is loading key, wait for it until deadline.
+  auto j = _loads_in_flight.find(key);
+  if (j != _loads_in_flight.end()) {
+    j->second.IsWaitedFor = true;
+    const std::shared_future<Handle> load = j->second.Result;
+    lock.unlock();
+    if (load.wait_until(deadline) != std::future_status::ready) {
+      *is_complete = false;
+      return Handle();
     }
+    const Handle handle = load.get();
+    *is_complete = (handle != nullptr);
+    return handle;
+  }
 
-    // 3. Do the actual loading.
-    V value = Load(key);
+  // 3. Otherwise, load it ourselves, and stop at deadline.
+  RemovePendingRequest(key);
+  return LoadAndInsert(
+      key, std::make_shared<CancellationToken>(deadline), true, is_complete,
+      &lock);
+}
 
-    {
-      std::unique_lock<std::mutex> lock(_mutex);
+template <typename K, typename V, typename Hash>
+typename Cache<K, V, Hash>::Handle Cache<K, V, Hash>::TryGet(const K& key) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  auto i = _map.find(key);
+  if (i == _map.end()) {
+    return Handle();
+  }
+  _eviction_policy->Touch(key);
+  return i->second.Value;
+}
 
-      // 4. Tell other threads we're done.
-      assert(_work_set.count(key));
-      _work_set.erase(key);
+template <typename K, typename V, typename Hash>
+void Cache<K, V, Hash>::Prepare(const K& key, int priority) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (_map.count(key) || _loads_in_flight.count(key)) {
+    return;
+  }
 
-      // 5. Add (key, value) to cache.
-      assert(!_map.count(key));
-      _map[key] = value;
+  // 1. Collapse with an existing request for the same key.
+  for (Request& request : _pending_requests) {
+    if (request.Key == key) {
+      request.Priority = std::min(request.Priority, priority);
+      request.Sequence = _next_request_sequence++;
+      _loader_condition.notify_one();
+      return;
+    }
+  }
 
-      // 6. Add key to queue.
-      _queue.push(key);
+  // 2. Add a new request.
+  _pending_requests.push_back({key, priority, _next_request_sequence++});
 
-      // 7. If the cache size is now too large, evict some entries in separate
-      // threads.
-      while (_queue.size() >= static_cast<size_t>(_size)) {
-        K evicted_key = _queue.front();
-        V evicted_value = _map[evicted_key];
+  // 3. If there are too many pending requests, drop the least urgent ones.
+  while (_pending_requests.size() > _max_num_pending_prefetches) {
+    auto least_urgent = _pending_requests.begin();
+    for (auto i = least_urgent; i != _pending_requests.end(); ++i) {
+      if (least_urgent->IsMoreUrgentThan(*i)) {
+        least_urgent = i;
+      }
+    }
+    _pending_requests.erase(least_urgent);
+  }
 
-        _map.erase(evicted_key);
-        _queue.pop();
+  _loader_condition.notify_one();
+}
 
-        std::thread eviction_thread([=] {
-          Discard(evicted_key, evicted_value);
-        });
-        eviction_thread.detach();
+template <typename K, typename V, typename Hash>
+void Cache<K, V, Hash>::CancelPrefetches(
+    const std::function<bool(const K&)>& is_wanted) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _pending_requests.erase(
+      std::remove_if(
+          _pending_requests.begin(), _pending_requests.end(),
+          [&is_wanted](const Request& request) {
+            return !is_wanted(request.Key);
+          }),
+      _pending_requests.end());
+  for (auto& load : _loads_in_flight) {
+    if (!load.second.IsWaitedFor && !is_wanted(load.first)) {
+      load.second.Token->Cancel();
+    }
+  }
+}
+
+template <typename K, typename V, typename Hash>
+void Cache<K, V, Hash>::RunLoader() {
+  for (;;) {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // 1. Wait for the most urgent pending request.
+    _loader_condition.wait(
+        lock, [this] { return _stopping || !_pending_requests.empty(); });
+    if (_stopping) {
+      return;
+    }
+    auto most_urgent = _pending_requests.begin();
+    for (auto i = most_urgent; i != _pending_requests.end(); ++i) {
+      if (i->IsMoreUrgentThan(*most_urgent)) {
+        most_urgent = i;
       }
     }
+    const K key = most_urgent->Key;
+    _pending_requests.erase(most_urgent);
 
-    // 8. Finally, let everyone know the cache was modified.
-    _condition.notify_all();
-  }, key);
+    // 2. If key is already in the cache or being loaded by another thread, no
+    // need to do extra work.
+    if (_map.count(key) || _loads_in_flight.count(key)) {
+      continue;
+    }
 
-  thread.detach();
+    // 3. Load it. A prefetch that fails is dropped; Get() will try again.
+    try {
+      LoadAndInsert(
+          key, std::make_shared<CancellationToken>(), false, nullptr, &lock);
+    } catch (...) {
+    }
+  }
 }
 
-template <typename K, typename V>
-int Cache<K, V>::GetSize() const {
-  return _size;
+template <typename K, typename V, typename Hash>
+typename Cache<K, V, Hash>::Handle Cache<K, V, Hash>::LoadAndInsert(
+    const K& key, const std::shared_ptr<CancellationToken>& token,
+    bool is_waited_for, bool* is_complete,
+    std::unique_lock<std::mutex>* lock) {
+  // 1. Tell other threads we're going to load the key, and do the actual
+  // loading without holding the lock. The time it takes is reported to the
+  // eviction policy as the cost of the entry. Whether the load was cancelled
+  // is decided once, right after it returns.
+  std::promise<Handle> promise;
+  _loads_in_flight[key] = {promise.get_future().share(), token, is_waited_for};
+  lock->unlock();
+  const auto load_start_time = std::chrono::steady_clock::now();
+  Handle handle;
+  size_t value_size;
+  try {
+    V value = LoadCancellable(key, *token);
+    value_size = GetValueSize(key, value);
+    handle = NewHandle(key, std::move(value));
+  } catch (...) {
+    // If the load fails, withdraw it so that Clear() does not wait for it,
+    // and wake up waiters with nullptr as if it had been cancelled, so they
+    // retry the load themselves.
+    lock->lock();
+    _loads_in_flight.erase(key);
+    const bool is_idle = _loads_in_flight.empty();
+    lock->unlock();
+    promise.set_value(Handle());
+    if (is_idle) {
+      _condition.notify_all();
+    }
+    throw;
+  }
+  const std::chrono::duration<double> load_time =
+      std::chrono::steady_clock::now() - load_start_time;
+  const bool is_cancelled = token->IsCancelled();
+  lock->lock();
+
+  std::vector<Handle> evicted_values;
+  if (!is_cancelled) {
+    // 2. Add (key, value) to cache, and let the eviction policy track it.
+    assert(!_map.count(key));
+    _map[key] = {handle, value_size};
+    _total_value_size += value_size;
+    _eviction_policy->Insert(key, load_time.count(), value_size);
+
+    // 3. If the cache is now too large, evict some entries. The eviction
+    // policy never picks the key we just loaded.
+    while ((_map.size() > 1) && IsOverLimit()) {
+      const K evicted_key = _eviction_policy->Evict();
+      assert(!(evicted_key == key));
+      auto i = _map.find(evicted_key);
+      assert(i != _map.end());
+      evicted_values.push_back(std::move(i->second.Value));
+      _total_value_size -= i->second.Size;
+      _map.erase(i);
+    }
+  }
+
+  // 4. Tell other threads we're done. Only threads waiting for this key are
+  // woken up. They get nullptr if the load was cancelled, since an incomplete
+  // value is only good enough for the thread that set the deadline.
+  assert(_loads_in_flight.count(key));
+  _loads_in_flight.erase(key);
+  const bool is_idle = _loads_in_flight.empty();
+  lock->unlock();
+  promise.set_value(is_cancelled ? Handle() : handle);
+  if (is_complete != nullptr) {
+    *is_complete = !is_cancelled;
+  }
+  if (is_idle) {
+    _condition.notify_all();
+  }
+
+  // 5. Release evicted values outside the lock. Unpinned values are
+  // discarded right away; pinned ones when their last handle is released.
+  evicted_values.clear();
+  return handle;
 }
 
-template <typename K, typename V>
-void Cache<K, V>::Clear() {
-  std::vector<std::thread> discard_threads;
+template <typename K, typename V, typename Hash>
+typename Cache<K, V, Hash>::Handle Cache<K, V, Hash>::NewHandle(
+    const K& key, V&& value) {
   {
     std::unique_lock<std::mutex> lock(_mutex);
-    // 1. Block until all ongoing loads are complete.
-    _condition.wait(lock, [=] { return _work_set.empty(); });
-    // 2. Clear queue.
-    while (_queue.size()) {
-      _queue.pop();
+    ++_num_live_values;
+  }
+  return Handle(new V(std::move(value)), [this, key](V* value) {
+    Discard(key, *value);
+    delete value;
+    bool is_last_value;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      is_last_value = (--_num_live_values == 0);
+    }
+    if (is_last_value) {
+      _condition.notify_all();
     }
-    // 3. Clear cache and start a thread to call Discard() on each entry.
-    for (auto& i : _map) {
-      K key = i.first;
-      V value = i.second;
-      discard_threads.push_back(std::thread([=] {
-        Discard(key, value);
-      }));
+  });
+}
+
+template <typename K, typename V, typename Hash>
+int Cache<K, V, Hash>::GetSize() const {
+  return _size;
+}
+
+template <typename K, typename V, typename Hash>
+void Cache<K, V, Hash>::SetSizeBudget(size_t size_budget) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _size_budget = size_budget;
+}
+
+template <typename K, typename V, typename Hash>
+size_t Cache<K, V, Hash>::GetSizeBudget() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  return _size_budget;
+}
+
+template <typename K, typename V, typename Hash>
+void Cache<K, V, Hash>::SetMaxNumPendingPrefetches(
+    int max_num_pending_prefetches) {
+  assert(max_num_pending_prefetches > 0);
+  std::unique_lock<std::mutex> lock(_mutex);
+  _max_num_pending_prefetches = max_num_pending_prefetches;
+}
+
+template <typename K, typename V, typename Hash>
+size_t Cache<K, V, Hash>::GetTotalValueSize() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  return _total_value_size;
+}
+
+template <typename K, typename V, typename Hash>
+bool Cache<K, V, Hash>::IsOverLimit() const {
+  return (_map.size() >= static_cast<size_t>(_size)) ||
+         ((_size_budget > 0) && (_total_value_size > _size_budget));
+}
+
+template <typename K, typename V, typename Hash>
+void Cache<K, V, Hash>::RemovePendingRequest(const K& key) {
+  for (auto i = _pending_requests.begin(); i != _pending_requests.end(); ++i) {
+    if (i->Key == key) {
+      _pending_requests.erase(i);
+      return;
     }
   }
-  // 4. Wait for all Discard() calls to complete.
-  for (std::thread& discard_thread : discard_threads) {
-    discard_thread.join();
+}
+
+template <typename K, typename V, typename Hash>
+V Cache<K, V, Hash>::LoadCancellable(
+    const K& key, const CancellationToken& /* token */) {
+  return Load(key);
+}
+
+template <typename K, typename V, typename Hash>
+void Cache<K, V, Hash>::Discard(const K& /* key */, const V& /* value */) {}
+
+template <typename K, typename V, typename Hash>
+size_t Cache<K, V, Hash>::GetValueSize(
+    const K& /* key */, const V& /* value */) const {
+  return 1;
+}
+
+template <typename K, typename V, typename Hash>
+void Cache<K, V, Hash>::Clear() {
+  std::vector<Handle> discarded_values;
+  std::unique_lock<std::mutex> lock(_mutex);
+  // 1. Drop pending requests, and block until all ongoing loads are complete.
+  _pending_requests.clear();
+  _condition.wait(lock, [this] { return _loads_in_flight.empty(); });
+  // 2. Reset eviction policy.
+  _eviction_policy->Clear();
+  // 3. Clear cache.
+  for (auto& entry : _map) {
+    discarded_values.push_back(std::move(entry.second.Value));
   }
+  _map.clear();
+  _total_value_size = 0;
+  // 4. Release the cached values outside the lock, which calls Discard() on
+  // each one that is not pinned.
+  lock.unlock();
+  discarded_values.clear();
+  // 5. Wait for pinned values to be released and discarded as well.
+  lock.lock();
+  _condition.wait(lock, [this] { return _num_live_values == 0; });
 }
 
 #endif
-
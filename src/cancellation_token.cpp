@@ -0,0 +1,55 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "cancellation_token.hpp"
+
+#include <algorithm>
+
+CancellationToken::CancellationToken()
+    : _is_cancelled(false), _has_deadline(false) {}
+
+CancellationToken::CancellationToken(Clock::time_point deadline)
+    : _is_cancelled(false), _has_deadline(true), _deadline(deadline) {}
+
+void CancellationToken::Cancel() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _is_cancelled = true;
+  for (int* flag : _watched_flags) {
+    *flag = 1;
+  }
+}
+
+bool CancellationToken::IsCancelled() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _is_cancelled || (_has_deadline && (Clock::now() >= _deadline));
+}
+
+void CancellationToken::Watch(int* flag) const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_is_cancelled || (_has_deadline && (Clock::now() >= _deadline))) {
+    *flag = 1;
+  }
+  _watched_flags.push_back(flag);
+}
+
+void CancellationToken::Unwatch(int* flag) const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _watched_flags.erase(
+      std::remove(_watched_flags.begin(), _watched_flags.end(), flag),
+      _watched_flags.end());
+}
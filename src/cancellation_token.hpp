@@ -0,0 +1,70 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file declares a token for asking long-running operations, such as
+// rendering a page, to stop early.
+
+#ifndef CANCELLATION_TOKEN_HPP
+#define CANCELLATION_TOKEN_HPP
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+// A token that an operation polls to find out whether it should stop. It is
+// cancelled either explicitly with Cancel(), which may be called from any
+// thread, or implicitly once an optional deadline has passed. Thread-safe.
+class CancellationToken {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Constructs a token that is not cancelled and has no deadline.
+  CancellationToken();
+  // Constructs a token that counts as cancelled once deadline has passed.
+  explicit CancellationToken(Clock::time_point deadline);
+  CancellationToken(const CancellationToken&) = delete;
+  CancellationToken& operator=(const CancellationToken&) = delete;
+
+  // Cancels the token, and sets all flags passed to Watch().
+  void Cancel();
+  // Returns whether Cancel() has been called or the deadline has passed.
+  bool IsCancelled() const;
+  // Sets *flag to 1 when Cancel() is called, or right away if the token is
+  // already cancelled, until the flag is passed to Unwatch(). This lets
+  // libraries that poll a plain flag, such as the abort field of MuPDF's
+  // fz_cookie, stop in the middle of an operation. The deadline is only
+  // checked by this method and IsCancelled().
+  void Watch(int* flag) const;
+  // Stops setting a flag passed to Watch().
+  void Unwatch(int* flag) const;
+
+ private:
+  // Lock guarding all members below.
+  mutable std::mutex _mutex;
+  // Whether Cancel() has been called.
+  bool _is_cancelled;
+  // Whether _deadline is valid.
+  bool _has_deadline;
+  // Time after which the token counts as cancelled.
+  Clock::time_point _deadline;
+  // Flags passed to Watch() and not yet to Unwatch(). Watching does not
+  // change the state of the token, so it is allowed on const tokens.
+  mutable std::vector<int*> _watched_flags;
+};
+
+#endif
@@ -0,0 +1,270 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file defines ColorTransform, which adjusts the colors of pixels as they
+// are copied to the screen.
+
+#include "color_transform.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+// Sepia tone matrix, indexed as [output channel][input channel].
+const float SEPIA_MATRIX[3][3] = {
+    {0.393f, 0.769f, 0.189f},
+    {0.349f, 0.686f, 0.168f},
+    {0.272f, 0.534f, 0.131f},
+};
+
+// Finds the offset and length of the contiguous run of bits in mask. Returns
+// false if mask is empty or its bits are not contiguous.
+bool GetBitField(uint32_t mask, int* offset, int* length) {
+  if (mask == 0) {
+    return false;
+  }
+  for (*offset = 0; !(mask & 1); mask >>= 1) {
+    ++*offset;
+  }
+  for (*length = 0; mask & 1; mask >>= 1) {
+    ++*length;
+  }
+  return mask == 0;
+}
+
+// Scales a channel value of length bits to 8 bits.
+int Expand(uint32_t value, int length) {
+  const uint32_t max_value = (1u << length) - 1;
+  return static_cast<int>((value * 255 + max_value / 2) / max_value);
+}
+
+// Scales an 8-bit channel value, clamped to [0, 255], to length bits.
+uint32_t Reduce(long value, int length) {
+  const uint32_t max_value = (1u << length) - 1;
+  const uint32_t clamped =
+      static_cast<uint32_t>(std::max(0L, std::min(255L, value)));
+  return (clamped * max_value + 127) / 255;
+}
+
+// Loads a pixel value of DEPTH bytes stored in native byte order.
+template <int DEPTH>
+inline uint32_t Load(const uint8_t* p) {
+  uint32_t value = 0;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  memcpy(reinterpret_cast<uint8_t*>(&value) + 4 - DEPTH, p, DEPTH);
+#else
+  memcpy(&value, p, DEPTH);
+#endif
+  return value;
+}
+
+// Stores a pixel value of DEPTH bytes in native byte order.
+template <int DEPTH>
+inline void Store(uint32_t value, uint8_t* p) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  memcpy(p, reinterpret_cast<const uint8_t*>(&value) + 4 - DEPTH, DEPTH);
+#else
+  memcpy(p, &value, DEPTH);
+#endif
+}
+
+// Replaces each of width pixel values of DEPTH bytes at src with f(value),
+// storing the results at dest.
+template <int DEPTH, typename F>
+void TransformRow(const uint8_t* src, int width, uint8_t* dest, const F& f) {
+  for (int x = 0; x < width; ++x, src += DEPTH, dest += DEPTH) {
+    Store<DEPTH>(f(Load<DEPTH>(src)), dest);
+  }
+}
+
+// Same as TransformRow(), with the depth given at run time.
+template <typename F>
+void TransformRow(
+    int depth, const uint8_t* src, int width, uint8_t* dest, const F& f) {
+  switch (depth) {
+    case 1:
+      TransformRow<1>(src, width, dest, f);
+      break;
+    case 2:
+      TransformRow<2>(src, width, dest, f);
+      break;
+    case 3:
+      TransformRow<3>(src, width, dest, f);
+      break;
+    case 4:
+      TransformRow<4>(src, width, dest, f);
+      break;
+    default:
+      assert(false);
+  }
+}
+
+}  // namespace
+
+ColorTransform::ColorTransform(
+    const PixelBuffer::Format* format, Mode mode, int brightness)
+    : _format(format),
+      _mode(mode),
+      _brightness(std::max(0, brightness)),
+      _kernel(COPY),
+      _depth(format->GetDepth()),
+      _other_bits(0),
+      _xor_mask(0) {
+  // 1. Find the channels of the format by packing pure colors. Formats we do
+  // not understand are left alone. Grey levels are treated as three identical
+  // channels, which sepia toning does not apply to.
+  Mode effective_mode = _mode;
+  if (format->GetLayout() == PixelLayout::GRAY8) {
+    for (int c = 0; c < NUM_CHANNELS; ++c) {
+      _offsets[c] = 0;
+      _lengths[c] = 8;
+    }
+    _xor_mask = UINT8_MAX;
+    if (effective_mode == SEPIA) {
+      effective_mode = NORMAL;
+    }
+  } else {
+    const uint32_t channel_masks[NUM_CHANNELS] = {
+        format->Pack(UINT8_MAX, 0, 0), format->Pack(0, UINT8_MAX, 0),
+        format->Pack(0, 0, UINT8_MAX)};
+    for (int c = 0; c < NUM_CHANNELS; ++c) {
+      if (!GetBitField(channel_masks[c], &_offsets[c], &_lengths[c]) ||
+          (_lengths[c] > 8)) {
+        return;
+      }
+      _xor_mask |= channel_masks[c];
+    }
+  }
+  _other_bits = ~_xor_mask;
+
+  // 2. Inverting alone flips all channel bits.
+  if (_brightness == DEFAULT_BRIGHTNESS) {
+    if (effective_mode == NORMAL) {
+      return;
+    } else if (effective_mode == INVERTED) {
+      _kernel = XOR;
+      return;
+    }
+  }
+
+  // 3. Build the tables. Sepia mixes channels, so the contributions of each
+  // input channel are summed before brightness is applied.
+  const float scale = static_cast<float>(_brightness) / DEFAULT_BRIGHTNESS;
+  if (effective_mode == SEPIA) {
+    _kernel = MIX_LUT;
+    for (int c = 0; c < NUM_CHANNELS; ++c) {
+      for (int i = 0; i < NUM_CHANNELS; ++i) {
+        _mix_luts[c][i].resize(1 << _lengths[i]);
+        for (size_t v = 0; v < _mix_luts[c][i].size(); ++v) {
+          _mix_luts[c][i][v] = static_cast<int32_t>(lroundf(
+              SEPIA_MATRIX[c][i] * Expand(v, _lengths[i]) *
+              (1 << MIX_FRACTION_BITS)));
+        }
+      }
+      _channel_luts[c].resize(UINT8_MAX + 1);
+      for (int v = 0; v <= UINT8_MAX; ++v) {
+        _channel_luts[c][v] = Reduce(lroundf(v * scale), _lengths[c])
+                              << _offsets[c];
+      }
+    }
+  } else {
+    _kernel = CHANNEL_LUT;
+    for (int c = 0; c < NUM_CHANNELS; ++c) {
+      _channel_luts[c].resize(1 << _lengths[c]);
+      for (size_t v = 0; v < _channel_luts[c].size(); ++v) {
+        int value = Expand(v, _lengths[c]);
+        if (effective_mode == INVERTED) {
+          value = UINT8_MAX - value;
+        }
+        _channel_luts[c][v] = Reduce(lroundf(value * scale), _lengths[c])
+                              << _offsets[c];
+      }
+    }
+  }
+
+  // 4. Pixels of up to 2 bytes are cheaper to look up whole.
+  if (_depth <= 2) {
+    _pixel_lut.resize(1 << (8 * _depth));
+    for (size_t v = 0; v < _pixel_lut.size(); ++v) {
+      _pixel_lut[v] = static_cast<uint16_t>(TransformPixel(v));
+    }
+    _kernel = PIXEL_LUT;
+  }
+}
+
+const PixelBuffer::Format* ColorTransform::GetFormat() const {
+  return _format;
+}
+
+ColorTransform::Mode ColorTransform::GetMode() const { return _mode; }
+
+int ColorTransform::GetBrightness() const { return _brightness; }
+
+bool ColorTransform::IsIdentity() const { return _kernel == COPY; }
+
+void ColorTransform::Apply(const uint8_t* src, int width, uint8_t* dest) const {
+  switch (_kernel) {
+    case COPY:
+      if (src != dest) {
+        memcpy(dest, src, width * _depth);
+      }
+      break;
+    case XOR:
+      TransformRow(_depth, src, width, dest, [this](uint32_t value) {
+        return value ^ _xor_mask;
+      });
+      break;
+    case PIXEL_LUT:
+      TransformRow(_depth, src, width, dest, [this](uint32_t value) {
+        return static_cast<uint32_t>(_pixel_lut[value]);
+      });
+      break;
+    case CHANNEL_LUT:
+    case MIX_LUT:
+      TransformRow(_depth, src, width, dest, [this](uint32_t value) {
+        return TransformPixel(value);
+      });
+      break;
+  }
+}
+
+uint32_t ColorTransform::TransformPixel(uint32_t value) const {
+  uint32_t channels[NUM_CHANNELS];
+  for (int c = 0; c < NUM_CHANNELS; ++c) {
+    channels[c] = (value >> _offsets[c]) & ((1u << _lengths[c]) - 1);
+  }
+  uint32_t result = value & _other_bits;
+  if (_kernel == MIX_LUT) {
+    for (int c = 0; c < NUM_CHANNELS; ++c) {
+      const int32_t sum = _mix_luts[c][0][channels[0]] +
+                          _mix_luts[c][1][channels[1]] +
+                          _mix_luts[c][2][channels[2]] +
+                          (1 << (MIX_FRACTION_BITS - 1));
+      result |= _channel_luts[c][std::min<int32_t>(
+          UINT8_MAX, sum >> MIX_FRACTION_BITS)];
+    }
+  } else {
+    for (int c = 0; c < NUM_CHANNELS; ++c) {
+      result |= _channel_luts[c][channels[c]];
+    }
+  }
+  return result;
+}
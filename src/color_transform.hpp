@@ -0,0 +1,110 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file declares ColorTransform, which adjusts the colors of pixels as
+// they are copied to the screen.
+
+#ifndef COLOR_TRANSFORM_HPP
+#define COLOR_TRANSFORM_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "pixel_buffer.hpp"
+
+// Adjusts the colors of packed pixel values, such as when a cached page is
+// blitted to the screen. All the work happens in table lookups computed at
+// construction, so transforms are cheap to apply but not to build.
+class ColorTransform {
+ public:
+  // Color effects.
+  enum Mode {
+    NORMAL,
+    INVERTED,
+    SEPIA,
+  };
+  // Brightness that leaves colors unchanged, in percent.
+  enum { DEFAULT_BRIGHTNESS = 100 };
+
+  // Constructs a transform that applies mode, then scales channels by
+  // brightness percent, to pixels in format. Does NOT take ownership of
+  // format. Formats with channels of more than 8 bits are left unchanged.
+  ColorTransform(
+      const PixelBuffer::Format* format, Mode mode,
+      int brightness = DEFAULT_BRIGHTNESS);
+
+  // Returns the parameters this transform was constructed with.
+  const PixelBuffer::Format* GetFormat() const;
+  Mode GetMode() const;
+  int GetBrightness() const;
+  // Returns whether Apply() simply copies pixels.
+  bool IsIdentity() const;
+
+  // Transforms width pixels at src and stores them at dest. src and dest may
+  // be the same, but must not otherwise overlap. Thread-safe.
+  void Apply(const uint8_t* src, int width, uint8_t* dest) const;
+
+ private:
+  // How Apply() transforms pixels.
+  enum Kernel {
+    // Copy pixels unchanged.
+    COPY,
+    // XOR pixels with _xor_mask, which inverts all channels.
+    XOR,
+    // Look up each whole pixel value in _pixel_lut. Used for depths of up to 2
+    // bytes.
+    PIXEL_LUT,
+    // Look up each channel in _channel_luts.
+    CHANNEL_LUT,
+    // Sum per channel contributions from _mix_luts, then look up the sums in
+    // _channel_luts.
+    MIX_LUT,
+  };
+  // Number of color channels.
+  enum { NUM_CHANNELS = 3 };
+  // Number of fractional bits in _mix_luts entries.
+  enum { MIX_FRACTION_BITS = 8 };
+
+  const PixelBuffer::Format* _format;
+  Mode _mode;
+  int _brightness;
+  Kernel _kernel;
+  // Pixel size in bytes.
+  int _depth;
+  // Bit offset and length of each channel in a pixel value.
+  int _offsets[NUM_CHANNELS];
+  int _lengths[NUM_CHANNELS];
+  // Bits of a pixel value that do not belong to any channel. These are kept.
+  uint32_t _other_bits;
+  // Bits of all channels.
+  uint32_t _xor_mask;
+  // Transformed pixel value for each pixel value.
+  std::vector<uint16_t> _pixel_lut;
+  // For CHANNEL_LUT, the transformed channel value, shifted into place, for
+  // each channel value. For MIX_LUT, the same for each mixed 8-bit value.
+  std::vector<uint32_t> _channel_luts[NUM_CHANNELS];
+  // Contribution of each channel value to each output channel, in fixed
+  // point with MIX_FRACTION_BITS fractional bits, indexed as
+  // [output channel][input channel][input value].
+  std::vector<int32_t> _mix_luts[NUM_CHANNELS][NUM_CHANNELS];
+
+  // Transforms a single pixel value with the channel or mix tables.
+  uint32_t TransformPixel(uint32_t value) const;
+};
+
+#endif
@@ -24,6 +24,23 @@
 
 Document::~Document() { }
 
+void Document::PixelWriter::WriteRow(int y, const uint8_t* rgba, int width) {
+  for (int x = 0; x < width; ++x, rgba += 4) {
+    Write(x, y, rgba[0], rgba[1], rgba[2]);
+  }
+}
+
+bool Document::PixelWriter::GetDirectBuffer(DirectBuffer* /* buffer */) {
+  return false;
+}
+
+void Document::Render(PixelWriter* pw, int page, float zoom, int rotation) {
+  const PageSize page_size = GetPageSize(page, zoom, rotation);
+  Render(
+      pw, page, zoom, rotation,
+      PageRect(0, 0, page_size.Width, page_size.Height), BEST, nullptr);
+}
+
 Document::OutlineItem::~OutlineItem() {
 }
 
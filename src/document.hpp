@@ -26,6 +26,8 @@
 #include <string>
 #include <vector>
 
+class CancellationToken;
+
 // An abstraction for a document.
 class Document {
  public:
@@ -37,6 +39,26 @@ class Document {
     explicit PageSize(int width = -1, int height = -1)
         : Width(width), Height(height) {}
   };
+  // A rectangular region of a rendered page, in pixels from its top-left
+  // corner.
+  struct PageRect {
+    int X, Y;
+    int Width, Height;
+
+    explicit PageRect(int x = 0, int y = 0, int width = 0, int height = 0)
+        : X(x), Y(y), Width(width), Height(height) {}
+  };
+
+  // Trade-offs between rendering speed and quality.
+  enum Quality {
+    // No anti-aliasing, color management or image interpolation.
+    FAST,
+    // Anti-aliased text, less anti-aliasing of graphics, and no color
+    // management.
+    NORMAL,
+    // The renderer's defaults, which favor quality.
+    BEST,
+  };
 
   // An interface for a callback that stores a pixel in a memory buffer.
   class PixelWriter {
@@ -44,6 +66,29 @@ class Document {
     // Writes a pixel value (r, g, b) to position (x, y). It is important that
     // Write be thread-safe when called with different (x, y).
     virtual void Write(int x, int y, uint8_t r, uint8_t g, uint8_t b) = 0;
+    // Writes width pixels to positions (0, y) through (width - 1, y). rgba
+    // holds 4 bytes per pixel in the order r, g, b, and an ignored byte. Like
+    // Write, this must be thread-safe when called with different y. The
+    // default implementation calls Write for each pixel; writers should
+    // override it, as backends write whole rows at a time.
+    virtual void WriteRow(int y, const uint8_t* rgba, int width);
+
+    // Memory that a backend may render pixels into directly, instead of
+    // calling Write or WriteRow.
+    struct DirectBuffer {
+      // Order of bytes within a pixel. The fourth byte of RGBX and BGRX is
+      // not a color channel, and may be overwritten with any value.
+      enum Format { RGBX, BGRX, GRAY };
+      Format PixelFormat;
+      // Pixels of the first row. Rows follow each other without padding.
+      uint8_t* Data;
+      // Size of the buffer in pixels.
+      int Width, Height;
+    };
+    // Fills in buffer and returns true if pixels can be stored directly in
+    // memory in one of the formats above. The default implementation returns
+    // false.
+    virtual bool GetDirectBuffer(DirectBuffer* buffer);
   };
 
   // An item in a outline. An item may contain further children items.
@@ -102,8 +147,18 @@ class Document {
   // Renders the given page to a buffer. Page numbers are 0-based. zoom gives
   // the zoom ratio as a fraction, e.g., 1.5 = 150%. rotation is the desired
   // rotation in clockwise degrees. For every rendered pixel, pw will be invoked
-  // to store that pixel value somewhere.
-  virtual void Render(PixelWriter* pw, int page, float zoom, int rotation) = 0;
+  // to store that pixel value somewhere. The page is rendered at BEST quality.
+  void Render(PixelWriter* pw, int page, float zoom, int rotation);
+  // Same as above, but only renders the pixels within region of the rendered
+  // page, which must lie within GetPageSize(). Pixels are passed to pw with
+  // coordinates relative to the top-left corner of region. Backends that do
+  // not support lower qualities ignore quality. If token is not nullptr,
+  // backends that support it stop early once it is cancelled, and leave the
+  // pixels they did not get to white.
+  virtual void Render(
+      PixelWriter* pw, int page, float zoom, int rotation,
+      const PageRect& region, Quality quality,
+      const CancellationToken* token) = 0;
 
   // Returns the outline of this document. The returned item represents the
   // top-level element in the outline, and is owned by the caller. If the
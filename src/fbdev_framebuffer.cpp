@@ -0,0 +1,307 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file implements the framebuffer backed by a Linux framebuffer device.
+
+#include "fbdev_framebuffer.hpp"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "file_utils.hpp"
+#include "multithreading.hpp"
+
+namespace {
+
+// First line of write settings files. The version number must be bumped
+// whenever the format changes.
+const char* const WRITE_SETTINGS_FILE_HEADER =
+    "jfbview framebuffer write settings 1\n";
+
+// Numbers of rows per thread chunk tried when timing writes.
+const int CANDIDATE_NUM_ROWS_PER_CHUNK[] = {8, 32, 128};
+
+// Number of times each candidate write settings are timed. The fastest run
+// counts, which filters out interruptions.
+const int NUM_TIMING_RUNS = 5;
+
+// Returns the time it takes to copy src over dest with the given settings.
+double TimeCopy(
+    const PixelBuffer& src, PixelBuffer* dest,
+    const PixelBuffer::WriteSettings& settings) {
+  dest->SetWriteSettings(settings);
+  double best_time = 0.0;
+  for (int i = 0; i < NUM_TIMING_RUNS; ++i) {
+    const auto start_time = std::chrono::steady_clock::now();
+    src.Copy(src.GetRect(), dest->GetRect(), dest);
+    const std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start_time;
+    if ((i == 0) || (time.count() < best_time)) {
+      best_time = time.count();
+    }
+  }
+  return best_time;
+}
+
+}  // namespace
+
+FbdevFramebuffer* FbdevFramebuffer::Open(
+    const std::string& device, int rotation, bool double_buffered) {
+  std::unique_ptr<FbdevFramebuffer> fb(new FbdevFramebuffer(device, rotation));
+
+  if ((fb->_fd = open(device.c_str(), O_RDWR)) == -1) {
+    goto error;
+  }
+  if ((ioctl(fb->_fd, FBIOGET_VSCREENINFO, &(fb->_vinfo)) == -1) ||
+      (ioctl(fb->_fd, FBIOGET_FSCREENINFO, &(fb->_finfo)) == -1)) {
+    goto error;
+  }
+  fb->_original_vinfo = fb->_vinfo;
+  if (double_buffered) {
+    fb->_is_double_buffered = fb->EnableDoubleBuffering();
+  }
+  fb->_buffer = reinterpret_cast<uint8_t*>(mmap(
+      nullptr, fb->GetBufferByteSize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+      fb->_fd, 0));
+  if (fb->_buffer == MAP_FAILED) {
+    goto error;
+  }
+
+  fb->InitPages(
+      fb->_buffer, fb->_finfo.line_length,
+      fb->_finfo.smem_len / fb->_finfo.line_length);
+  return fb.release();
+
+error:
+  perror(("Error initializing framebuffer device \"" + device + "\"").c_str());
+  return nullptr;
+}
+
+FbdevFramebuffer::FbdevFramebuffer(const std::string& device, int rotation)
+    : Framebuffer(rotation), _device(device), _fd(-1), _buffer(nullptr) {}
+
+FbdevFramebuffer::~FbdevFramebuffer() {
+  if (_buffer != nullptr && _buffer != MAP_FAILED) {
+    memset(_buffer, 0, GetBufferByteSize());
+    munmap(_buffer, GetBufferByteSize());
+  }
+  if (_is_double_buffered) {
+    ioctl(_fd, FBIOPUT_VSCREENINFO, &_original_vinfo);
+  }
+  if (_fd != -1) {
+    close(_fd);
+  }
+}
+
+std::string FbdevFramebuffer::GetDebugInfoString() {
+  std::ostringstream out;
+
+  out << "Device:\t\t\t" << _device << std::endl;
+  out << "Visible resolution:\t" << _vinfo.xres << " x " << _vinfo.yres
+      << std::endl;
+  out << "Virtual resolution:\t" << _vinfo.xres_virtual << " x "
+      << _vinfo.yres_virtual << std::endl;
+  out << "Offset:\t\t\t" << _vinfo.xoffset << ", " << _vinfo.yoffset
+      << std::endl;
+  out << "Rotation:\t\t" << _rotation << std::endl;
+  out << "Double buffered:\t" << (_is_double_buffered ? "yes" : "no")
+      << std::endl;
+  out << "Buffer size:\t\t" << (_finfo.smem_len / _format->GetDepth()) << " ("
+      << _finfo.smem_len << " bytes)" << std::endl;
+  out << "Buffer width:\t\t" << (_finfo.line_length / _format->GetDepth())
+      << " (" << _finfo.line_length << " bytes)" << std::endl;
+  out << "Buffer height:\t\t" << (_finfo.smem_len / _finfo.line_length)
+      << std::endl;
+  out << "Bits per pixel:\t\t" << _vinfo.bits_per_pixel << std::endl;
+  out << "Bit depth:\t\t" << _format->GetDepth() << std::endl;
+  out << "Red:\t\t\t"
+      << "length " << _vinfo.red.length << ", offset " << _vinfo.red.offset
+      << std::endl;
+  out << "Green:\t\t\t"
+      << "length " << _vinfo.green.length << ", offset " << _vinfo.green.offset
+      << std::endl;
+  out << "Blue:\t\t\t"
+      << "length " << _vinfo.blue.length << ", offset " << _vinfo.blue.offset
+      << std::endl;
+  out << "Non-std pixel format:\t" << _vinfo.nonstd << std::endl;
+  const PixelBuffer::WriteSettings& write_settings =
+      _pages[0]->GetWriteSettings();
+  out << "Write threads:\t\t" << write_settings.NumThreads << std::endl;
+  out << "Write chunk size:\t" << write_settings.NumRowsPerChunk << " rows"
+      << std::endl;
+  out << "Streaming stores:\t"
+      << (write_settings.UseStreamingStores ? "yes" : "no") << std::endl;
+
+  return out.str();
+}
+
+int FbdevFramebuffer::GetBufferByteSize() const { return _finfo.smem_len; }
+
+bool FbdevFramebuffer::ShowPage(int index) {
+  // 1. Wait for the next vertical blank, so that the flip does not happen
+  // halfway through a scan. Drivers that do not support this return an error,
+  // which is fine; many of them flip on vertical blank anyway.
+  uint32_t crtc = 0;
+  ioctl(_fd, FBIO_WAITFORVSYNC, &crtc);
+
+  // 2. Pan to the page.
+  fb_var_screeninfo vinfo = _vinfo;
+  vinfo.yoffset = index * _vinfo.yres;
+  if (ioctl(_fd, FBIOPAN_DISPLAY, &vinfo) == -1) {
+    return false;
+  }
+  _vinfo.yoffset = vinfo.yoffset;
+  return true;
+}
+
+bool FbdevFramebuffer::EnableDoubleBuffering() {
+  // 1. Ask for a virtual resolution twice the height of the screen, unless we
+  // already have that.
+  if (_vinfo.yres_virtual < 2 * _vinfo.yres) {
+    fb_var_screeninfo vinfo = _vinfo;
+    vinfo.yres_virtual = 2 * _vinfo.yres;
+    if ((ioctl(_fd, FBIOPUT_VSCREENINFO, &vinfo) == -1) ||
+        (ioctl(_fd, FBIOGET_VSCREENINFO, &_vinfo) == -1) ||
+        (ioctl(_fd, FBIOGET_FSCREENINFO, &_finfo) == -1)) {
+      _vinfo = _original_vinfo;
+      return false;
+    }
+  }
+
+  // 2. Make sure both screens fit in the mapped memory, then show the first
+  // one.
+  fb_var_screeninfo vinfo = _vinfo;
+  vinfo.yoffset = 0;
+  if ((_vinfo.yres_virtual < 2 * _vinfo.yres) ||
+      (_finfo.smem_len <
+       static_cast<size_t>(_finfo.line_length) * 2 * _vinfo.yres) ||
+      (ioctl(_fd, FBIOPAN_DISPLAY, &vinfo) == -1)) {
+    ioctl(_fd, FBIOPUT_VSCREENINFO, &_original_vinfo);
+    ioctl(_fd, FBIOGET_VSCREENINFO, &_vinfo);
+    ioctl(_fd, FBIOGET_FSCREENINFO, &_finfo);
+    return false;
+  }
+  _vinfo.yoffset = 0;
+  return true;
+}
+
+void FbdevFramebuffer::TuneWrites() {
+  PixelBuffer::WriteSettings settings;
+  bool is_known = false;
+
+  // 1. Load saved settings.
+  const std::string key = GetWriteSettingsKey();
+  const std::string prefix = WRITE_SETTINGS_FILE_HEADER + key;
+  std::string file_path, contents;
+  const std::string cache_dir = GetCacheDir();
+  if (!cache_dir.empty()) {
+    char file_name[64];
+    snprintf(
+        file_name, sizeof(file_name), "fb_write_settings_%016zx",
+        std::hash<std::string>()(key));
+    file_path = cache_dir + "/" + file_name;
+    int use_streaming_stores;
+    is_known = ReadFile(file_path, &contents) &&
+               (contents.compare(0, prefix.length(), prefix) == 0) &&
+               (sscanf(
+                    contents.c_str() + prefix.length(), "%d %d %d",
+                    &settings.NumThreads, &settings.NumRowsPerChunk,
+                    &use_streaming_stores) == 3);
+    settings.UseStreamingStores = is_known && use_streaming_stores;
+  }
+
+  // 2. Otherwise, time copies of a black screen with every combination of
+  // thread count, chunk size and store kind, and keep the fastest. Timing
+  // happens on the page not shown if there is one. Otherwise it happens on an
+  // offscreen buffer in ordinary memory, which is only an approximation of
+  // the device but leaves the screen alone.
+  if (!is_known) {
+    std::vector<int> candidate_num_threads;
+    for (int num_threads = 1; num_threads < GetNumThreads(); num_threads *= 2) {
+      candidate_num_threads.push_back(num_threads);
+    }
+    candidate_num_threads.push_back(GetNumThreads());
+    std::unique_ptr<PixelBuffer> offscreen_page;
+    PixelBuffer* page = _pages[1].get();
+    if (page == nullptr) {
+      offscreen_page.reset(NewPixelBuffer(_pages[0]->GetSize()));
+      page = offscreen_page.get();
+    }
+    std::unique_ptr<PixelBuffer> black_screen(
+        NewPixelBuffer(page->GetSize()));
+    black_screen->Clear(black_screen->GetRect());
+    double best_time = 0.0;
+    for (int num_threads : candidate_num_threads) {
+      for (int num_rows_per_chunk : CANDIDATE_NUM_ROWS_PER_CHUNK) {
+        for (bool use_streaming_stores : {false, true}) {
+          if (use_streaming_stores &&
+              !PixelBuffer::SupportsStreamingStores()) {
+            continue;
+          }
+          const PixelBuffer::WriteSettings candidate(
+              num_threads, num_rows_per_chunk, use_streaming_stores);
+          const double time = TimeCopy(*black_screen, page, candidate);
+          if (!is_known || (time < best_time)) {
+            settings = candidate;
+            best_time = time;
+            is_known = true;
+          }
+        }
+      }
+    }
+    if (!file_path.empty()) {
+      char line[64];
+      snprintf(
+          line, sizeof(line), "%d %d %d\n", settings.NumThreads,
+          settings.NumRowsPerChunk, settings.UseStreamingStores ? 1 : 0);
+      WriteFileAtomically(file_path, prefix + line);
+    }
+  }
+
+  // 3. Apply the settings to all pages.
+  for (const std::unique_ptr<PixelBuffer>& page : _pages) {
+    if (page != nullptr) {
+      page->SetWriteSettings(settings);
+    }
+  }
+}
+
+std::string FbdevFramebuffer::GetWriteSettingsKey() const {
+  // Write speed depends on the device, the screen mode, and the threads
+  // available to write with. Settings timed offscreen are kept apart from
+  // those timed on the device.
+  std::ostringstream out;
+  out << _device << "\n"
+      << std::string(_finfo.id, strnlen(_finfo.id, sizeof(_finfo.id))) << " "
+      << _vinfo.xres << "x" << _vinfo.yres << " " << _vinfo.bits_per_pixel
+      << " " << _finfo.line_length << " " << GetNumThreads() << " "
+      << (_is_double_buffered ? "device" : "offscreen") << "\n";
+  return out.str();
+}
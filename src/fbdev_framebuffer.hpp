@@ -0,0 +1,79 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file declares the framebuffer backed by a Linux framebuffer device.
+
+#ifndef FBDEV_FRAMEBUFFER_HPP
+#define FBDEV_FRAMEBUFFER_HPP
+
+#include <linux/fb.h>
+
+#include <cstdint>
+#include <string>
+
+#include "framebuffer.hpp"
+
+// A framebuffer that draws on a Linux framebuffer device, such as /dev/fb0.
+class FbdevFramebuffer : public Framebuffer {
+ public:
+  // Factory method to initialize a framebuffer device. Returns nullptr if the
+  // initialization failed. Caller owns returned object. See
+  // Framebuffer::Open() for the arguments.
+  static FbdevFramebuffer* Open(
+      const std::string& device, int rotation, bool double_buffered);
+  virtual ~FbdevFramebuffer();
+
+  // See Framebuffer.
+  std::string GetDebugInfoString() override;
+  // Sets up how pages are written to: with the settings saved for this device
+  // and screen mode if there are any, or else with the fastest ones found by
+  // timing writes, which are then saved. Writes are timed on the page not
+  // shown if there is one, and otherwise on an offscreen buffer, so nothing
+  // flickers on screen.
+  void TuneWrites() override;
+
+ protected:
+  // See Framebuffer.
+  bool ShowPage(int index) override;
+
+ private:
+  // The framebuffer device.
+  const std::string _device;
+  // File descriptor of the opened framebuffer device.
+  int _fd;
+  // Framebuffer info structure.
+  fb_fix_screeninfo _finfo;
+  // Screen info before we changed it, restored on exit.
+  fb_var_screeninfo _original_vinfo;
+  // mmap'd buffer.
+  uint8_t* _buffer;
+
+  // Contructors are disallowed. Use factory method Open() instead.
+  FbdevFramebuffer(const std::string& device, int rotation);
+
+  // Returns the size of the mmap'd buffer in bytes.
+  int GetBufferByteSize() const;
+  // Sets up a virtual resolution that fits two screens, and shows the first.
+  // Returns false, leaving the screen as it was, if the device cannot do it.
+  bool EnableDoubleBuffering();
+  // Returns the key identifying this device and screen mode in saved write
+  // settings.
+  std::string GetWriteSettingsKey() const;
+};
+
+#endif
@@ -0,0 +1,94 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// A collection of file system utilities.
+
+#include "file_utils.hpp"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace {
+
+// Name of jfbview's subdirectory in the cache directory.
+const char* const CACHE_DIR_NAME = "jfbview";
+
+// Creates a directory if it does not already exist. Returns false on failure.
+bool MakeDir(const std::string& path) {
+  return (mkdir(path.c_str(), 0700) == 0) || (errno == EEXIST);
+}
+
+}  // namespace
+
+std::string GetCacheDir() {
+  std::string base_dir;
+  const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+  if ((xdg_cache_home != nullptr) && (*xdg_cache_home != '\0')) {
+    base_dir = xdg_cache_home;
+  } else {
+    const char* home = getenv("HOME");
+    if ((home == nullptr) || (*home == '\0')) {
+      return "";
+    }
+    base_dir = std::string(home) + "/.cache";
+  }
+  const std::string cache_dir = base_dir + "/" + CACHE_DIR_NAME;
+  if (!MakeDir(base_dir) || !MakeDir(cache_dir)) {
+    return "";
+  }
+  return cache_dir;
+}
+
+bool ReadFile(const std::string& path, std::string* contents) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  contents->clear();
+  char buffer[4096];
+  size_t num_bytes_read;
+  while ((num_bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    contents->append(buffer, num_bytes_read);
+  }
+  const bool success = !ferror(file);
+  fclose(file);
+  return success;
+}
+
+bool WriteFileAtomically(
+    const std::string& path, const std::string& contents) {
+  // The process ID keeps concurrent writers from sharing a temporary file.
+  const std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  const bool write_succeeded =
+      fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+  if ((fclose(file) != 0) || !write_succeeded ||
+      (rename(tmp_path.c_str(), path.c_str()) != 0)) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
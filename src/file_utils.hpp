@@ -0,0 +1,40 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// A collection of file system utilities.
+
+#ifndef FILE_UTILS_HPP
+#define FILE_UTILS_HPP
+
+#include <string>
+
+// Returns the directory for data that jfbview keeps across runs, creating it
+// if needed. This is $XDG_CACHE_HOME/jfbview, or ~/.cache/jfbview if
+// XDG_CACHE_HOME is not set. Returns the empty string on failure.
+extern std::string GetCacheDir();
+
+// Reads the entire content of a file into contents. Returns false on failure.
+extern bool ReadFile(const std::string& path, std::string* contents);
+
+// Replaces the content of a file. The new content is written to a temporary
+// file first and renamed into place, so that readers never see a partially
+// written file. Returns false on failure.
+extern bool WriteFileAtomically(
+    const std::string& path, const std::string& contents);
+
+#endif
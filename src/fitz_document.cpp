@@ -21,18 +21,128 @@
 
 #include "fitz_document.hpp"
 
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <cassert>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
 
+#include "cancellation_token.hpp"
+#include "file_utils.hpp"
 #include "multithreading.hpp"
 #include "string_utils.hpp"
 
+namespace {
+
+// Number of pixmap rows drawn at a time by Render(). Bands this size are
+// small enough for a scratch pixmap per thread, and large enough that
+// replaying the display list for each band is cheap.
+const int NUM_ROWS_PER_BAND = 64;
+
+// Number of anti-aliasing bits, which MuPDF uses by default for both text and
+// graphics.
+const int MAX_AA_BITS = 8;
+// Number of anti-aliasing bits for graphics at NORMAL quality.
+const int NORMAL_QUALITY_GRAPHICS_AA_BITS = 4;
+
+// Number of loader threads for the display list cache. Display lists are only
+// requested by Render(), which never prefetches, so one is plenty.
+const int DISPLAY_LIST_CACHE_NUM_LOADER_THREADS = 1;
+
+// Number of loader threads for the page cache. Loading pages requires the
+// document lock, so more would not help.
+const int PAGE_CACHE_NUM_LOADER_THREADS = 1;
+
+// Prefetch priorities for the pages following and preceding a requested page.
+const int NEXT_PAGE_PREFETCH_PRIORITY = 1;
+const int PREVIOUS_PAGE_PREFETCH_PRIORITY = 2;
+
+// Documents with at least this many pages have their page bounds saved in
+// the cache directory, so that they need not be measured again.
+const int MIN_NUM_PAGES_TO_SAVE_PAGE_BOUNDS = 100;
+
+// First line of page bounds files. The version number must be bumped whenever
+// the format changes.
+const char* const PAGE_BOUNDS_FILE_HEADER = "jfbview page bounds 1\n";
+
+// Warning callback that discards messages.
+void IgnoreWarning(void* /* user */, const char* /* message */) {}
+
+// Determines where the page bounds of a document should be saved, and a key
+// identifying the current version of the document. Returns false if the
+// bounds should not be saved.
+bool GetPageBoundsFile(
+    const std::string& path, int num_pages, std::string* file_path,
+    std::string* key) {
+  // 1. Only bother for large documents.
+  if (num_pages < MIN_NUM_PAGES_TO_SAVE_PAGE_BOUNDS) {
+    return false;
+  }
+
+  // 2. Identify the document by its absolute path, size and modification
+  // time, so that the saved bounds are discarded when the file changes.
+  char real_path[PATH_MAX];
+  struct stat file_stat;
+  if ((realpath(path.c_str(), real_path) == nullptr) ||
+      (stat(real_path, &file_stat) != 0)) {
+    return false;
+  }
+  *key = std::string(real_path) + "\n" + std::to_string(file_stat.st_size) +
+         " " + std::to_string(file_stat.st_mtime) + " " +
+         std::to_string(num_pages) + "\n";
+
+  // 3. Name the file after a hash of the path.
+  const std::string cache_dir = GetCacheDir();
+  if (cache_dir.empty()) {
+    return false;
+  }
+  char file_name[64];
+  snprintf(
+      file_name, sizeof(file_name), "page_bounds_%016zx",
+      std::hash<std::string>()(real_path));
+  *file_path = cache_dir + "/" + file_name;
+  return true;
+}
+
+// Configures a context for rendering at the given quality. Contexts are
+// reused across renders, so every setting is made each time. Image
+// interpolation is a setting of draw devices rather than contexts, so FAST
+// turns it off in FitzDocument::Render() on each band's device.
+void SetRenderQuality(fz_context* ctx, Document::Quality quality) {
+  switch (quality) {
+    case Document::FAST:
+      fz_set_text_aa_level(ctx, 0);
+      fz_set_graphics_aa_level(ctx, 0);
+      fz_disable_icc(ctx);
+      break;
+    case Document::NORMAL:
+      fz_set_text_aa_level(ctx, MAX_AA_BITS);
+      fz_set_graphics_aa_level(ctx, NORMAL_QUALITY_GRAPHICS_AA_BITS);
+      fz_disable_icc(ctx);
+      break;
+    default:
+      fz_set_text_aa_level(ctx, MAX_AA_BITS);
+      fz_set_graphics_aa_level(ctx, MAX_AA_BITS);
+      fz_enable_icc(ctx);
+      break;
+  }
+}
+
+}  // namespace
+
 FitzDocument* FitzDocument::Open(
-    const std::string& path, const std::string* password) {
-  fz_context* fz_ctx = fz_new_context(nullptr, nullptr, FZ_STORE_DEFAULT);
+    const std::string& path, const std::string* password,
+    size_t display_list_cache_memory, int page_cache_size) {
+  std::unique_ptr<FitzLocks> fz_locks(new FitzLocks());
+  fz_context* fz_ctx = fz_new_context(
+      GetCountingAllocContext(), fz_locks->GetLocksContext(),
+      FZ_STORE_DEFAULT);
   fz_register_document_handlers(fz_ctx);
   // Disable warning messages in the console.
-  fz_set_warning_callback(
-      fz_ctx, [](void* user, const char* message) {}, nullptr);
+  fz_set_warning_callback(fz_ctx, &IgnoreWarning, nullptr);
 
   fz_document* fz_doc = nullptr;
   fz_try(fz_ctx) {
@@ -67,82 +177,188 @@ FitzDocument* FitzDocument::Open(
     return nullptr;
   }
 
-  return new FitzDocument(fz_ctx, fz_doc);
+  // Page bounds of password protected documents are not saved, so as not to
+  // leave information about them behind.
+  std::string page_bounds_file_path, page_bounds_file_key;
+  if (fz_needs_password(fz_ctx, fz_doc) ||
+      !GetPageBoundsFile(
+          path, fz_count_pages(fz_ctx, fz_doc), &page_bounds_file_path,
+          &page_bounds_file_key)) {
+    page_bounds_file_path.clear();
+  }
+
+  return new FitzDocument(
+      std::move(fz_locks), fz_ctx, fz_doc, display_list_cache_memory,
+      page_cache_size, page_bounds_file_path, page_bounds_file_key);
 }
 
-FitzDocument::FitzDocument(fz_context* fz_ctx, fz_document* fz_doc)
-    : _fz_ctx(fz_ctx), _fz_doc(fz_doc) {
+FitzDocument::FitzDocument(
+    std::unique_ptr<FitzLocks> fz_locks, fz_context* fz_ctx,
+    fz_document* fz_doc, size_t display_list_cache_memory,
+    int page_cache_size, const std::string& page_bounds_file_path,
+    const std::string& page_bounds_file_key)
+    : _fz_locks(std::move(fz_locks)),
+      _fz_ctx(fz_ctx),
+      _fz_doc(fz_doc),
+      _num_pages(fz_count_pages(fz_ctx, fz_doc)),
+      _num_page_loads(0),
+      _page_bounds(_num_pages),
+      _is_page_bounds_known(_num_pages, false),
+      _num_unknown_page_bounds(_num_pages),
+      _is_stopping_page_bounds_scanner(false),
+      _page_bounds_file_path(page_bounds_file_path),
+      _page_bounds_file_key(page_bounds_file_key) {
+  assert(_fz_locks != nullptr);
   assert(_fz_ctx != nullptr);
   assert(_fz_doc != nullptr);
+  if (!_page_bounds_file_path.empty()) {
+    LoadPageBounds();
+  }
+  _page_cache.reset(new PageCache(this, page_cache_size));
+  if (display_list_cache_memory > 0) {
+    _display_list_cache.reset(
+        new DisplayListCache(this, display_list_cache_memory));
+  }
 }
 
 FitzDocument::~FitzDocument() {
-  std::lock_guard<std::recursive_mutex> lock(_fz_mutex);
+  _is_stopping_page_bounds_scanner = true;
+  if (_page_bounds_scanner.joinable()) {
+    _page_bounds_scanner.join();
+  }
+  // Display lists and pages must be dropped while the document and context
+  // are still alive.
+  _display_list_cache.reset();
+  _page_cache.reset();
+  std::lock_guard<std::recursive_mutex> lock(_fz_doc_mutex);
+  for (fz_context* ctx : _idle_fz_ctxs) {
+    fz_drop_context(ctx);
+  }
   fz_drop_document(_fz_ctx, _fz_doc);
   fz_drop_context(_fz_ctx);
 }
 
-int FitzDocument::GetNumPages() {
-  std::lock_guard<std::recursive_mutex> lock(_fz_mutex);
-  return fz_count_pages(_fz_ctx, _fz_doc);
-}
+int FitzDocument::GetNumPages() { return _num_pages; }
 
 const Document::PageSize FitzDocument::GetPageSize(
     int page, float zoom, int rotation) {
-  std::lock_guard<std::recursive_mutex> lock(_fz_mutex);
   assert((page >= 0) && (page < GetNumPages()));
-  FitzPageScopedPtr page_ptr(_fz_ctx, fz_load_page(_fz_ctx, _fz_doc, page));
-  const fz_irect& bbox = GetPageBoundingBox(
-      _fz_ctx, page_ptr.get(), ComputeTransformMatrix(zoom, rotation));
+  const fz_irect bbox = fz_round_rect(fz_transform_rect(
+      GetPageBounds(page), ComputeTransformMatrix(zoom, rotation)));
   return PageSize(bbox.x1 - bbox.x0, bbox.y1 - bbox.y0);
 }
 
 void FitzDocument::Render(
-    Document::PixelWriter* pw, int page, float zoom, int rotation) {
-  std::lock_guard<std::recursive_mutex> lock(_fz_mutex);
+    Document::PixelWriter* pw, int page, float zoom, int rotation,
+    const PageRect& region, Quality quality, const CancellationToken* token) {
+  // 1. Get the page recorded into a display list. Recording is the only part
+  // that uses the document, and is skipped entirely if the page is cached.
   assert((page >= 0) && (page < GetNumPages()));
-
-  // 1. Init MuPDF structures.
   const fz_matrix& m = ComputeTransformMatrix(zoom, rotation);
-  FitzPageScopedPtr page_ptr(_fz_ctx, fz_load_page(_fz_ctx, _fz_doc, page));
-  const fz_irect& bbox = GetPageBoundingBox(_fz_ctx, page_ptr.get(), m);
-  FitzPixmapScopedPtr pixmap_ptr(
-      _fz_ctx, fz_new_pixmap_with_bbox(
-                   _fz_ctx, fz_device_rgb(_fz_ctx), bbox, nullptr, 1));
-  FitzDeviceScopedPtr dev_ptr(
-      _fz_ctx, fz_new_draw_device(_fz_ctx, fz_identity, pixmap_ptr.get()));
-
-  // 2. Render page.
-  fz_clear_pixmap_with_value(_fz_ctx, pixmap_ptr.get(), 0xff);
-  fz_run_page(_fz_ctx, page_ptr.get(), dev_ptr.get(), m, nullptr);
-
-  // 3. Write pixmap to buffer. The page is vertically divided into n equal
-  // stripes, each copied to pw by one thread.
-  assert(fz_pixmap_components(_fz_ctx, pixmap_ptr.get()) == 4);
-  uint8_t* buffer =
-      reinterpret_cast<uint8_t*>(fz_pixmap_samples(_fz_ctx, pixmap_ptr.get()));
-  const int num_cols = fz_pixmap_width(_fz_ctx, pixmap_ptr.get());
-  const int num_rows = fz_pixmap_height(_fz_ctx, pixmap_ptr.get());
-  ExecuteInParallel([=](int num_threads, int i) {
-    const int num_rows_per_thread = num_rows / num_threads;
-    const int y_begin = i * num_rows_per_thread;
-    const int y_end =
-        (i == num_threads - 1) ? num_rows : (i + 1) * num_rows_per_thread;
-    uint8_t* p = buffer + y_begin * num_cols * 4;
-    for (int y = y_begin; y < y_end; ++y) {
-      for (int x = 0; x < num_cols; ++x) {
-        pw->Write(x, y, p[0], p[1], p[2]);
-        p += 4;
+  const DisplayListCache::Handle display_list = GetPageDisplayList(page);
+  const fz_irect page_bbox =
+      fz_round_rect(fz_transform_rect(display_list->Bounds, m));
+  assert((region.X >= 0) && (region.Y >= 0));
+  assert(region.X + region.Width <= page_bbox.x1 - page_bbox.x0);
+  assert(region.Y + region.Height <= page_bbox.y1 - page_bbox.y0);
+  // Top-left corner of region, in the coordinates of the transformed page.
+  const int region_x0 = page_bbox.x0 + region.X;
+  const int region_y0 = page_bbox.y0 + region.Y;
+
+  // 2. If pw can take pixels in a format MuPDF draws, draw straight into its
+  // memory. Otherwise, draw RGBA pixels into scratch pixmaps and convert them.
+  Document::PixelWriter::DirectBuffer direct_buffer;
+  const bool is_direct = pw->GetDirectBuffer(&direct_buffer) &&
+                         (direct_buffer.Width == region.Width) &&
+                         (direct_buffer.Height == region.Height);
+  const bool is_gray =
+      is_direct &&
+      (direct_buffer.PixelFormat == PixelWriter::DirectBuffer::GRAY);
+  const bool is_bgr =
+      is_direct &&
+      (direct_buffer.PixelFormat == PixelWriter::DirectBuffer::BGRX);
+  const int num_components = is_gray ? 1 : 4;
+
+  // 3. Render the display list in horizontal bands, which are divided among
+  // workers. Each worker uses a context of its own, set up for quality, and a
+  // single scratch pixmap for all of its bands, so peak scratch memory is one
+  // band per thread rather than a whole page. Bands are drawn with the page
+  // translated so that they start at the origin of their pixmap. Once token
+  // is cancelled, MuPDF is told to stop through the band's cookie, and the
+  // remaining bands are only cleared.
+  const int num_bands = (region.Height + NUM_ROWS_PER_BAND - 1) /
+                        NUM_ROWS_PER_BAND;
+  ParallelFor(0, num_bands, 0, [&](int band_begin, int band_end) {
+    fz_context* ctx = AcquireContext();
+    SetRenderQuality(ctx, quality);
+    {
+      fz_colorspace* colorspace =
+          is_gray ? fz_device_gray(ctx)
+                  : (is_bgr ? fz_device_bgr(ctx) : fz_device_rgb(ctx));
+      fz_irect scratch_bbox;
+      scratch_bbox.x0 = scratch_bbox.y0 = 0;
+      scratch_bbox.x1 = region.Width;
+      scratch_bbox.y1 = NUM_ROWS_PER_BAND;
+      FitzPixmapScopedPtr scratch_ptr(
+          ctx,
+          is_direct ? nullptr
+                    : fz_new_pixmap_with_bbox(
+                          ctx, colorspace, scratch_bbox, nullptr, 1));
+      for (int band = band_begin; band < band_end; ++band) {
+        const int y = band * NUM_ROWS_PER_BAND;
+        fz_irect band_bbox = scratch_bbox;
+        band_bbox.y1 = std::min<int>(NUM_ROWS_PER_BAND, region.Height - y);
+        FitzPixmapScopedPtr direct_ptr(
+            ctx,
+            is_direct ? fz_new_pixmap_with_bbox_and_data(
+                            ctx, colorspace, band_bbox, nullptr,
+                            is_gray ? 0 : 1,
+                            direct_buffer.Data +
+                                static_cast<size_t>(y) * region.Width *
+                                    num_components)
+                      : nullptr);
+        fz_pixmap* pixmap = is_direct ? direct_ptr.get() : scratch_ptr.get();
+        FitzDeviceScopedPtr dev_ptr(
+            ctx, fz_new_draw_device(ctx, fz_identity, pixmap));
+        // See SetRenderQuality().
+        if (quality == FAST) {
+          fz_enable_device_hints(
+              ctx, dev_ptr.get(), FZ_DONT_INTERPOLATE_IMAGES);
+        }
+        fz_clear_pixmap_with_value(ctx, pixmap, 0xff);
+        fz_cookie cookie = {};
+        if (token != nullptr) {
+          token->Watch(&cookie.abort);
+        }
+        if (!cookie.abort) {
+          fz_run_display_list(
+              ctx, display_list->List, dev_ptr.get(),
+              fz_concat(m, fz_translate(-region_x0, -(region_y0 + y))),
+              fz_rect_from_irect(band_bbox), &cookie);
+        }
+        if (token != nullptr) {
+          token->Unwatch(&cookie.abort);
+        }
+        fz_close_device(ctx, dev_ptr.get());
+
+        if (!is_direct) {
+          assert(fz_pixmap_components(ctx, pixmap) == 4);
+          const uint8_t* samples =
+              reinterpret_cast<uint8_t*>(fz_pixmap_samples(ctx, pixmap));
+          for (int row = 0; row < band_bbox.y1; ++row) {
+            pw->WriteRow(
+                y + row, samples + row * region.Width * 4, region.Width);
+          }
+        }
       }
     }
+    // The MuPDF objects above were dropped with ctx, so it can now be reused.
+    ReleaseContext(ctx);
   });
-
-  // 4. Clean up.
-  fz_close_device(_fz_ctx, dev_ptr.get());
 }
 
 const Document::OutlineItem* FitzDocument::GetOutline() {
-  std::lock_guard<std::recursive_mutex> lock(_fz_mutex);
+  std::lock_guard<std::recursive_mutex> lock(_fz_doc_mutex);
   FitzOutlineScopedPtr outline_ptr(_fz_ctx, fz_load_outline(_fz_ctx, _fz_doc));
   if (outline_ptr.get() == nullptr) {
     return nullptr;
@@ -156,11 +372,13 @@ int FitzDocument::Lookup(const OutlineItem* item) {
 }
 
 std::string FitzDocument::GetPageText(int page, int line_sep) {
-  std::lock_guard<std::recursive_mutex> lock(_fz_mutex);
-  FitzPageScopedPtr page_ptr(_fz_ctx, fz_load_page(_fz_ctx, _fz_doc, page));
-  return ::GetPageText(_fz_ctx, page_ptr.get(), line_sep);
+  const PageCache::Handle page_handle = GetPage(page);
+  std::lock_guard<std::recursive_mutex> lock(_fz_doc_mutex);
+  return ::GetPageText(_fz_ctx, *page_handle, line_sep);
 }
 
+int FitzDocument::GetNumPageLoads() const { return _num_page_loads; }
+
 std::vector<Document::SearchHit> FitzDocument::SearchOnPage(
     const std::string& search_string, int page, int context_length) {
   const size_t margin =
@@ -183,3 +401,226 @@ std::vector<Document::SearchHit> FitzDocument::SearchOnPage(
   return search_hits;
 }
 
+fz_context* FitzDocument::AcquireContext() {
+  {
+    std::lock_guard<std::mutex> lock(_idle_fz_ctxs_mutex);
+    if (!_idle_fz_ctxs.empty()) {
+      fz_context* ctx = _idle_fz_ctxs.back();
+      _idle_fz_ctxs.pop_back();
+      return ctx;
+    }
+  }
+  // Cloning reads _fz_ctx, which may only be used under the document lock.
+  std::lock_guard<std::recursive_mutex> lock(_fz_doc_mutex);
+  fz_context* ctx = fz_clone_context(_fz_ctx);
+  assert(ctx != nullptr);
+  fz_set_warning_callback(ctx, &IgnoreWarning, nullptr);
+  return ctx;
+}
+
+void FitzDocument::ReleaseContext(fz_context* ctx) {
+  std::lock_guard<std::mutex> lock(_idle_fz_ctxs_mutex);
+  _idle_fz_ctxs.push_back(ctx);
+}
+
+FitzDocument::PageDisplayList FitzDocument::RecordPage(int page) {
+  const PageCache::Handle page_handle = GetPage(page);
+  std::lock_guard<std::recursive_mutex> lock(_fz_doc_mutex);
+  PageDisplayList display_list;
+  display_list.Bounds = fz_bound_page(_fz_ctx, *page_handle);
+  SetPageBounds(page, display_list.Bounds);
+  // The memory retained by the display list is whatever recording allocates
+  // and does not free, which includes resources such as fonts that it keeps
+  // alive.
+  const int64_t num_bytes_before = GetThreadNetAllocatedBytes();
+  display_list.List = fz_new_display_list_from_page(_fz_ctx, *page_handle);
+  display_list.Size = static_cast<size_t>(std::max<int64_t>(
+      1, GetThreadNetAllocatedBytes() - num_bytes_before));
+  return display_list;
+}
+
+FitzDocument::PageCache::Handle FitzDocument::GetPage(int page) {
+  assert((page >= 0) && (page < GetNumPages()));
+  PageCache::Handle page_handle = _page_cache->Get(page);
+  if (page + 1 < _num_pages) {
+    _page_cache->Prepare(page + 1, NEXT_PAGE_PREFETCH_PRIORITY);
+  }
+  if (page > 0) {
+    _page_cache->Prepare(page - 1, PREVIOUS_PAGE_PREFETCH_PRIORITY);
+  }
+  return page_handle;
+}
+
+fz_rect FitzDocument::GetPageBounds(int page) {
+  // 1. Return known bounds. On the first miss, start measuring all pages in
+  // the background so that later calls do not have to.
+  {
+    std::lock_guard<std::mutex> lock(_page_bounds_mutex);
+    if (_is_page_bounds_known[page]) {
+      return _page_bounds[page];
+    }
+    if (!_page_bounds_scanner.joinable()) {
+      _page_bounds_scanner =
+          std::thread(&FitzDocument::ScanPageBounds, this);
+    }
+  }
+
+  // 2. Measure the page.
+  const PageCache::Handle page_handle = GetPage(page);
+  fz_rect bounds;
+  {
+    std::lock_guard<std::recursive_mutex> lock(_fz_doc_mutex);
+    bounds = fz_bound_page(_fz_ctx, *page_handle);
+  }
+  SetPageBounds(page, bounds);
+  return bounds;
+}
+
+void FitzDocument::SetPageBounds(int page, const fz_rect& bounds) {
+  std::lock_guard<std::mutex> lock(_page_bounds_mutex);
+  if (!_is_page_bounds_known[page]) {
+    _page_bounds[page] = bounds;
+    _is_page_bounds_known[page] = true;
+    --_num_unknown_page_bounds;
+  }
+}
+
+void FitzDocument::ScanPageBounds() {
+  for (int page = 0; page < _num_pages; ++page) {
+    if (_is_stopping_page_bounds_scanner) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_page_bounds_mutex);
+      if (_is_page_bounds_known[page]) {
+        continue;
+      }
+    }
+    fz_rect bounds;
+    {
+      std::lock_guard<std::recursive_mutex> lock(_fz_doc_mutex);
+      FitzPageScopedPtr page_ptr(
+          _fz_ctx, fz_load_page(_fz_ctx, _fz_doc, page));
+      bounds = fz_bound_page(_fz_ctx, page_ptr.get());
+    }
+    SetPageBounds(page, bounds);
+    // Each page is measured under the document lock; let the foreground
+    // take it in between.
+    std::this_thread::yield();
+  }
+  if (!_page_bounds_file_path.empty()) {
+    SavePageBounds();
+  }
+}
+
+bool FitzDocument::LoadPageBounds() {
+  // 1. Check that the file describes this version of the document.
+  std::string contents;
+  const std::string prefix = PAGE_BOUNDS_FILE_HEADER + _page_bounds_file_key;
+  if (!ReadFile(_page_bounds_file_path, &contents) ||
+      (contents.compare(0, prefix.length(), prefix) != 0)) {
+    return false;
+  }
+
+  // 2. Parse one line of coordinates per page.
+  std::vector<fz_rect> page_bounds(_num_pages);
+  const char* p = contents.c_str() + prefix.length();
+  for (fz_rect& bounds : page_bounds) {
+    for (float* coord : {&bounds.x0, &bounds.y0, &bounds.x1, &bounds.y1}) {
+      char* end;
+      *coord = strtof(p, &end);
+      if (end == p) {
+        return false;
+      }
+      p = end;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(_page_bounds_mutex);
+  _page_bounds.swap(page_bounds);
+  _is_page_bounds_known.assign(_num_pages, true);
+  _num_unknown_page_bounds = 0;
+  return true;
+}
+
+void FitzDocument::SavePageBounds() {
+  std::string contents = PAGE_BOUNDS_FILE_HEADER + _page_bounds_file_key;
+  {
+    std::lock_guard<std::mutex> lock(_page_bounds_mutex);
+    if (_num_unknown_page_bounds > 0) {
+      return;
+    }
+    // Coordinates are written in hexadecimal so that they are read back
+    // exactly.
+    char line[128];
+    for (const fz_rect& bounds : _page_bounds) {
+      snprintf(
+          line, sizeof(line), "%a %a %a %a\n", bounds.x0, bounds.y0,
+          bounds.x1, bounds.y1);
+      contents += line;
+    }
+  }
+  WriteFileAtomically(_page_bounds_file_path, contents);
+}
+
+void FitzDocument::DropPageDisplayList(const PageDisplayList& display_list) {
+  fz_context* ctx = AcquireContext();
+  fz_drop_display_list(ctx, display_list.List);
+  ReleaseContext(ctx);
+}
+
+FitzDocument::DisplayListCache::Handle FitzDocument::GetPageDisplayList(
+    int page) {
+  if (_display_list_cache != nullptr) {
+    return _display_list_cache->Get(page);
+  }
+  return DisplayListCache::Handle(
+      new PageDisplayList(RecordPage(page)),
+      [this](PageDisplayList* display_list) {
+        DropPageDisplayList(*display_list);
+        delete display_list;
+      });
+}
+
+FitzDocument::DisplayListCache::DisplayListCache(
+    FitzDocument* parent, size_t memory)
+    : Cache<int, PageDisplayList>(
+          parent->GetNumPages() + 1, DISPLAY_LIST_CACHE_NUM_LOADER_THREADS),
+      _parent(parent) {
+  SetSizeBudget(memory);
+}
+
+FitzDocument::DisplayListCache::~DisplayListCache() { Clear(); }
+
+FitzDocument::PageDisplayList FitzDocument::DisplayListCache::Load(
+    const int& page) {
+  return _parent->RecordPage(page);
+}
+
+void FitzDocument::DisplayListCache::Discard(
+    const int& /* page */, const PageDisplayList& display_list) {
+  _parent->DropPageDisplayList(display_list);
+}
+
+size_t FitzDocument::DisplayListCache::GetValueSize(
+    const int& /* page */, const PageDisplayList& display_list) const {
+  return display_list.Size;
+}
+
+FitzDocument::PageCache::PageCache(FitzDocument* parent, int cache_size)
+    : Cache<int, fz_page*>(cache_size, PAGE_CACHE_NUM_LOADER_THREADS),
+      _parent(parent) {}
+
+FitzDocument::PageCache::~PageCache() { Clear(); }
+
+fz_page* FitzDocument::PageCache::Load(const int& page) {
+  ++_parent->_num_page_loads;
+  std::lock_guard<std::recursive_mutex> lock(_parent->_fz_doc_mutex);
+  return fz_load_page(_parent->_fz_ctx, _parent->_fz_doc, page);
+}
+
+void FitzDocument::PageCache::Discard(
+    const int& /* page */, fz_page* const& page_struct) {
+  std::lock_guard<std::recursive_mutex> lock(_parent->_fz_doc_mutex);
+  fz_drop_page(_parent->_fz_ctx, page_struct);
+}
@@ -22,36 +22,59 @@
 #ifndef FITZ_DOCUMENT_HPP
 #define FITZ_DOCUMENT_HPP
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "cache.hpp"
 #include "document.hpp"
 #include "fitz_utils.hpp"
 
 // Document implementation using Fitz.
 class FitzDocument : public Document {
  public:
+  // Default memory budget for cached display lists, in bytes.
+  enum { DEFAULT_DISPLAY_LIST_CACHE_MEMORY = 64 << 20 };
+  // Default maximum number of loaded pages to keep around.
+  enum { DEFAULT_PAGE_CACHE_SIZE = 5 };
+
   virtual ~FitzDocument();
   // Factory method to construct an instance of FitzDocument. path gives the
   // path to a file. password is the password to use to unlock the document;
   // specify nullptr if no password was provided. Does not take ownership of
-  // password. Returns nullptr if the file cannot be opened.
+  // password. display_list_cache_memory limits the memory used by recorded
+  // pages, which are replayed by Render() instead of reinterpreting the page;
+  // 0 disables the cache. page_cache_size is the number of loaded pages
+  // shared by rendering, search and geometry queries. The bounds of pages are
+  // measured once, in the background after the first call to GetPageSize(),
+  // and saved in the cache directory for large documents. Returns nullptr if
+  // the file cannot be opened.
   static FitzDocument* Open(
-      const std::string& path, const std::string* password);
+      const std::string& path, const std::string* password,
+      size_t display_list_cache_memory = DEFAULT_DISPLAY_LIST_CACHE_MEMORY,
+      int page_cache_size = DEFAULT_PAGE_CACHE_SIZE);
   // See Document.
   int GetNumPages() override;
-  // See Document.
+  // See Document. Only loads the page if its bounds are not yet known.
   const PageSize GetPageSize(int page, float zoom, int rotation) override;
-  // See Document. Thread-safe.
-  void Render(PixelWriter* pw, int page, float zoom, int rotation) override;
+  // See Document. Thread-safe; multiple pages can be rendered concurrently.
+  using Document::Render;
+  void Render(
+      PixelWriter* pw, int page, float zoom, int rotation,
+      const PageRect& region, Quality quality,
+      const CancellationToken* token) override;
   // See Document.
   const OutlineItem* GetOutline() override;
   // See Document.
   int Lookup(const OutlineItem* item) override;
   // Returns the text content of a page, using line_sep to separate lines.
   std::string GetPageText(int page, int line_sep = '\n');
+  // Returns the number of times a page has been loaded into the page cache,
+  // for checking that pages are shared and prefetched.
+  int GetNumPageLoads() const;
 
  protected:
   // See Document.
@@ -59,17 +82,128 @@ class FitzDocument : public Document {
       const std::string& search_string, int page, int context_length) override;
 
  private:
+  // Locks shared by _fz_ctx and its clones. Declared first so that it is
+  // destroyed last.
+  std::unique_ptr<FitzLocks> _fz_locks;
   // MuPDF structures.
   fz_context* _fz_ctx;
   fz_document* _fz_doc;
-  // Mutex guarding MuPDF structures.
-  std::recursive_mutex _fz_mutex;
+  // Mutex guarding _fz_ctx, _fz_doc and pages loaded from it. MuPDF documents
+  // are not thread-safe, but display lists recorded from their pages can be
+  // rendered by several threads at once, each with its own context.
+  std::recursive_mutex _fz_doc_mutex;
+  // Number of pages in _fz_doc.
+  const int _num_pages;
+  // Contexts cloned from _fz_ctx that are not currently in use.
+  std::vector<fz_context*> _idle_fz_ctxs;
+  // Mutex guarding _idle_fz_ctxs.
+  std::mutex _idle_fz_ctxs_mutex;
+
+  // Cache of loaded pages. Pages may only be used under _fz_doc_mutex, which
+  // must not be held while calling Get().
+  class PageCache : public Cache<int, fz_page*> {
+   public:
+    PageCache(FitzDocument* parent, int cache_size);
+    virtual ~PageCache();
+
+   protected:
+    fz_page* Load(const int& page) override;
+    void Discard(const int& page, fz_page* const& page_struct) override;
+
+   private:
+    FitzDocument* _parent;
+  };
+  friend class PageCache;
+  // Loaded pages.
+  std::unique_ptr<PageCache> _page_cache;
+  // Number of calls to PageCache::Load().
+  std::atomic<int> _num_page_loads;
+
+  // A page recorded into a display list.
+  struct PageDisplayList {
+    fz_display_list* List;
+    // Bounds of the page before transformation.
+    fz_rect Bounds;
+    // Approximate memory retained by List, in bytes.
+    size_t Size;
+  };
+  // Cache of recorded pages, bounded by memory.
+  class DisplayListCache : public Cache<int, PageDisplayList> {
+   public:
+    DisplayListCache(FitzDocument* parent, size_t memory);
+    virtual ~DisplayListCache();
+
+   protected:
+    PageDisplayList Load(const int& page) override;
+    void Discard(
+        const int& page, const PageDisplayList& display_list) override;
+    size_t GetValueSize(
+        const int& page, const PageDisplayList& display_list) const override;
+
+   private:
+    FitzDocument* _parent;
+  };
+  friend class DisplayListCache;
+  // Recorded pages, or nullptr if disabled.
+  std::unique_ptr<DisplayListCache> _display_list_cache;
+
+  // Unscaled bounds of each page, indexed by page number.
+  std::vector<fz_rect> _page_bounds;
+  // Whether each entry in _page_bounds has been measured.
+  std::vector<bool> _is_page_bounds_known;
+  // Number of false entries in _is_page_bounds_known.
+  int _num_unknown_page_bounds;
+  // Mutex guarding the above page bounds state.
+  std::mutex _page_bounds_mutex;
+  // Thread measuring the bounds of all pages, started by the first call to
+  // GetPageBounds().
+  std::thread _page_bounds_scanner;
+  // Tells _page_bounds_scanner to exit.
+  std::atomic<bool> _is_stopping_page_bounds_scanner;
+  // File the page bounds are loaded from and saved to, or empty if disabled.
+  const std::string _page_bounds_file_path;
+  // Identifies the document in _page_bounds_file_path.
+  const std::string _page_bounds_file_key;
 
   // We disallow the constructor; use the factory method Open() instead.
-  FitzDocument(fz_context* _fz_context, fz_document* fz_document);
+  FitzDocument(
+      std::unique_ptr<FitzLocks> fz_locks, fz_context* fz_ctx,
+      fz_document* fz_doc, size_t display_list_cache_memory,
+      int page_cache_size, const std::string& page_bounds_file_path,
+      const std::string& page_bounds_file_key);
   // We disallow copying because we store lots of heap allocated state.
   explicit FitzDocument(const FitzDocument& other);
   FitzDocument& operator=(const FitzDocument& other);
+
+  // Returns a context cloned from _fz_ctx for exclusive use by the calling
+  // thread. Must be returned with ReleaseContext().
+  fz_context* AcquireContext();
+  // Returns a context obtained from AcquireContext() for reuse.
+  void ReleaseContext(fz_context* ctx);
+  // Returns a loaded page, from the cache if possible, and prefetches its
+  // neighbors. Must not be called under _fz_doc_mutex.
+  PageCache::Handle GetPage(int page);
+  // Returns the unscaled bounds of a page, measuring them if not yet known.
+  // Thread-safe.
+  fz_rect GetPageBounds(int page);
+  // Stores the measured bounds of a page. Thread-safe.
+  void SetPageBounds(int page, const fz_rect& bounds);
+  // Measures the bounds of all pages, then saves them to
+  // _page_bounds_file_path. Runs on _page_bounds_scanner. Pages are loaded
+  // directly rather than through _page_cache, so as not to evict pages that
+  // are in use.
+  void ScanPageBounds();
+  // Loads page bounds from _page_bounds_file_path. Returns false if the file
+  // does not exist or does not match the document.
+  bool LoadPageBounds();
+  // Saves page bounds to _page_bounds_file_path.
+  void SavePageBounds();
+  // Records a page into a display list. Thread-safe.
+  PageDisplayList RecordPage(int page);
+  // Frees a display list returned by RecordPage(). Thread-safe.
+  void DropPageDisplayList(const PageDisplayList& display_list);
+  // Returns the display list for a page, from the cache if enabled.
+  DisplayListCache::Handle GetPageDisplayList(int page);
 };
 
 #endif
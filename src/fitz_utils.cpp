@@ -22,6 +22,8 @@
 #include "fitz_utils.hpp"
 
 #include <cassert>
+#include <cstddef>
+#include <cstdlib>
 
 fz_matrix ComputeTransformMatrix(float zoom, int rotation) {
   fz_matrix transformation_matrix, scale_matrix, rotate_matrix;
@@ -39,6 +41,91 @@ fz_irect GetPageBoundingBox(
 
 namespace {
 
+// Header stored in front of each allocation made by the counting allocator.
+union AllocHeader {
+  // Size of the allocation, excluding the header.
+  size_t Size;
+  // Keeps the memory following the header suitably aligned.
+  std::max_align_t Alignment;
+};
+
+// Net number of bytes allocated by the counting allocator on this thread.
+thread_local int64_t thread_net_allocated_bytes = 0;
+
+void* CountingMalloc(void* /* user */, size_t size) {
+  AllocHeader* header =
+      static_cast<AllocHeader*>(malloc(sizeof(AllocHeader) + size));
+  if (header == nullptr) {
+    return nullptr;
+  }
+  header->Size = size;
+  thread_net_allocated_bytes += size;
+  return header + 1;
+}
+
+void CountingFree(void* /* user */, void* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  AllocHeader* header = static_cast<AllocHeader*>(ptr) - 1;
+  thread_net_allocated_bytes -= header->Size;
+  free(header);
+}
+
+void* CountingRealloc(void* /* user */, void* old_ptr, size_t size) {
+  if (old_ptr == nullptr) {
+    return CountingMalloc(nullptr, size);
+  }
+  if (size == 0) {
+    CountingFree(nullptr, old_ptr);
+    return nullptr;
+  }
+  AllocHeader* old_header = static_cast<AllocHeader*>(old_ptr) - 1;
+  const size_t old_size = old_header->Size;
+  AllocHeader* header = static_cast<AllocHeader*>(
+      realloc(old_header, sizeof(AllocHeader) + size));
+  if (header == nullptr) {
+    return nullptr;
+  }
+  header->Size = size;
+  thread_net_allocated_bytes +=
+      static_cast<int64_t>(size) - static_cast<int64_t>(old_size);
+  return header + 1;
+}
+
+const fz_alloc_context COUNTING_ALLOC_CONTEXT = {
+    nullptr, &CountingMalloc, &CountingRealloc, &CountingFree};
+
+}  // namespace
+
+const fz_alloc_context* GetCountingAllocContext() {
+  return &COUNTING_ALLOC_CONTEXT;
+}
+
+int64_t GetThreadNetAllocatedBytes() { return thread_net_allocated_bytes; }
+
+FitzLocks::FitzLocks() {
+  _locks_context.user = this;
+  _locks_context.lock = &FitzLocks::Lock;
+  _locks_context.unlock = &FitzLocks::Unlock;
+}
+
+const fz_locks_context* FitzLocks::GetLocksContext() const {
+  return &_locks_context;
+}
+
+void FitzLocks::Lock(void* user, int lock) {
+  assert((lock >= 0) && (lock < FZ_LOCK_MAX));
+  reinterpret_cast<FitzLocks*>(user)->_mutexes[lock].lock();
+}
+
+void FitzLocks::Unlock(void* user, int lock) {
+  assert((lock >= 0) && (lock < FZ_LOCK_MAX));
+  reinterpret_cast<FitzLocks*>(user)->_mutexes[lock].unlock();
+}
+
+namespace {
+
 const char* const DEFAULT_ROOT_OUTLINE_ITEM_TITLE = "TABLE OF CONTENTS";
 
 }  // namespace
@@ -26,6 +26,8 @@ extern "C" {
 #include "mupdf/fitz.h"
 }
 
+#include <cstdint>
+#include <mutex>
 #include <string>
 
 #include "document.hpp"
@@ -58,6 +60,40 @@ class FitzOutlineItem : public Document::OutlineItem {
       fz_outline* src, std::vector<std::unique_ptr<OutlineItem>>* output);
 };
 
+// Returns a fz_alloc_context that keeps count of the bytes allocated and freed
+// on each thread, for measuring the memory retained by MuPDF objects.
+extern const fz_alloc_context* GetCountingAllocContext();
+
+// Returns the net number of bytes allocated on the calling thread through
+// GetCountingAllocContext(). Only differences between two calls on the same
+// thread are meaningful.
+extern int64_t GetThreadNetAllocatedBytes();
+
+// Mutexes backing MuPDF's fz_locks_context, which allow contexts cloned from a
+// common context with fz_clone_context() to be used on different threads at
+// the same time.
+class FitzLocks {
+ public:
+  FitzLocks();
+  // Returns a fz_locks_context to pass to fz_new_context(). This object must
+  // outlive the context and all of its clones.
+  const fz_locks_context* GetLocksContext() const;
+
+ private:
+  // One mutex per lock defined by MuPDF.
+  std::mutex _mutexes[FZ_LOCK_MAX];
+  // Callbacks into _mutexes.
+  fz_locks_context _locks_context;
+
+  // Callbacks for fz_locks_context.
+  static void Lock(void* user, int lock);
+  static void Unlock(void* user, int lock);
+
+  // We disallow copying because MuPDF holds a pointer to this object.
+  FitzLocks(const FitzLocks& other);
+  FitzLocks& operator=(const FitzLocks& other);
+};
+
 // Returns the text content of a page, using line_sep to separate lines. NOT
 // thread-safe.
 extern std::string GetPageText(
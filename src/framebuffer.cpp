@@ -20,121 +20,169 @@
 
 #include "framebuffer.hpp"
 
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
-#include <cstdio>
-#include <cstring>
+#include <cassert>
 #include <memory>
-#include <sstream>
 #include <string>
 
-const char* const Framebuffer::DEFAULT_FRAMEBUFFER_DEVICE = "/dev/fb0";
+#include "fbdev_framebuffer.hpp"
+#include "virtual_framebuffer.hpp"
 
-Framebuffer* Framebuffer::Open(const std::string& device) {
-  std::unique_ptr<Framebuffer> fb(new Framebuffer(device));
+const char* const Framebuffer::DEFAULT_FRAMEBUFFER_DEVICE = "/dev/fb0";
+const char* const Framebuffer::VIRTUAL_FRAMEBUFFER_PREFIX = "virtual:";
 
-  if ((fb->_fd = open(device.c_str(), O_RDWR)) == -1) {
-    goto error;
-  }
-  if ((ioctl(fb->_fd, FBIOGET_VSCREENINFO, &(fb->_vinfo)) == -1) ||
-      (ioctl(fb->_fd, FBIOGET_FSCREENINFO, &(fb->_finfo)) == -1)) {
-    goto error;
-  }
-  fb->_buffer = reinterpret_cast<uint8_t*>(mmap(
-      nullptr, fb->GetBufferByteSize(), PROT_READ | PROT_WRITE, MAP_SHARED,
-      fb->_fd, 0));
-  if (fb->_buffer == MAP_FAILED) {
-    goto error;
+Framebuffer* Framebuffer::Open(
+    const std::string& device, int rotation, bool double_buffered) {
+  const std::string virtual_prefix(VIRTUAL_FRAMEBUFFER_PREFIX);
+  if (device.compare(0, virtual_prefix.length(), virtual_prefix) == 0) {
+    return VirtualFramebuffer::Open(
+        device.substr(virtual_prefix.length()), rotation, double_buffered);
   }
+  return FbdevFramebuffer::Open(device, rotation, double_buffered);
+}
+
+Framebuffer::Framebuffer(int rotation)
+    : _format(nullptr),
+      _pixel_buffer(nullptr),
+      _rotation(((rotation % 360) + 360) % 360),
+      _is_double_buffered(false),
+      _front(0),
+      _is_in_frame(false) {
+  assert(_rotation % 90 == 0);
+}
 
-  fb->_format.reset(new Format(fb->_vinfo));
-  fb->_pixel_buffer.reset(new PixelBuffer(
-      fb->GetSize(), fb->_format.get(), fb->_buffer, fb->GetAllocatedSize(),
-      fb->GetOffset()));
-  return fb.release();
+Framebuffer::~Framebuffer() {}
 
-error:
-  perror(("Error initializing framebuffer device \"" + device + "\"").c_str());
-  return nullptr;
+PixelBuffer* Framebuffer::NewPixelBuffer(const PixelBuffer::Size& size) {
+  return new PixelBuffer(size, _format.get());
 }
 
-Framebuffer::Framebuffer(const std::string& device)
-    : _device(device),
-      _buffer(nullptr),
-      _format(nullptr),
-      _pixel_buffer(nullptr) {}
+PixelBuffer::Size Framebuffer::GetSize() const {
+  if ((_rotation == 90) || (_rotation == 270)) {
+    return PixelBuffer::Size(_vinfo.yres, _vinfo.xres);
+  }
+  return PixelBuffer::Size(_vinfo.xres, _vinfo.yres);
+}
+
+const PixelBuffer::Format* Framebuffer::GetFormat() const {
+  return _format.get();
+}
 
-Framebuffer::~Framebuffer() {
-  if (_buffer != nullptr && _buffer != MAP_FAILED) {
-    memset(_buffer, 0, GetBufferByteSize());
-    munmap(_buffer, GetBufferByteSize());
+void Framebuffer::Render(
+    const PixelBuffer& src, const PixelBuffer::Rect& rect,
+    const ColorTransform* transform) {
+  if (_rotation == 0) {
+    src.Copy(rect, _pixel_buffer->GetRect(), _pixel_buffer, transform);
+    return;
   }
-  if (_fd != -1) {
-    close(_fd);
+  // Clear the screen around the centered rect, then rotate it into place.
+  const PixelBuffer::Size size = GetSize();
+  const int x = (size.Width - rect.Width) / 2;
+  const int y = (size.Height - rect.Height) / 2;
+  const PixelBuffer::Rect margins[] = {
+      PixelBuffer::Rect(0, 0, size.Width, y),
+      PixelBuffer::Rect(
+          0, y + rect.Height, size.Width, size.Height - y - rect.Height),
+      PixelBuffer::Rect(0, y, x, rect.Height),
+      PixelBuffer::Rect(
+          x + rect.Width, y, size.Width - x - rect.Width, rect.Height),
+  };
+  for (const PixelBuffer::Rect& margin : margins) {
+    if ((margin.Width > 0) && (margin.Height > 0)) {
+      Clear(margin);
+    }
   }
+  Render(src, rect, x, y, transform);
 }
 
-std::string Framebuffer::GetDebugInfoString() {
-  std::ostringstream out;
-
-  out << "Device:\t\t\t" << _device << std::endl;
-  out << "Visible resolution:\t" << _vinfo.xres << " x " << _vinfo.yres
-      << std::endl;
-  out << "Virtual resolution:\t" << _vinfo.xres_virtual << " x "
-      << _vinfo.yres_virtual << std::endl;
-  out << "Offset:\t\t\t" << _vinfo.xoffset << ", " << _vinfo.yoffset
-      << std::endl;
-  out << "Buffer size:\t\t" << (_finfo.smem_len / _format->GetDepth()) << " ("
-      << _finfo.smem_len << " bytes)" << std::endl;
-  out << "Buffer width:\t\t" << (_finfo.line_length / _format->GetDepth())
-      << " (" << _finfo.line_length << " bytes)" << std::endl;
-  out << "Buffer height:\t\t" << (_finfo.smem_len / _finfo.line_length)
-      << std::endl;
-  out << "Bits per pixel:\t\t" << _vinfo.bits_per_pixel << std::endl;
-  out << "Bit depth:\t\t" << _format->GetDepth() << std::endl;
-  out << "Red:\t\t\t"
-      << "length " << _vinfo.red.length << ", offset " << _vinfo.red.offset
-      << std::endl;
-  out << "Green:\t\t\t"
-      << "length " << _vinfo.green.length << ", offset " << _vinfo.green.offset
-      << std::endl;
-  out << "Blue:\t\t\t"
-      << "length " << _vinfo.blue.length << ", offset " << _vinfo.blue.offset
-      << std::endl;
-  out << "Non-std pixel format:\t" << _vinfo.nonstd << std::endl;
-
-  return out.str();
+void Framebuffer::Render(
+    const PixelBuffer& src, const PixelBuffer::Rect& rect, int x, int y,
+    const ColorTransform* transform) {
+  const PixelBuffer::Rect dest_rect =
+      GetDeviceRect(PixelBuffer::Rect(x, y, rect.Width, rect.Height));
+  if (_rotation == 0) {
+    src.Copy(rect, dest_rect, _pixel_buffer, transform);
+  } else {
+    src.Rotate(
+        rect, _rotation, _pixel_buffer, dest_rect.X, dest_rect.Y,
+        transform);
+  }
 }
 
-PixelBuffer* Framebuffer::NewPixelBuffer(const PixelBuffer::Size& size) {
-  return new PixelBuffer(size, _format.get());
+void Framebuffer::BeginFrame() {
+  assert(!_is_in_frame);
+  _is_in_frame = true;
+  if (_is_double_buffered) {
+    _pixel_buffer = _pages[1 - _front].get();
+  }
+}
+
+void Framebuffer::EndFrame() {
+  assert(_is_in_frame);
+  _is_in_frame = false;
+  if (_is_double_buffered) {
+    const int back = 1 - _front;
+    if (ShowPage(back)) {
+      _front = back;
+    } else {
+      // Give up on double buffering, and show the frame the slow way.
+      _pages[back]->Copy(
+          _pages[back]->GetRect(), _pages[_front]->GetRect(),
+          _pages[_front].get());
+      _is_double_buffered = false;
+    }
+    _pixel_buffer = _pages[_front].get();
+  }
+  OnFrameShown();
 }
 
-int Framebuffer::GetBufferByteSize() const { return _finfo.smem_len; }
+bool Framebuffer::IsDoubleBuffered() const { return _is_double_buffered; }
 
-PixelBuffer::Size Framebuffer::GetSize() const {
-  return PixelBuffer::Size(_vinfo.xres, _vinfo.yres);
+int Framebuffer::GetBufferIndex() const {
+  return (_pixel_buffer == _pages[0].get()) ? 0 : 1;
 }
 
-PixelBuffer::Size Framebuffer::GetAllocatedSize() const {
-  return PixelBuffer::Size(
-      _finfo.line_length / _format->GetDepth(),
-      _finfo.smem_len / _finfo.line_length);
+void Framebuffer::Clear(const PixelBuffer::Rect& rect) {
+  _pixel_buffer->Clear(GetDeviceRect(rect));
 }
 
-PixelBuffer::Size Framebuffer::GetOffset() const {
-  return PixelBuffer::Size(_vinfo.xoffset, _vinfo.yoffset);
+void Framebuffer::Move(const PixelBuffer::Rect& rect, int x, int y) {
+  const PixelBuffer::Rect device_rect = GetDeviceRect(rect);
+  const PixelBuffer::Rect device_dest_rect =
+      GetDeviceRect(PixelBuffer::Rect(x, y, rect.Width, rect.Height));
+  _pixel_buffer->Move(device_rect, device_dest_rect.X, device_dest_rect.Y);
 }
 
-void Framebuffer::Render(
-    const PixelBuffer& src, const PixelBuffer::Rect& rect) {
-  src.Copy(rect, _pixel_buffer->GetRect(), _pixel_buffer.get());
+void Framebuffer::WritePixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+  const PixelBuffer::Rect device_rect =
+      GetDeviceRect(PixelBuffer::Rect(x, y, 1, 1));
+  _pixel_buffer->WritePixel(device_rect.X, device_rect.Y, r, g, b);
+}
+
+PixelBuffer::Rect Framebuffer::GetDeviceRect(
+    const PixelBuffer::Rect& rect) const {
+  return PixelBuffer::RotateRect(rect, GetSize(), _rotation);
 }
 
+void Framebuffer::InitPages(uint8_t* buffer, int line_length, int num_lines) {
+  _format.reset(new Format(_vinfo));
+  const PixelBuffer::Size size(_vinfo.xres, _vinfo.yres);
+  const PixelBuffer::Size allocated_size(
+      line_length / _format->GetDepth(), num_lines);
+  _pages[0].reset(new PixelBuffer(
+      size, _format.get(), buffer, allocated_size,
+      PixelBuffer::Size(_vinfo.xoffset, _vinfo.yoffset)));
+  if (_is_double_buffered) {
+    _pages[1].reset(new PixelBuffer(
+        size, _format.get(), buffer, allocated_size,
+        PixelBuffer::Size(_vinfo.xoffset, _vinfo.yoffset + _vinfo.yres)));
+  }
+  _pixel_buffer = _pages[0].get();
+}
+
+void Framebuffer::OnFrameShown() {}
+
+void Framebuffer::TuneWrites() {}
+
 Framebuffer::Format::Format(const fb_var_screeninfo& vinfo) : _vinfo(vinfo) {}
 
 int Framebuffer::Format::GetDepth() const {
@@ -142,6 +190,9 @@ int Framebuffer::Format::GetDepth() const {
 }
 
 uint32_t Framebuffer::Format::Pack(uint8_t r, uint8_t g, uint8_t b) const {
+  if (IsGray8()) {
+    return RGBToGray(r, g, b);
+  }
   return ((static_cast<uint32_t>(r) >> (8 - _vinfo.red.length))
           << _vinfo.red.offset) |
          ((static_cast<uint32_t>(g) >> (8 - _vinfo.green.length))
@@ -150,3 +201,58 @@ uint32_t Framebuffer::Format::Pack(uint8_t r, uint8_t g, uint8_t b) const {
           << _vinfo.blue.offset);
 }
 
+PixelLayout Framebuffer::Format::GetLayout() const {
+  if (IsGray8()) {
+    return PixelLayout::GRAY8;
+  }
+  return DetectPixelLayout(
+      _vinfo.bits_per_pixel, _vinfo.red.offset, _vinfo.red.length,
+      _vinfo.green.offset, _vinfo.green.length, _vinfo.blue.offset,
+      _vinfo.blue.length);
+}
+
+void Framebuffer::Format::PackRow(
+    const uint8_t* rgba, int width, uint32_t* dest) const {
+  if (IsGray8()) {
+    for (int x = 0; x < width; ++x, rgba += 4) {
+      dest[x] = RGBToGray(rgba[0], rgba[1], rgba[2]);
+    }
+    return;
+  }
+  // Same as Pack(), with the shifts hoisted out of the loop.
+  const int red_shift = 8 - _vinfo.red.length,
+            red_offset = _vinfo.red.offset,
+            green_shift = 8 - _vinfo.green.length,
+            green_offset = _vinfo.green.offset,
+            blue_shift = 8 - _vinfo.blue.length,
+            blue_offset = _vinfo.blue.offset;
+  for (int x = 0; x < width; ++x, rgba += 4) {
+    dest[x] = ((static_cast<uint32_t>(rgba[0]) >> red_shift) << red_offset) |
+              ((static_cast<uint32_t>(rgba[1]) >> green_shift)
+               << green_offset) |
+              ((static_cast<uint32_t>(rgba[2]) >> blue_shift) << blue_offset);
+  }
+}
+
+void Framebuffer::Format::Unpack(
+    uint32_t value, uint8_t* r, uint8_t* g, uint8_t* b) const {
+  if (IsGray8()) {
+    *r = *g = *b = static_cast<uint8_t>(value);
+    return;
+  }
+  // Each channel is shifted to the top of a byte, and its high bits repeated
+  // below it, so that the maximum value of any length maps to 255.
+  const auto unpack_channel = [value](const fb_bitfield& bitfield) {
+    const uint32_t channel =
+        ((value >> bitfield.offset) & ((1u << bitfield.length) - 1))
+        << (8 - bitfield.length);
+    return static_cast<uint8_t>(channel | (channel >> bitfield.length));
+  };
+  *r = unpack_channel(_vinfo.red);
+  *g = unpack_channel(_vinfo.green);
+  *b = unpack_channel(_vinfo.blue);
+}
+
+bool Framebuffer::Format::IsGray8() const {
+  return (_vinfo.grayscale == 1) && (_vinfo.bits_per_pixel == 8);
+}
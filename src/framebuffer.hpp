@@ -29,45 +29,83 @@
 
 #include "pixel_buffer.hpp"
 
-// An abstraction for a framebuffer device.
+// An abstraction for a screen that pixel buffers are drawn on. Subclasses
+// provide the memory behind it, and show its pages.
 class Framebuffer {
  public:
   static const char* const DEFAULT_FRAMEBUFFER_DEVICE;
+  // Device names starting with this select a VirtualFramebuffer; the rest of
+  // the name is its spec.
+  static const char* const VIRTUAL_FRAMEBUFFER_PREFIX;
   // Factory method to initialize a framebuffer device and returns an
   // abstraction object. Returns nullptr if the initialization failed. Caller
-  // owns returned object.
+  // owns returned object. device is the path of a Linux framebuffer device,
+  // or VIRTUAL_FRAMEBUFFER_PREFIX followed by a VirtualFramebuffer spec.
+  // rotation is the clockwise rotation in degrees, a multiple of 90, applied
+  // to everything drawn on screen, for displays mounted sideways or upside
+  // down; sizes and coordinates are then those of the rotated screen. If
+  // double_buffered is true, frames are drawn off screen and shown all at
+  // once, if the device supports it.
   static Framebuffer* Open(
-      const std::string& device = DEFAULT_FRAMEBUFFER_DEVICE);
+      const std::string& device = DEFAULT_FRAMEBUFFER_DEVICE,
+      int rotation = 0, bool double_buffered = false);
   virtual ~Framebuffer();
 
   // Creates a new pixel buffer with the given size. The pixel buffer will have
   // the same color settings as the screen. Caller owns returned value.
   PixelBuffer* NewPixelBuffer(const PixelBuffer::Size& size);
 
-  // Retrieve the dimensions of the current display, in pixels.
+  // Retrieve the dimensions of the current display, in pixels, after rotation.
   PixelBuffer::Size GetSize() const;
-  // Retrieve the dimensions of the framebuffer device's allocated memory
-  // buffer, a.k.a. its virtual resolution, in pixels.
-  PixelBuffer::Size GetAllocatedSize() const;
-  // Retrieve the offset of the visible area within the device's allocated
-  // memory buffer, in pixels.
-  PixelBuffer::Size GetOffset() const;
+  // Retrieve the color format of the screen.
+  const PixelBuffer::Format* GetFormat() const;
 
   // Renders a region in a pixel buffer onto the framebuffer device. The region
   // must be equal to or smaller than the screen size. If smaller, the source
-  // rect is centered on screen.
-  void Render(const PixelBuffer& src, const PixelBuffer::Rect& rect);
+  // rect is centered on screen. If transform is not nullptr, it is applied to
+  // the pixels on the way.
+  void Render(
+      const PixelBuffer& src, const PixelBuffer::Rect& rect,
+      const ColorTransform* transform = nullptr);
+  // Renders a region in a pixel buffer onto the framebuffer device, with its
+  // top-left corner at (x, y) on screen. The region must fit on screen there.
+  void Render(
+      const PixelBuffer& src, const PixelBuffer::Rect& rect, int x, int y,
+      const ColorTransform* transform = nullptr);
+  // Sets a region of the screen to black.
+  void Clear(const PixelBuffer::Rect& rect);
+  // Moves a region of the screen so that its top-left corner is at (x, y).
+  // The region and its destination may overlap.
+  void Move(const PixelBuffer::Rect& rect, int x, int y);
+
+  // Starts a frame. Until EndFrame(), drawing goes to a back buffer if the
+  // framebuffer is double buffered. Each buffer keeps what was drawn on it two
+  // frames ago, so the frame must redraw everything that changed since the
+  // buffer given by GetBufferIndex() was last drawn, not just since the
+  // previous frame. Otherwise, drawing goes straight to the screen.
+  void BeginFrame();
+  // Ends a frame, flipping the back buffer onto the screen on the next
+  // vertical blank if the framebuffer is double buffered.
+  void EndFrame();
+  // Returns whether frames are drawn off screen then flipped onto it. This
+  // falls back to false if the device cannot pan.
+  bool IsDoubleBuffered() const;
+  // Returns the index of the buffer drawing goes to. When double buffered,
+  // this alternates between 0 and 1 from one frame to the next; otherwise it
+  // is always 0.
+  int GetBufferIndex() const;
 
   // Return debugging information as a string.
-  std::string GetDebugInfoString();
+  virtual std::string GetDebugInfoString() = 0;
+  // Picks the fastest way to write to the screen, which may take a moment the
+  // first time. Not done by Open() so that callers that only inspect the
+  // screen skip it. The default implementation does nothing.
+  virtual void TuneWrites();
 
-  // 
-  void WritePixel(int x, int y, uint8_t r, uint8_t g, uint8_t b)
-  {
-    _pixel_buffer->WritePixel(x, y, r, g, b);
-  }
+  // Writes a pixel value to a location on screen.
+  void WritePixel(int x, int y, uint8_t r, uint8_t g, uint8_t b);
 
- private:
+ protected:
   // Color format of the framebuffer.
   class Format : public PixelBuffer::Format {
    public:
@@ -79,33 +117,61 @@ class Framebuffer {
     int GetDepth() const override;
     // See PixelBuffer::Format.
     uint32_t Pack(uint8_t r, uint8_t g, uint8_t b) const override;
+    // See PixelBuffer::Format.
+    void PackRow(
+        const uint8_t* rgba, int width, uint32_t* dest) const override;
+    // See PixelBuffer::Format.
+    PixelLayout GetLayout() const override;
+    // Reverses Pack(), scaling each channel back up to 8 bits.
+    void Unpack(uint32_t value, uint8_t* r, uint8_t* g, uint8_t* b) const;
 
    private:
     fb_var_screeninfo _vinfo;
+
+    // Whether pixels are 8-bit grey levels rather than color channels.
+    bool IsGray8() const;
   };
 
-  // The framebuffer device.
-  const std::string _device;
-  // File descriptor of the opened framebuffer device.
-  int _fd;
-  // Framebuffer info structures.
+  // Resolution, pixel format and offset of the framebuffer, as the device
+  // describes them.
   fb_var_screeninfo _vinfo;
-  fb_fix_screeninfo _finfo;
-  // mmap'd buffer.
-  uint8_t* _buffer;
   std::unique_ptr<Format> _format;
-  // Pixel buffer object managing the mmap'ed buffer.
-  std::unique_ptr<PixelBuffer> _pixel_buffer;
+  // Pixel buffer objects managing the screens in the framebuffer memory: the
+  // visible one, and when double buffering, the one below it in the virtual
+  // resolution.
+  std::unique_ptr<PixelBuffer> _pages[2];
+  // The page drawing goes to.
+  PixelBuffer* _pixel_buffer;
+  // Clockwise rotation of the screen in degrees, normalized to [0, 360).
+  int _rotation;
+  // Whether frames are drawn to the page not shown, then flipped.
+  bool _is_double_buffered;
+  // Index of the page shown on screen.
+  int _front;
+  // Whether we are between BeginFrame() and EndFrame().
+  bool _is_in_frame;
+
+  // Contructors are reserved to subclasses, which are created with Open().
+  explicit Framebuffer(int rotation);
+
+  // Sets up _format and _pages from _vinfo and _is_double_buffered, for
+  // framebuffer memory of num_lines lines of line_length bytes. The first page
+  // starts at the offset in _vinfo, and the second one right below it.
+  void InitPages(uint8_t* buffer, int line_length, int num_lines);
+  // Shows the page with the given index, on the next vertical blank if
+  // possible. Returns false if the page cannot be shown.
+  virtual bool ShowPage(int index) = 0;
+  // Called by EndFrame() once the frame is on screen. The default
+  // implementation does nothing.
+  virtual void OnFrameShown();
 
-  // Contructors are disallowed. Use factory method Open() instead.
-  Framebuffer(const std::string& device);
+ private:
   // No copying is allowed.
   Framebuffer(const Framebuffer&);
   Framebuffer& operator=(const Framebuffer&);
 
-  // Returns the size of the mmap'd buffer in bytes.
-  int GetBufferByteSize() const;
+  // Returns where a rect on the rotated screen is on the device.
+  PixelBuffer::Rect GetDeviceRect(const PixelBuffer::Rect& rect) const;
 };
 
 #endif
-
@@ -29,10 +29,15 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "multithreading.hpp"
 
+// Number of image rows converted by a single ParallelFor() chunk in Render().
+static const int NUM_ROWS_PER_CHUNK = 32;
+
 // Converts degree angles to radian.
 static inline double ToRadians(int degrees) {
   return static_cast<double>(degrees) * M_PI / 180.0;
@@ -119,7 +124,10 @@ static inline std::string GetImlibLoadErrorName(Imlib_Load_Error load_error) {
   }
 }
 
+std::mutex ImageDocument::_imlib_mutex;
+
 Document* ImageDocument::Open(const std::string& path) {
+  std::unique_lock<std::mutex> lock(_imlib_mutex);
   Imlib_Image image = imlib_load_image_without_cache(path.c_str());
   if (image == nullptr) {
     Imlib_Load_Error load_error;
@@ -129,16 +137,19 @@ Document* ImageDocument::Open(const std::string& path) {
       return nullptr;
     }
   }
+  lock.unlock();
   return new ImageDocument(image);
 }
 
 ImageDocument::ImageDocument(Imlib_Image image) : _src(image) {
+  std::lock_guard<std::mutex> lock(_imlib_mutex);
   imlib_context_set_image(_src);
   _src_size.Width = imlib_image_get_width();
   _src_size.Height = imlib_image_get_height();
 }
 
 ImageDocument::~ImageDocument() {
+  std::lock_guard<std::mutex> lock(_imlib_mutex);
   imlib_context_set_image(_src);
   imlib_free_image();
 }
@@ -171,19 +182,27 @@ const Document::PageSize ImageDocument::GetPageSize(
 }
 
 void ImageDocument::Render(
-    Document::PixelWriter* pw, int page, float zoom, int rotation) {
+    Document::PixelWriter* pw, int page, float zoom, int rotation,
+    const PageRect& region, Quality quality, const CancellationToken* token) {
   assert(page == 0);
   const Rect& projected =
       ProjectRect(_src_size.Width, _src_size.Height, zoom, rotation);
-  const PageSize& dest_size = GetPageSize(page, zoom, rotation);
+  const PageSize& page_size = GetPageSize(page, zoom, rotation);
+  const PageSize dest_size(region.Width, region.Height);
+
+  // 1. Draw the region into a new image. The Imlib2 context is shared by all
+  // threads, so it is only used under _imlib_mutex.
+  std::unique_lock<std::mutex> lock(_imlib_mutex);
   Imlib_Image dest = imlib_create_image(dest_size.Width, dest_size.Height);
   imlib_context_set_image(dest);
   imlib_context_set_color(0, 0, 0, 255);
   imlib_image_fill_rectangle(0, 0, dest_size.Width, dest_size.Height);
+  imlib_context_set_anti_alias(quality != FAST);
 
+  // The center of the page, relative to the top-left corner of region.
   const Point dest_center(
-      static_cast<double>(dest_size.Width) / 2.0,
-      static_cast<double>(dest_size.Height) / 2.0);
+      static_cast<double>(page_size.Width) / 2.0 - region.X,
+      static_cast<double>(page_size.Height) / 2.0 - region.Y);
   const Point& dest_top_left = dest_center + projected.TopLeft;
   const Point& h_angle = projected.TopRight - projected.TopLeft;
 
@@ -191,25 +210,32 @@ void ImageDocument::Render(
       _src, 0, 0, 0, _src_size.Width, _src_size.Height, dest_top_left.X,
       dest_top_left.Y, h_angle.X, h_angle.Y);
 
+  // 2. Imlib2 stores pixels as native endian ARGB words, so each row is
+  // unpacked into RGBA bytes before being handed to pw. dest is ours alone, so
+  // its pixels are read without the lock.
   uint32_t* buffer =
       reinterpret_cast<uint32_t*>(imlib_image_get_data_for_reading_only());
-  ExecuteInParallel([=](int num_threads, int i) {
-    const int num_rows_per_thread = dest_size.Height / num_threads;
-    const int y_begin = i * num_rows_per_thread;
-    const int y_end = (i == num_threads - 1) ? dest_size.Height
-                                             : (i + 1) * num_rows_per_thread;
-    uint32_t* p = buffer + y_begin * dest_size.Width;
-    for (int y = y_begin; y < y_end; ++y) {
-      for (int x = 0; x < dest_size.Width; ++x) {
-        uint8_t r = static_cast<uint8_t>((*p) >> 16),
-                g = static_cast<uint8_t>((*p) >> 8),
-                b = static_cast<uint8_t>((*p) >> 0);
-        pw->Write(x, y, r, g, b);
-        ++p;
-      }
-    }
-  });
-
+  lock.unlock();
+  ParallelFor(
+      0, dest_size.Height, NUM_ROWS_PER_CHUNK, [=](int y_begin, int y_end) {
+        std::vector<uint8_t> row(dest_size.Width * 4);
+        uint32_t* p = buffer + y_begin * dest_size.Width;
+        for (int y = y_begin; y < y_end; ++y) {
+          uint8_t* q = row.data();
+          for (int x = 0; x < dest_size.Width; ++x) {
+            q[0] = static_cast<uint8_t>((*p) >> 16);
+            q[1] = static_cast<uint8_t>((*p) >> 8);
+            q[2] = static_cast<uint8_t>((*p) >> 0);
+            q += 4;
+            ++p;
+          }
+          pw->WriteRow(y, row.data(), dest_size.Width);
+        }
+      });
+
+  // 3. Free dest.
+  lock.lock();
+  imlib_context_set_image(dest);
   imlib_free_image();
 }
 
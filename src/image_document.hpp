@@ -25,6 +25,7 @@
 #ifndef IMAGE_DOCUMENT_HPP
 #define IMAGE_DOCUMENT_HPP
 
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -42,8 +43,12 @@ class ImageDocument : public Document {
   int GetNumPages() override { return 1; }
   // See Document.
   const PageSize GetPageSize(int page, float zoom, int rotation) override;
-  // See Document. Thread-safe.
-  void Render(PixelWriter* pw, int page, float zoom, int rotation) override;
+  // See Document. Thread-safe; Imlib2 calls are serialized by _imlib_mutex.
+  using Document::Render;
+  void Render(
+      PixelWriter* pw, int page, float zoom, int rotation,
+      const PageRect& region, Quality quality,
+      const CancellationToken* token) override;
   // See Document.
   const OutlineItem* GetOutline() override { return nullptr; }
   // See Document.
@@ -61,6 +66,9 @@ class ImageDocument : public Document {
   Imlib_Image _src;
   // Original (unscaled, unrotated) size of _src.
   PageSize _src_size;
+  // Lock guarding Imlib2 calls, which all go through a single process-wide
+  // context, and thus cannot run concurrently even on different images.
+  static std::mutex _imlib_mutex;
 
   // We disallow the constructor; use the factory method Open() instead.
   explicit ImageDocument(Imlib_Image image);
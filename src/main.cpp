@@ -46,9 +46,11 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cerrno>
 #include <climits>
 #include <cmath>
 #include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
@@ -61,6 +63,7 @@
 #include "fitz_document.hpp"
 #include "framebuffer.hpp"
 #include "image_document.hpp"
+#include "multithreading.hpp"
 #include "outline_view.hpp"
 #include "pdf_document.hpp"
 #include "search_view.hpp"
@@ -72,6 +75,10 @@ void reload_handler(int sig) {
   e_flag = 1;
 }
 
+// Interval between renders while the viewer shows previews of pages that are
+// still being rendered, in milliseconds.
+const int PROGRESSIVE_REFRESH_INTERVAL_MS = 50;
+
 // Main program state.
 struct State : public Viewer::State {
   // If true, just print debugging info and exit.
@@ -91,6 +98,17 @@ struct State : public Viewer::State {
   } DocumentType;
   // Viewer render cache size.
   int RenderCacheSize;
+  // Viewer render cache eviction policy.
+  Viewer::RenderCachePolicy RenderCachePolicy;
+  // Viewer render cache memory budget in bytes, or 0 for no limit.
+  size_t RenderCacheMemory;
+  // Memory budget for recorded pages in bytes, or 0 to disable.
+  size_t DisplayListCacheMemory;
+  // Whether to show previews of pages while they are rendered.
+  bool Progressive;
+  // Maximum time to wait for a page to render in milliseconds, or 0 for no
+  // limit.
+  int RenderDeadlineMs;
   // Input file.
   std::string FilePath;
   // Password for the input file. If no password is provided, this will be
@@ -98,6 +116,10 @@ struct State : public Viewer::State {
   std::unique_ptr<std::string> FilePassword;
   // Framebuffer device.
   std::string FramebufferDevice;
+  // Clockwise rotation of the display in degrees.
+  int DisplayRotation;
+  // Whether to draw pages off screen, then flip them onto it.
+  bool DoubleBuffer;
   // Document instance.
   std::unique_ptr<Document> DocumentInst;
   // Outline view instance.
@@ -117,9 +139,16 @@ struct State : public Viewer::State {
         Render(true),
         DocumentType(AUTO_DETECT),
         RenderCacheSize(Viewer::DEFAULT_RENDER_CACHE_SIZE),
+        RenderCachePolicy(Viewer::LRU),
+        RenderCacheMemory(0),
+        DisplayListCacheMemory(FitzDocument::DEFAULT_DISPLAY_LIST_CACHE_MEMORY),
+        Progressive(false),
+        RenderDeadlineMs(0),
         FilePath(""),
         FilePassword(),
         FramebufferDevice(Framebuffer::DEFAULT_FRAMEBUFFER_DEVICE),
+        DisplayRotation(0),
+        DoubleBuffer(false),
         OutlineViewInst(nullptr),
         SearchViewInst(nullptr),
         FramebufferInst(nullptr),
@@ -148,8 +177,9 @@ static std::string GetFileExtension(const std::string& path) {
 static bool LoadFile(State* state) {
 #if !defined(JFBVIEW_ENABLE_LEGACY_PDF_IMPL) && \
     !defined(JFBVIEW_ENABLE_LEGACY_IMAGE_IMPL)
-  Document* doc =
-      FitzDocument::Open(state->FilePath, state->FilePassword.get());
+  Document* doc = FitzDocument::Open(
+      state->FilePath, state->FilePassword.get(),
+      state->DisplayListCacheMemory);
 #else
   if (state->DocumentType == State::AUTO_DETECT) {
     if (GetFileExtension(state->FilePath) == "pdf") {
@@ -172,7 +202,9 @@ static bool LoadFile(State* state) {
 #ifdef JFBVIEW_ENABLE_LEGACY_PDF_IMPL
       doc = PDFDocument::Open(state->FilePath, state->FilePassword.get());
 #else
-      doc = FitzDocument::Open(state->FilePath, state->FilePassword.get());
+      doc = FitzDocument::Open(
+          state->FilePath, state->FilePassword.get(),
+          state->DisplayListCacheMemory);
 #endif
       break;
 #ifdef JFBVIEW_ENABLE_LEGACY_IMAGE_IMPL
@@ -183,7 +215,9 @@ static bool LoadFile(State* state) {
 #endif
 #else
     case State::IMAGE:
-      doc = FitzDocument::Open(state->FilePath, state->FilePassword.get());
+      doc = FitzDocument::Open(
+          state->FilePath, state->FilePassword.get(),
+          state->DisplayListCacheMemory);
       break;
 #endif
     default:
@@ -423,6 +457,8 @@ class ShowOutlineViewCommand : public Command {
  public:
   void Execute(int repeat, State* state) override {
     const Document::OutlineItem* dest = state->OutlineViewInst->Run();
+    // The view was drawn over.
+    state->ViewerInst->Invalidate();
     if (dest == nullptr) {
       return;
     }
@@ -438,6 +474,8 @@ class ShowSearchViewCommand : public Command {
  public:
   void Execute(int repeat, State* state) override {
     const int dest_page = state->SearchViewInst->Run();
+    // The view was drawn over.
+    state->ViewerInst->Invalidate();
     if (dest_page >= 0) {
       GoToPageCommand c(0);
       c.Execute(dest_page + 1, state);
@@ -475,10 +513,15 @@ class RestoreStateCommand : public StateCommand {
 class ReloadCommand : public StateCommand {
  public:
   void Execute(int repeat, State* state) override {
+    // The viewer's loader threads may be rendering from the old document, so
+    // the viewer must be gone before the document is replaced.
+    state->ViewerInst.reset();
     if (LoadFile(state)) {
       state->ViewerInst = std::make_unique<Viewer>(
           state->DocumentInst.get(), state->FramebufferInst.get(), *state,
-          state->RenderCacheSize);
+          state->RenderCacheSize, state->RenderCachePolicy,
+          state->RenderCacheMemory, state->Progressive,
+          state->RenderDeadlineMs);
     } else {
       state->Exit = true;
     }
@@ -503,6 +546,21 @@ class ToggleSepiaColorModeCommand : public Command {
   }
 };
 
+class ChangeBrightnessCommand : public Command {
+ public:
+  // Change in brightness per key press, in percent.
+  enum { BRIGHTNESS_STEP = 10 };
+
+  explicit ChangeBrightnessCommand(int increment) : _increment(increment) {}
+
+  void Execute(int repeat, State* state) override {
+    state->Brightness += RepeatOrDefault(repeat, 1) * _increment;
+  }
+
+ private:
+  int _increment;
+};
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  *                               END COMMANDS                                *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -681,6 +739,16 @@ static const char* HELP_STRING =
     "Options:\n"
     "\t--help, -h            Show this message.\n"
     "\t--fb=/path/to/dev     Specify output framebuffer device.\n"
+    "\t--fb=virtual:WxH[@FORMAT][:FILE]\n"
+    "\t                      Draw into memory instead, e.g.\n"
+    "\t                      --fb=virtual:1920x1080@rgb565. FORMAT is one\n"
+    "\t                      of rgb565, bgr565, xrgb8888 (default),\n"
+    "\t                      xbgr8888, bgrx8888, rgb888, bgr888 and gray8.\n"
+    "\t                      Frames are written to FILE as PPM images; %d\n"
+    "\t                      in FILE is replaced by the frame number.\n"
+    "\t--double_buffer       Draw pages off screen, then show them at once on\n"
+    "\t                      the next vertical blank, if the framebuffer\n"
+    "\t                      device supports panning.\n"
     "\t--password=xx, -P xx  Unlock PDF document with the given password.\n"
     "\t--page=N, -p N        Open page N on start up.\n"
     "\t--zoom=N, -z N        Set initial zoom to N. E.g., -z 150 sets \n"
@@ -688,10 +756,15 @@ static const char* HELP_STRING =
     "\t--zoom_to_fit         Start in automatic zoom-to-fit mode.\n"
     "\t--zoom_to_width       Start in automatic zoom-to-width mode.\n"
     "\t--rotation=N, -r N    Set initial rotation to N degrees clockwise.\n"
+    "\t--display_rotation=N  Rotate everything shown by N degrees clockwise,\n"
+    "\t                      a multiple of 90, for displays mounted sideways\n"
+    "\t                      or upside down.\n"
     "\t--color_mode=invert, -c invert\n"
     "\t                      Start in inverted color mode.\n"
     "\t--color_mode=sepia, -c sepia\n"
     "\t                      Start in sepia color mode.\n"
+    "\t--brightness=N        Set initial brightness to N percent, from 5 to\n"
+    "\t                      200. Values below 100 dim the screen.\n"
     "\t--interval=N, -i N    Set auto interval time in seconds \n"
     "\t--intervals=N, -j N,. Set auto intervals time in seconds \n"
     "\t--show_progress       Show progress circle \n"
@@ -705,11 +778,40 @@ static const char* HELP_STRING =
     "\t                      PDF document. Use this if your PDF file does not\n"
     "\t                      end in \".pdf\" (case is ignored).\n"
 #endif
-    "\t--cache_size=N        Cache at most N pages. If you have an older\n"
-    "\t                      machine with limited RAM, or if you are loading\n"
-    "\t                      huge documents, or if you just want to reduce\n"
-    "\t                      memory usage, you might want to set this to a\n"
-    "\t                      smaller number.\n"
+    "\t--cache_size=N        Cache at most N screens' worth of rendered\n"
+    "\t                      pages. If you have an older machine with limited\n"
+    "\t                      RAM, or if you just want to reduce memory usage,\n"
+    "\t                      you might want to set this to a smaller number.\n"
+    "\t--cache_mem=SIZE      Cache as much of rendered pages as fits in SIZE\n"
+    "\t                      bytes of memory. SIZE may end in K, M or G, e.g.\n"
+    "\t                      256M. Unless --cache_size is also given, this\n"
+    "\t                      replaces the limit on the number of screens.\n"
+    "\t--cache_mem=auto      Like --cache_mem, but use a quarter of the\n"
+    "\t                      memory available at startup.\n"
+    "\t--display_list_cache_mem=SIZE\n"
+    "\t                      Keep up to SIZE bytes of parsed pages in memory\n"
+    "\t                      to speed up re-rendering at a different zoom or\n"
+    "\t                      rotation. Defaults to 64M; 0 disables.\n"
+    "\t--cache_policy=lru|gdsf\n"
+    "\t                      Which cached page to drop when the cache is full:\n"
+    "\t                      the least recently viewed (lru, default), or the\n"
+    "\t                      cheapest to re-render for its size (gdsf).\n"
+    "\t--threads=N           Use N threads for rendering. Defaults to the\n"
+    "\t                      number of CPU cores.\n"
+    "\t--progressive         Show a low resolution preview of pages that are\n"
+    "\t                      slow to render, and refine it once rendering is\n"
+    "\t                      done.\n"
+    "\t--quality=fast|normal|best|adaptive\n"
+    "\t                      Trade rendering quality for speed: fast turns off\n"
+    "\t                      anti-aliasing, normal reduces it, and best\n"
+    "\t                      (default) renders at full quality. adaptive\n"
+    "\t                      renders drafts while you keep scrolling or\n"
+    "\t                      zooming, and full quality once you stop.\n"
+    "\t--render_deadline_ms=N\n"
+    "\t                      Wait at most N milliseconds for a page to\n"
+    "\t                      render, then show what is done so far and finish\n"
+    "\t                      the rest in the background. 0 (default) waits\n"
+    "\t                      for as long as it takes.\n"
     "\n"
     "jfbview home page: https://github.com/jichu4n/jfbview\n"
     "Bug reports & suggestions: https://github.com/jichu4n/jfbview/issues\n"
@@ -740,6 +842,66 @@ std::vector<int> split_intervals(const std::string& string, const std::string& s
   return list;
 }
 
+// Parses a byte size such as "4096", "512K", "256M" or "1G". Returns true on
+// success, or false if s is malformed or the size does not fit in a size_t.
+static bool ParseByteSize(const char* s, size_t* size) {
+  // strtoull() skips leading whitespace and accepts signs, which we don't.
+  if (!isdigit(static_cast<unsigned char>(*s))) {
+    return false;
+  }
+  char* end;
+  errno = 0;
+  const unsigned long long value = strtoull(s, &end, 10);
+  if (errno == ERANGE) {
+    return false;
+  }
+  int shift;
+  switch (toupper(*end)) {
+    case '\0':
+      shift = 0;
+      break;
+    case 'K':
+      shift = 10;
+      break;
+    case 'M':
+      shift = 20;
+      break;
+    case 'G':
+      shift = 30;
+      break;
+    default:
+      return false;
+  }
+  if ((shift > 0) && (end[1] != '\0') && (ToLower(end + 1) != "b")) {
+    return false;
+  }
+  if (value > (SIZE_MAX >> shift)) {
+    return false;
+  }
+  *size = static_cast<size_t>(value) << shift;
+  return true;
+}
+
+// Returns a render cache memory budget based on the memory available at
+// startup, or 0 if it cannot be determined.
+static size_t GetAutoRenderCacheMemory() {
+  // Fraction of available memory to use for the render cache.
+  const size_t AVAILABLE_MEMORY_DIVISOR = 4;
+  FILE* meminfo = fopen("/proc/meminfo", "r");
+  if (meminfo == nullptr) {
+    return 0;
+  }
+  unsigned long long available_kb = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), meminfo) != nullptr) {
+    if (sscanf(line, "MemAvailable: %llu kB", &available_kb) == 1) {
+      break;
+    }
+  }
+  fclose(meminfo);
+  return static_cast<size_t>(available_kb) * 1024 / AVAILABLE_MEMORY_DIVISOR;
+}
+
 // Parses the command line, and stores settings in state. Crashes the
 // program if the commnad line contains errors.
 static void ParseCommandLine(int argc, char* argv[], State* state) {
@@ -750,18 +912,31 @@ static void ParseCommandLine(int argc, char* argv[], State* state) {
     ZOOM_TO_FIT,
     FB,
     PRINT_FB_DEBUG_INFO_AND_EXIT,
+    NUM_THREADS,
+    RENDER_CACHE_POLICY,
+    RENDER_CACHE_MEMORY,
+    DISPLAY_LIST_CACHE_MEMORY,
+    BRIGHTNESS,
+    PROGRESSIVE,
+    RENDER_DEADLINE,
+    QUALITY,
+    DISPLAY_ROTATION,
+    DOUBLE_BUFFER,
   };
   // Command line options.
   static const option LongFlags[] = {
       {"help", false, nullptr, 'h'},
       {"fb", true, nullptr, FB},
+      {"double_buffer", false, nullptr, DOUBLE_BUFFER},
       {"password", true, nullptr, 'P'},
       {"page", true, nullptr, 'p'},
       {"zoom", true, nullptr, 'z'},
       {"zoom_to_width", false, nullptr, ZOOM_TO_WIDTH},
       {"zoom_to_fit", false, nullptr, ZOOM_TO_FIT},
       {"rotation", true, nullptr, 'r'},
+      {"display_rotation", true, nullptr, DISPLAY_ROTATION},
       {"color_mode", true, nullptr, 'c'},
+      {"brightness", true, nullptr, BRIGHTNESS},
       {"interval", true, nullptr, 'i'},
       {"intervals", true, nullptr, 'j'},
       {"show_progress", false, nullptr, 's'},
@@ -769,9 +944,17 @@ static void ParseCommandLine(int argc, char* argv[], State* state) {
       {"format", true, nullptr, 'f'},
       {"cache_size", true, nullptr, RENDER_CACHE_SIZE},
       {"fb_debug_info", false, nullptr, PRINT_FB_DEBUG_INFO_AND_EXIT},
+      {"threads", true, nullptr, NUM_THREADS},
+      {"cache_policy", true, nullptr, RENDER_CACHE_POLICY},
+      {"cache_mem", true, nullptr, RENDER_CACHE_MEMORY},
+      {"display_list_cache_mem", true, nullptr, DISPLAY_LIST_CACHE_MEMORY},
+      {"progressive", false, nullptr, PROGRESSIVE},
+      {"render_deadline_ms", true, nullptr, RENDER_DEADLINE},
+      {"quality", true, nullptr, QUALITY},
       {0, 0, 0, 0},
   };
   static const char* ShortFlags = "hP:p:z:r:c:i:j:s:b:f:";
+  bool has_render_cache_size = false;
 
   for (;;) {
     int opt_char = getopt_long(argc, argv, ShortFlags, LongFlags, nullptr);
@@ -785,6 +968,9 @@ static void ParseCommandLine(int argc, char* argv[], State* state) {
       case FB:
         state->FramebufferDevice = optarg;
         break;
+      case DOUBLE_BUFFER:
+        state->DoubleBuffer = true;
+        break;
       case 'f':
         if (ToLower(optarg) == "pdf") {
           state->DocumentType = State::PDF;
@@ -806,6 +992,38 @@ static void ParseCommandLine(int argc, char* argv[], State* state) {
           exit(EXIT_FAILURE);
         }
         state->RenderCacheSize = std::max(1, state->RenderCacheSize + 1);
+        has_render_cache_size = true;
+        break;
+      case RENDER_CACHE_MEMORY:
+        if (ToLower(optarg) == "auto") {
+          state->RenderCacheMemory = GetAutoRenderCacheMemory();
+          if (state->RenderCacheMemory == 0) {
+            fprintf(
+                stderr,
+                "Cannot determine available memory; using default render "
+                "cache size\n");
+          }
+        } else if (!ParseByteSize(optarg, &(state->RenderCacheMemory))) {
+          fprintf(stderr, "Invalid render cache memory \"%s\"\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case DISPLAY_LIST_CACHE_MEMORY:
+        if (!ParseByteSize(optarg, &(state->DisplayListCacheMemory))) {
+          fprintf(
+              stderr, "Invalid display list cache memory \"%s\"\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case RENDER_CACHE_POLICY:
+        if (ToLower(optarg) == "lru") {
+          state->RenderCachePolicy = Viewer::LRU;
+        } else if (ToLower(optarg) == "gdsf") {
+          state->RenderCachePolicy = Viewer::GDSF;
+        } else {
+          fprintf(stderr, "Invalid render cache policy \"%s\"\n", optarg);
+          exit(EXIT_FAILURE);
+        }
         break;
       case 'p':
         if (sscanf(optarg, "%d", &(state->Page)) < 1) {
@@ -833,6 +1051,13 @@ static void ParseCommandLine(int argc, char* argv[], State* state) {
           exit(EXIT_FAILURE);
         }
         break;
+      case DISPLAY_ROTATION:
+        if ((sscanf(optarg, "%d", &(state->DisplayRotation)) < 1) ||
+            (state->DisplayRotation % 90 != 0)) {
+          fprintf(stderr, "Invalid display rotation \"%s\"\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'c': {
         const std::string arg = ToLower(optarg);
         if (arg == "normal" || arg == "") {
@@ -847,6 +1072,38 @@ static void ParseCommandLine(int argc, char* argv[], State* state) {
         }
         break;
       }
+      case BRIGHTNESS:
+        if ((sscanf(optarg, "%d", &(state->Brightness)) < 1) ||
+            (state->Brightness < Viewer::MIN_BRIGHTNESS) ||
+            (state->Brightness > Viewer::MAX_BRIGHTNESS)) {
+          fprintf(stderr, "Invalid brightness \"%s\"\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case PROGRESSIVE:
+        state->Progressive = true;
+        break;
+      case QUALITY:
+        if (ToLower(optarg) == "fast") {
+          state->Quality = Viewer::QUALITY_FAST;
+        } else if (ToLower(optarg) == "normal") {
+          state->Quality = Viewer::QUALITY_NORMAL;
+        } else if (ToLower(optarg) == "best") {
+          state->Quality = Viewer::QUALITY_BEST;
+        } else if (ToLower(optarg) == "adaptive") {
+          state->Quality = Viewer::QUALITY_ADAPTIVE;
+        } else {
+          fprintf(stderr, "Invalid quality \"%s\"\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case RENDER_DEADLINE:
+        if ((sscanf(optarg, "%d", &(state->RenderDeadlineMs)) < 1) ||
+            (state->RenderDeadlineMs < 0)) {
+          fprintf(stderr, "Invalid render deadline \"%s\"\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'i':
         if (sscanf(optarg, "%d", &(state->Interval)) < 0) {
           fprintf(stderr, "Invalid interval \"%s\"\n", optarg);
@@ -871,11 +1128,23 @@ static void ParseCommandLine(int argc, char* argv[], State* state) {
       case PRINT_FB_DEBUG_INFO_AND_EXIT:
         state->PrintFBDebugInfoAndExit = true;
         break;
+      case NUM_THREADS: {
+        int num_threads;
+        if ((sscanf(optarg, "%d", &num_threads) < 1) || (num_threads < 1)) {
+          fprintf(stderr, "Invalid number of threads \"%s\"\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        SetNumThreads(num_threads);
+        break;
+      }
       default:
         fprintf(stderr, "Try \"-h\" for help.\n");
         exit(EXIT_FAILURE);
     }
   }
+  if ((state->RenderCacheMemory > 0) && !has_render_cache_size) {
+    state->RenderCacheSize = Viewer::UNLIMITED_RENDER_CACHE_SIZE;
+  }
   if (optind == argc) {
     if (!state->PrintFBDebugInfoAndExit) {
       fprintf(stderr, "No file specified. Try \"-h\" for help.\n");
@@ -948,6 +1217,12 @@ std::unique_ptr<Registry> BuildRegistry() {
 
   registry->Register('I', std::make_unique<ToggleInvertedColorModeCommand>());
   registry->Register('S', std::make_unique<ToggleSepiaColorModeCommand>());
+  registry->Register(
+      '(', std::make_unique<ChangeBrightnessCommand>(
+               -ChangeBrightnessCommand::BRIGHTNESS_STEP));
+  registry->Register(
+      ')', std::make_unique<ChangeBrightnessCommand>(
+               ChangeBrightnessCommand::BRIGHTNESS_STEP));
 
   return registry;
 }
@@ -1006,6 +1281,9 @@ Troubleshooting tips:
 
 3. Verify that the framebuffer device exists. If not, please supply the correct
    device with "--fb=<path to device>".
+
+4. To run without a framebuffer device, draw into memory with
+   "--fb=virtual:<width>x<height>".
 )";
 
 extern int JpdfgrepMain(int argc, char* argv[]);
@@ -1212,7 +1490,9 @@ int main(int argc, char* argv[]) {
     state.ShowProgress = prev_state.ShowProgress;
   }
 
-  state.FramebufferInst.reset(Framebuffer::Open(state.FramebufferDevice));
+  state.FramebufferInst.reset(
+      Framebuffer::Open(
+          state.FramebufferDevice, state.DisplayRotation, state.DoubleBuffer));
   if (state.FramebufferInst == nullptr) {
     fprintf(stderr, "%s", FRAMEBUFFER_ERROR_HELP_STR);
     exit(EXIT_FAILURE);
@@ -1222,6 +1502,7 @@ int main(int argc, char* argv[]) {
     PrintFBDebugInfo(state.FramebufferInst.get());
     exit(EXIT_SUCCESS);
   }
+  state.FramebufferInst->TuneWrites();
 
   if (!LoadFile(&state)) {
     exit(EXIT_FAILURE);
@@ -1241,7 +1522,8 @@ int main(int argc, char* argv[]) {
 
   state.ViewerInst = std::make_unique<Viewer>(
       state.DocumentInst.get(), state.FramebufferInst.get(), state,
-      state.RenderCacheSize);
+      state.RenderCacheSize, state.RenderCachePolicy, state.RenderCacheMemory,
+      state.Progressive, state.RenderDeadlineMs);
   std::unique_ptr<Registry> registry(BuildRegistry());
 
   state.OutlineViewInst =
@@ -1313,7 +1595,11 @@ int main(int argc, char* argv[]) {
 
     // If not set auto pager interval
     if (state.Interval == 0 and state.Intervals.size()==0) {
-      // 2.2. Grab input.
+      // 2.2. Grab input. While the viewer shows previews, stop waiting every
+      // now and then to render again, so that finished pages are shown.
+      timeout(
+          state.ViewerInst->IsRefining() ? PROGRESSIVE_REFRESH_INTERVAL_MS
+                                         : -1);
       int c;
       while (isdigit(c = getch())) {
         if (repeat == Command::NO_REPEAT) {
@@ -1322,7 +1608,13 @@ int main(int argc, char* argv[]) {
           repeat = repeat * 10 + c - '0';
         }
       }
+      timeout(-1);
       if (c == KEY_RESIZE) {
+        // We are back from another virtual terminal, which drew over us.
+        state.ViewerInst->Invalidate();
+        continue;
+      }
+      if (c == ERR) {
         continue;
       }
 
@@ -1333,6 +1625,10 @@ int main(int argc, char* argv[]) {
       int c = 0;
       // 2.2 Grab input.
       int wait_result = wait_timer(get_current_interval(state), state.ShowProgress ? state.FramebufferInst.get(): nullptr, gpio.get());
+      if (state.ShowProgress) {
+        // The progress circle was drawn over the view.
+        state.ViewerInst->Invalidate();
+      }
       if (wait_result == 'q' || wait_result == 'r') {
         state.Exit = true;
           if (wait_result == 'q') {e_flag = 0;}
@@ -1350,8 +1646,13 @@ int main(int argc, char* argv[]) {
   } while (!state.Exit);
 #endif
   
-  // 3. Clean up.
+  // 3. Clean up. The viewer's loader threads use the framebuffer, so the
+  // viewer is destroyed first.
+  const int num_render_overruns =
+      (state.ViewerInst != nullptr) ? state.ViewerInst->GetNumRenderOverruns()
+                                    : 0;
   state.OutlineViewInst.reset();
+  state.ViewerInst.reset();
   // Hack alert: Calling endwin() immediately after the framebuffer destructor
   // (which clears the screen) appears to cause a race condition where the next
   // shell prompt after this program exits would also get erased. Adding a
@@ -1359,6 +1660,11 @@ int main(int argc, char* argv[]) {
   state.FramebufferInst.reset();
   usleep(100 * 1000);
   endwin();
+  if (num_render_overruns > 0) {
+    fprintf(
+        stderr, "Rendering exceeded the deadline of %d ms %d times\n",
+        state.RenderDeadlineMs, num_render_overruns);
+  }
 
   // backup interval
   prev_state.Interval = state.Interval;
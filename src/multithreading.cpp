@@ -19,30 +19,236 @@
 #include "multithreading.hpp"
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
-int GetDefaultNumThreads() {
-  return std::min(2.0, sysconf(_SC_NPROCESSORS_ONLN) * 1.5);
+namespace {
+
+// Number of chunks to aim for per thread when the caller of ParallelFor() does
+// not specify a grain size. More than one chunk per thread gives work stealing
+// something to balance.
+const int DEFAULT_CHUNKS_PER_THREAD = 4;
+
+// Number of threads requested through SetNumThreads(), or 0 for the default.
+std::atomic<int> requested_num_threads(0);
+
+// A process-wide pool of persistent worker threads. Each worker owns a deque
+// of chunks. A worker pops chunks from the back of its own deque, and when
+// that runs dry, steals chunks from the front of the other workers' deques.
+class ThreadPool {
+ public:
+  // A single ParallelFor() invocation.
+  struct Job {
+    // The function to execute on each chunk.
+    const std::function<void(int, int)>* F;
+    // Number of chunks not yet completed.
+    std::atomic<int> NumRemainingChunks;
+    // Used to wake up the caller of ParallelFor() when the job completes.
+    std::mutex Mutex;
+    std::condition_variable Condition;
+  };
+  // A contiguous range of iterations belonging to a job.
+  struct Chunk {
+    Job* ParentJob;
+    int Begin, End;
+  };
+
+  // Spawns num_workers worker threads.
+  explicit ThreadPool(int num_workers);
+
+  // Enqueues the chunks of a job, and executes chunks until the job completes.
+  void Run(Job* job, const std::vector<Chunk>& chunks);
+
+ private:
+  // A deque of chunks owned by one worker thread.
+  struct WorkQueue {
+    std::mutex Mutex;
+    std::deque<Chunk> Chunks;
+  };
+
+  // Work queues, one per worker thread.
+  std::vector<std::unique_ptr<WorkQueue>> _queues;
+  // Total number of chunks sitting in work queues.
+  std::atomic<int> _num_queued_chunks;
+  // Used to wake up idle workers when new chunks are enqueued.
+  std::mutex _idle_mutex;
+  std::condition_variable _idle_condition;
+  // Round-robin counter used to distribute chunks enqueued by threads outside
+  // the pool.
+  std::atomic<unsigned> _next_queue;
+
+  // Main loop of a worker thread.
+  void WorkerMain(int index);
+  // Pops a chunk from the back of the queue with the given index, falling back
+  // to stealing from the front of other queues. index may be -1 for threads
+  // outside the pool. Returns false if there is no chunk to execute.
+  bool TryGetChunk(int index, Chunk* chunk);
+  // Executes a chunk and marks it complete.
+  void Execute(const Chunk& chunk);
+};
+
+// Index of the current thread in the pool, or -1 for threads outside the pool.
+thread_local int current_worker_index = -1;
+
+ThreadPool::ThreadPool(int num_workers)
+    : _num_queued_chunks(0), _next_queue(0) {
+  for (int i = 0; i < num_workers; ++i) {
+    _queues.emplace_back(new WorkQueue());
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    std::thread(&ThreadPool::WorkerMain, this, i).detach();
+  }
+}
+
+void ThreadPool::Run(Job* job, const std::vector<Chunk>& chunks) {
+  // 1. Enqueue chunks. A worker keeps chunks in its own queue, so that nested
+  // calls are executed depth-first. Other threads spread chunks over all
+  // queues.
+  for (const Chunk& chunk : chunks) {
+    const int index =
+        current_worker_index >= 0
+            ? current_worker_index
+            : static_cast<int>(_next_queue++ % _queues.size());
+    WorkQueue* queue = _queues[index].get();
+    std::lock_guard<std::mutex> lock(queue->Mutex);
+    queue->Chunks.push_back(chunk);
+    ++_num_queued_chunks;
+  }
+
+  // 2. Wake up idle workers. Taking the lock ensures that a worker which has
+  // just checked _num_queued_chunks is actually waiting before we notify.
+  { std::lock_guard<std::mutex> lock(_idle_mutex); }
+  _idle_condition.notify_all();
+
+  // 3. Help out until all chunks of the job have completed. If there is
+  // nothing left to steal, the remaining chunks are being executed by other
+  // threads, so we just wait for them.
+  while (job->NumRemainingChunks > 0) {
+    Chunk chunk;
+    if (TryGetChunk(current_worker_index, &chunk)) {
+      Execute(chunk);
+    } else {
+      std::unique_lock<std::mutex> lock(job->Mutex);
+      job->Condition.wait(lock, [job] { return job->NumRemainingChunks == 0; });
+    }
+  }
+  // 4. The thread that completed the last chunk may still hold the job's lock.
+  // Wait for it to let go before the job goes out of scope.
+  { std::lock_guard<std::mutex> lock(job->Mutex); }
+}
+
+void ThreadPool::WorkerMain(int index) {
+  current_worker_index = index;
+  for (;;) {
+    Chunk chunk;
+    if (TryGetChunk(index, &chunk)) {
+      Execute(chunk);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(_idle_mutex);
+    _idle_condition.wait(lock, [this] { return _num_queued_chunks > 0; });
+  }
+}
+
+bool ThreadPool::TryGetChunk(int index, Chunk* chunk) {
+  // 1. Pop from the back of our own queue.
+  if (index >= 0) {
+    WorkQueue* queue = _queues[index].get();
+    std::lock_guard<std::mutex> lock(queue->Mutex);
+    if (!queue->Chunks.empty()) {
+      *chunk = queue->Chunks.back();
+      queue->Chunks.pop_back();
+      --_num_queued_chunks;
+      return true;
+    }
+  }
+  // 2. Steal from the front of other queues, starting from our neighbor so
+  // that thieves spread out.
+  const int num_queues = _queues.size();
+  for (int i = 1; i <= num_queues; ++i) {
+    const int victim = (std::max(index, 0) + i) % num_queues;
+    if (victim == index) {
+      continue;
+    }
+    WorkQueue* queue = _queues[victim].get();
+    std::lock_guard<std::mutex> lock(queue->Mutex);
+    if (!queue->Chunks.empty()) {
+      *chunk = queue->Chunks.front();
+      queue->Chunks.pop_front();
+      --_num_queued_chunks;
+      return true;
+    }
+  }
+  return false;
 }
 
-void ExecuteInParallel(
-    const std::function<void(int, int)>& f, int num_threads) {
-  // 1. Set default value for num_threads if needed.
-  assert(num_threads >= 0);
-  if (num_threads <= 0) {
-    num_threads = GetDefaultNumThreads();
+void ThreadPool::Execute(const Chunk& chunk) {
+  Job* job = chunk.ParentJob;
+  (*job->F)(chunk.Begin, chunk.End);
+  // The caller of Run() may destroy the job as soon as it observes the count
+  // reaching zero, so the notification must happen under the job's lock.
+  std::lock_guard<std::mutex> lock(job->Mutex);
+  if (--job->NumRemainingChunks == 0) {
+    job->Condition.notify_all();
   }
+}
+
+// Returns the process-wide thread pool, creating it on first use. The pool is
+// intentionally leaked: worker threads are detached and live until the process
+// exits, so that ParallelFor() remains usable from any thread during shutdown.
+ThreadPool* GetThreadPool() {
+  static ThreadPool* const pool = new ThreadPool(GetNumThreads() - 1);
+  return pool;
+}
+
+}  // namespace
 
-  // 2. Spawn threads.
-  std::vector<std::thread> threads;
-  for (int i = 0; i < num_threads; ++i) {
-    threads.push_back(std::thread(f, num_threads, i));
+int GetDefaultNumThreads() {
+  return std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+void SetNumThreads(int num_threads) {
+  requested_num_threads = std::max(0, num_threads);
+}
+
+int GetNumThreads() {
+  const int num_threads = requested_num_threads;
+  return num_threads > 0 ? num_threads : GetDefaultNumThreads();
+}
+
+void ParallelFor(
+    int begin, int end, int grain, const std::function<void(int, int)>& f) {
+  if (begin >= end) {
+    return;
   }
 
-  // 3. Wait for threads to exit.
-  for (std::thread& thread : threads) {
-    thread.join();
+  // 1. Split the range into chunks.
+  const int num_iterations = end - begin;
+  const int num_threads = GetNumThreads();
+  if (grain <= 0) {
+    const int num_chunks = num_threads * DEFAULT_CHUNKS_PER_THREAD;
+    grain = std::max(1, (num_iterations + num_chunks - 1) / num_chunks);
+  }
+  if ((num_threads <= 1) || (num_iterations <= grain)) {
+    for (int chunk_begin = begin; chunk_begin < end; chunk_begin += grain) {
+      f(chunk_begin, std::min(end, chunk_begin + grain));
+    }
+    return;
   }
+  ThreadPool::Job job;
+  job.F = &f;
+  std::vector<ThreadPool::Chunk> chunks;
+  for (int chunk_begin = begin; chunk_begin < end; chunk_begin += grain) {
+    chunks.push_back({&job, chunk_begin, std::min(end, chunk_begin + grain)});
+  }
+  job.NumRemainingChunks = chunks.size();
+
+  // 2. Run them on the pool.
+  GetThreadPool()->Run(&job, chunks);
 }
@@ -23,14 +23,28 @@
 
 #include <functional>
 
-// Returns the sane default number of threads.
+// Returns the sane default number of threads, i.e. the number of online CPU
+// cores.
 extern int GetDefaultNumThreads();
 
-// Execute f in parallel. f is invoked with arguments (n, i) where n is the
-// total number of threads, and i is the index of the current thread (0-based).
-// num_threads specifies how many threads to spawn, and defaults to the number
-// of CPU cores. Blocks until all spawned threads exit.
-extern void ExecuteInParallel(
-    const std::function<void(int, int)> &f, int num_threads = 0);
+// Sets the number of threads used by ParallelFor(), including the calling
+// thread. A value <= 0 selects GetDefaultNumThreads(). Only takes effect if
+// called before the first call to ParallelFor(), since the worker pool is
+// created on first use.
+extern void SetNumThreads(int num_threads);
+
+// Returns the number of threads used by ParallelFor(), including the calling
+// thread.
+extern int GetNumThreads();
+
+// Executes f over the range [begin, end) in parallel. The range is split into
+// chunks of at most grain iterations, and f is invoked once per chunk with
+// arguments (chunk_begin, chunk_end). If grain <= 0, a chunk size is chosen
+// based on the number of threads. Chunks are executed by a process-wide pool
+// of persistent worker threads with work stealing, and the calling thread
+// helps out while waiting. Blocks until all chunks have been executed. May be
+// called recursively from within f.
+extern void ParallelFor(
+    int begin, int end, int grain, const std::function<void(int, int)>& f);
 
 #endif
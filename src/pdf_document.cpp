@@ -29,6 +29,7 @@
 extern "C" {
 #include "mupdf/pdf.h"
 }
+#include "cancellation_token.hpp"
 #include "detected_mupdf_version.hpp"
 #include "multithreading.hpp"
 #include "pdf_document.hpp"
@@ -114,6 +115,13 @@ extern "C" {
 const char* const PDFDocument::DEFAULT_ROOT_OUTLINE_ITEM_TITLE =
     "TABLE OF CONTENTS";
 
+namespace {
+
+// Number of pixmap rows converted by a single ParallelFor() chunk in Render().
+const int NUM_ROWS_PER_CHUNK = 32;
+
+}  // namespace
+
 PDFDocument* PDFDocument::Open(
     const std::string& path, const std::string* password, int page_cache_size) {
   fz_context* ctx = fz_new_context(nullptr, nullptr, FZ_STORE_DEFAULT);
@@ -182,47 +190,56 @@ const Document::PageSize PDFDocument::GetPageSize(
     int page, float zoom, int rotation) {
   assert((page >= 0) && (page < GetNumPages()));
   const fz_irect& bbox =
-      GetBoundingBox(GetPage(page), Transform(zoom, rotation));
+      GetBoundingBox(*GetPage(page), Transform(zoom, rotation));
   return PageSize(bbox.x1 - bbox.x0, bbox.y1 - bbox.y0);
 }
 
 void PDFDocument::Render(
-    Document::PixelWriter* pw, int page, float zoom, int rotation) {
+    Document::PixelWriter* pw, int page, float zoom, int rotation,
+    const PageRect& region, Quality quality, const CancellationToken* token) {
   assert((page >= 0) && (page < GetNumPages()));
 
   std::unique_lock<std::mutex> lock(_render_mutex);
 
   // 1. Init MuPDF structures.
   const fz_matrix& m = Transform(zoom, rotation);
-  pdf_page* page_struct = GetPage(page);
-  const fz_irect& bbox = GetBoundingBox(page_struct, m);
+  const PDFPageCache::Handle page_handle = GetPage(page);
+  pdf_page* page_struct = *page_handle;
+  const fz_irect& page_bbox = GetBoundingBox(page_struct, m);
+  fz_irect bbox;
+  bbox.x0 = page_bbox.x0 + region.X;
+  bbox.y0 = page_bbox.y0 + region.Y;
+  bbox.x1 = bbox.x0 + region.Width;
+  bbox.y1 = bbox.y0 + region.Height;
   fz_pixmap* pixmap = fz_new_pixmap_with_bbox(
       _fz_context, fz_device_rgb(_fz_context), FZ_OBJ(bbox), nullptr, 1);
   fz_device* dev = fz_new_draw_device(_fz_context, FZ_OBJ(fz_identity), pixmap);
 
-  // 2. Render page.
+  // 2. Render page, unless token is cancelled before we get to it. Cancelling
+  // it later makes MuPDF stop through the cookie.
   fz_clear_pixmap_with_value(_fz_context, pixmap, 0xff);
-  pdf_run_page(
-      _fz_context, _pdf_document, page_struct, dev, FZ_OBJ(m), nullptr);
+  fz_cookie cookie = {};
+  if (token != nullptr) {
+    token->Watch(&cookie.abort);
+  }
+  if (!cookie.abort) {
+    pdf_run_page(
+        _fz_context, _pdf_document, page_struct, dev, FZ_OBJ(m), &cookie);
+  }
+  if (token != nullptr) {
+    token->Unwatch(&cookie.abort);
+  }
 
-  // 3. Write pixmap to buffer. The page is vertically divided into n equal
-  // stripes, each copied to pw by one thread.
+  // 3. Write pixmap to buffer. The page is vertically divided into chunks of
+  // rows, which are copied to pw in parallel.
   assert(fz_pixmap_components(_fz_context, pixmap) == 4);
   uint8_t* buffer =
       reinterpret_cast<uint8_t*>(fz_pixmap_samples(_fz_context, pixmap));
   const int num_cols = fz_pixmap_width(_fz_context, pixmap);
   const int num_rows = fz_pixmap_height(_fz_context, pixmap);
-  ExecuteInParallel([=](int num_threads, int i) {
-    const int num_rows_per_thread = num_rows / num_threads;
-    const int y_begin = i * num_rows_per_thread;
-    const int y_end =
-        (i == num_threads - 1) ? num_rows : (i + 1) * num_rows_per_thread;
-    uint8_t* p = buffer + y_begin * num_cols * 4;
+  ParallelFor(0, num_rows, NUM_ROWS_PER_CHUNK, [=](int y_begin, int y_end) {
     for (int y = y_begin; y < y_end; ++y) {
-      for (int x = 0; x < num_cols; ++x) {
-        pw->Write(x, y, p[0], p[1], p[2]);
-        p += 4;
-      }
+      pw->WriteRow(y, buffer + y * num_cols * 4, num_cols);
     }
   });
 
@@ -265,7 +282,8 @@ std::vector<Document::SearchHit> PDFDocument::SearchOnPage(
 
 std::string PDFDocument::GetPageText(int page, int line_sep) {
   // 1. Init MuPDF structures.
-  pdf_page* page_struct = GetPage(page);
+  const PDFPageCache::Handle page_handle = GetPage(page);
+  pdf_page* page_struct = *page_handle;
 
 #if MUPDF_VERSION < 10012
   fz_stext_sheet* text_sheet = fz_new_stext_sheet(_fz_context);
@@ -418,7 +436,7 @@ void PDFDocument::PDFPageCache::Discard(
   pdf_drop_page(_parent->_fz_context, _parent->_pdf_document, page_struct);
 }
 
-pdf_page* PDFDocument::GetPage(int page) {
+PDFDocument::PDFPageCache::Handle PDFDocument::GetPage(int page) {
   assert((page >= 0) && (page < GetNumPages()));
   return _page_cache->Get(page);
 }
@@ -69,7 +69,11 @@ class PDFDocument : public Document {
   // See Document.
   const PageSize GetPageSize(int page, float zoom, int rotation) override;
   // See Document. Thread-safe.
-  void Render(PixelWriter* pw, int page, float zoom, int rotation) override;
+  using Document::Render;
+  void Render(
+      PixelWriter* pw, int page, float zoom, int rotation,
+      const PageRect& region, Quality quality,
+      const CancellationToken* token) override;
   // See Document.
   const OutlineItem* GetOutline() override;
   // See Document.
@@ -140,8 +144,9 @@ class PDFDocument : public Document {
 
   // Wrapper around pdf_load_page that implements caching. If _page_cache_size
   // is reached, throw out the oldest page. Will also attempt to load the pages
-  // before and after specified page. Returns the loaded page.
-  pdf_page* GetPage(int page);
+  // before and after specified page. Returns a handle to the loaded page, which
+  // keeps it from being freed while in use.
+  PDFPageCache::Handle GetPage(int page);
 
   // Constructs a transformation matrix from the given parameters.
   fz_matrix Transform(float zoom, int rotation);
@@ -23,13 +23,538 @@
 
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <vector>
 
+#include "color_transform.hpp"
 #include "multithreading.hpp"
 
+// As in pixel_converter.cpp, SSE2 is part of the x86-64 baseline, and NEON
+// kernels assume little endian byte order.
+#if defined(__SSE2__)
+#define JFBVIEW_PIXEL_BUFFER_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#define JFBVIEW_PIXEL_BUFFER_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Number of rows copied by a single ParallelFor() chunk in Copy().
+const int NUM_ROWS_PER_CHUNK = 64;
+
+// Number of bytes written by one iteration of StreamCopy(): a whole line of
+// a typical write-combining buffer.
+const int STREAM_BLOCK_SIZE = 64;
+
+// Number of pixels packed at a time by WriteRow().
+const int NUM_PIXELS_PER_PACK = 256;
+
+// Quarter turns are done in square blocks of this many pixels, so that the
+// source rows and destination rows touched by a block stay in the cache.
+const int ROTATE_BLOCK_SIZE = 64;
+
+// Filter weights used by smooth scaling are fixed point numbers with this many
+// fractional bits. With 7 bits, a byte scaled by a weight fits in a signed
+// 16-bit integer, and a pixel filtered along both axes in 32 bits.
+const int SCALE_WEIGHT_BITS = 7;
+const int SCALE_WEIGHT_ONE = 1 << SCALE_WEIGHT_BITS;
+
+// Source pixels contributing to each destination pixel along one axis of a
+// smooth scale. Destination pixel i is a weighted sum of the source pixels
+// starting from Begins[i], whose weights are Weights[Offsets[i]] through
+// Weights[Offsets[i + 1] - 1] and add up to SCALE_WEIGHT_ONE.
+struct ScaleTaps {
+  std::vector<int> Begins;
+  std::vector<int> Offsets;
+  std::vector<int16_t> Weights;
+};
+
+// Computes taps for scaling src_length pixels to dest_length pixels, with
+// bilinear interpolation when enlarging and a box filter when shrinking.
+ScaleTaps ComputeScaleTaps(int src_length, int dest_length) {
+  ScaleTaps taps;
+  taps.Begins.reserve(dest_length);
+  taps.Offsets.reserve(dest_length + 1);
+  for (int i = 0; i < dest_length; ++i) {
+    taps.Offsets.push_back(static_cast<int>(taps.Weights.size()));
+    if (dest_length >= src_length) {
+      // Interpolate between the two source pixels around the center of the
+      // destination pixel, clamping at the edges.
+      const double center = std::max(
+          0.0, std::min<double>(
+                   src_length - 1, (i + 0.5) * src_length / dest_length - 0.5));
+      const int begin = static_cast<int>(center);
+      const int weight = static_cast<int>(
+          std::lround((center - begin) * SCALE_WEIGHT_ONE));
+      taps.Begins.push_back(begin);
+      taps.Weights.push_back(static_cast<int16_t>(SCALE_WEIGHT_ONE - weight));
+      if (weight > 0) {
+        taps.Weights.push_back(static_cast<int16_t>(weight));
+      }
+    } else {
+      // The destination pixel covers [i * src_length, (i + 1) * src_length)
+      // and source pixel j covers [j * dest_length, (j + 1) * dest_length),
+      // in units of 1 / dest_length source pixels. Weights are rounded from
+      // the cumulative coverage, so that they add up exactly.
+      const long long begin = static_cast<long long>(i) * src_length;
+      const long long end = begin + src_length;
+      taps.Begins.push_back(static_cast<int>(begin / dest_length));
+      int previous_total = 0;
+      for (long long j = begin / dest_length; j * dest_length < end; ++j) {
+        const long long covered =
+            std::min(end, (j + 1) * dest_length) - begin;
+        const int total = static_cast<int>(
+            (covered * SCALE_WEIGHT_ONE + src_length / 2) / src_length);
+        taps.Weights.push_back(static_cast<int16_t>(total - previous_total));
+        previous_total = total;
+      }
+    }
+  }
+  taps.Offsets.push_back(static_cast<int>(taps.Weights.size()));
+  return taps;
+}
+
+// Computes the weighted sum of num_rows source rows of length bytes into dest.
+void BlendRows(
+    const uint8_t* const* rows, const int16_t* weights, int num_rows,
+    int length, uint16_t* dest) {
+  int i = 0;
+#if defined(JFBVIEW_PIXEL_BUFFER_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= length; i += 16) {
+    __m128i lo = zero, hi = zero;
+    for (int row = 0; row < num_rows; ++row) {
+      const __m128i value =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[row] + i));
+      const __m128i weight = _mm_set1_epi16(weights[row]);
+      lo = _mm_add_epi16(
+          lo, _mm_mullo_epi16(_mm_unpacklo_epi8(value, zero), weight));
+      hi = _mm_add_epi16(
+          hi, _mm_mullo_epi16(_mm_unpackhi_epi8(value, zero), weight));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i + 8), hi);
+  }
+#elif defined(JFBVIEW_PIXEL_BUFFER_NEON)
+  for (; i + 16 <= length; i += 16) {
+    uint16x8_t lo = vdupq_n_u16(0), hi = vdupq_n_u16(0);
+    for (int row = 0; row < num_rows; ++row) {
+      const uint8x16_t value = vld1q_u8(rows[row] + i);
+      const uint8x8_t weight = vdup_n_u8(static_cast<uint8_t>(weights[row]));
+      lo = vmlal_u8(lo, vget_low_u8(value), weight);
+      hi = vmlal_u8(hi, vget_high_u8(value), weight);
+    }
+    vst1q_u16(dest + i, lo);
+    vst1q_u16(dest + i + 8, hi);
+  }
+#endif
+  for (; i < length; ++i) {
+    int sum = 0;
+    for (int row = 0; row < num_rows; ++row) {
+      sum += rows[row][i] * weights[row];
+    }
+    dest[i] = static_cast<uint16_t>(sum);
+  }
+}
+
+// Converts a pixel channel filtered along both axes back to a byte.
+inline uint8_t RoundScaledChannel(uint32_t sum) {
+  return static_cast<uint8_t>(
+      (sum + (1u << (2 * SCALE_WEIGHT_BITS - 1))) >> (2 * SCALE_WEIGHT_BITS));
+}
+
+// Filters a row blended by BlendRows() horizontally into dest, for pixels of
+// depth bytes.
+template <int DEPTH>
+void ResampleRow(const uint16_t* src, const ScaleTaps& taps, uint8_t* dest) {
+  const int width = static_cast<int>(taps.Begins.size());
+  for (int x = 0; x < width; ++x, dest += DEPTH) {
+    const uint16_t* src_pixel = src + taps.Begins[x] * DEPTH;
+    const int16_t* weights = taps.Weights.data() + taps.Offsets[x];
+    const int num_taps = taps.Offsets[x + 1] - taps.Offsets[x];
+    for (int channel = 0; channel < DEPTH; ++channel) {
+      uint32_t sum = 0;
+      for (int tap = 0; tap < num_taps; ++tap) {
+        sum += src_pixel[tap * DEPTH + channel] * weights[tap];
+      }
+      dest[channel] = RoundScaledChannel(sum);
+    }
+  }
+}
+
+#if defined(JFBVIEW_PIXEL_BUFFER_SSE2)
+// Filters 4-byte pixels with one vector per pixel. Channels are paired across
+// two taps, so that _mm_madd_epi16 applies both weights at once.
+template <>
+void ResampleRow<4>(const uint16_t* src, const ScaleTaps& taps, uint8_t* dest) {
+  const int width = static_cast<int>(taps.Begins.size());
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rounding = _mm_set1_epi32(1 << (2 * SCALE_WEIGHT_BITS - 1));
+  for (int x = 0; x < width; ++x, dest += 4) {
+    const uint16_t* src_pixel = src + taps.Begins[x] * 4;
+    const int16_t* weights = taps.Weights.data() + taps.Offsets[x];
+    const int num_taps = taps.Offsets[x + 1] - taps.Offsets[x];
+    __m128i sum = rounding;
+    for (int tap = 0; tap < num_taps; tap += 2) {
+      const __m128i first = _mm_loadl_epi64(
+          reinterpret_cast<const __m128i*>(src_pixel + tap * 4));
+      const bool has_second = tap + 1 < num_taps;
+      const __m128i second =
+          has_second ? _mm_loadl_epi64(reinterpret_cast<const __m128i*>(
+                           src_pixel + tap * 4 + 4))
+                     : zero;
+      const int second_weight = has_second ? weights[tap + 1] : 0;
+      const __m128i weight =
+          _mm_set1_epi32((second_weight << 16) | weights[tap]);
+      sum = _mm_add_epi32(
+          sum, _mm_madd_epi16(_mm_unpacklo_epi16(first, second), weight));
+    }
+    sum = _mm_srli_epi32(sum, 2 * SCALE_WEIGHT_BITS);
+    sum = _mm_packs_epi32(sum, sum);
+    const int value = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    memcpy(dest, &value, 4);
+  }
+}
+#elif defined(JFBVIEW_PIXEL_BUFFER_NEON)
+template <>
+void ResampleRow<4>(const uint16_t* src, const ScaleTaps& taps, uint8_t* dest) {
+  const int width = static_cast<int>(taps.Begins.size());
+  for (int x = 0; x < width; ++x, dest += 4) {
+    const uint16_t* src_pixel = src + taps.Begins[x] * 4;
+    const int16_t* weights = taps.Weights.data() + taps.Offsets[x];
+    const int num_taps = taps.Offsets[x + 1] - taps.Offsets[x];
+    uint32x4_t sum = vdupq_n_u32(0);
+    for (int tap = 0; tap < num_taps; ++tap) {
+      sum = vmlal_n_u16(
+          sum, vld1_u16(src_pixel + tap * 4),
+          static_cast<uint16_t>(weights[tap]));
+    }
+    const uint16x4_t value = vrshrn_n_u32(sum, 2 * SCALE_WEIGHT_BITS);
+    const uint8x8_t bytes = vmovn_u16(vcombine_u16(value, value));
+    vst1_lane_u32(
+        reinterpret_cast<uint32_t*>(dest), vreinterpret_u32_u8(bytes), 0);
+  }
+}
+#endif
+
+// Transposes a square block of SIZE x SIZE pixels of DEPTH bytes: pixel i of
+// src_rows[j] is copied to pixel j of dest_rows[i]. This is the portable
+// version; SIMD versions below replace it for some depths.
+template <int DEPTH>
+struct TransposeKernel {
+  enum { SIZE = 4 };
+  static void Transpose(
+      const uint8_t* const* src_rows, uint8_t* const* dest_rows) {
+    for (int i = 0; i < SIZE; ++i) {
+      for (int j = 0; j < SIZE; ++j) {
+        memcpy(dest_rows[i] + j * DEPTH, src_rows[j] + i * DEPTH, DEPTH);
+      }
+    }
+  }
+};
+
+#if defined(JFBVIEW_PIXEL_BUFFER_SSE2)
+// Transposes 8x8 bytes with three rounds of interleaving.
+template <>
+struct TransposeKernel<1> {
+  enum { SIZE = 8 };
+  static void Transpose(
+      const uint8_t* const* src_rows, uint8_t* const* dest_rows) {
+    __m128i rows[SIZE];
+    for (int j = 0; j < SIZE; ++j) {
+      rows[j] = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src_rows[j]));
+    }
+    // Row pairs, then quadruples, then octuples of each column.
+    const __m128i pairs[] = {
+        _mm_unpacklo_epi8(rows[0], rows[1]),
+        _mm_unpacklo_epi8(rows[2], rows[3]),
+        _mm_unpacklo_epi8(rows[4], rows[5]),
+        _mm_unpacklo_epi8(rows[6], rows[7]),
+    };
+    const __m128i quads[] = {
+        _mm_unpacklo_epi16(pairs[0], pairs[1]),
+        _mm_unpackhi_epi16(pairs[0], pairs[1]),
+        _mm_unpacklo_epi16(pairs[2], pairs[3]),
+        _mm_unpackhi_epi16(pairs[2], pairs[3]),
+    };
+    const __m128i columns[] = {
+        _mm_unpacklo_epi32(quads[0], quads[2]),
+        _mm_unpackhi_epi32(quads[0], quads[2]),
+        _mm_unpacklo_epi32(quads[1], quads[3]),
+        _mm_unpackhi_epi32(quads[1], quads[3]),
+    };
+    for (int i = 0; i < SIZE / 2; ++i) {
+      _mm_storel_epi64(
+          reinterpret_cast<__m128i*>(dest_rows[2 * i]), columns[i]);
+      _mm_storel_epi64(
+          reinterpret_cast<__m128i*>(dest_rows[2 * i + 1]),
+          _mm_unpackhi_epi64(columns[i], columns[i]));
+    }
+  }
+};
+
+// Transposes 8x8 16-bit pixels with three rounds of interleaving.
+template <>
+struct TransposeKernel<2> {
+  enum { SIZE = 8 };
+  static void Transpose(
+      const uint8_t* const* src_rows, uint8_t* const* dest_rows) {
+    __m128i rows[SIZE];
+    for (int j = 0; j < SIZE; ++j) {
+      rows[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_rows[j]));
+    }
+    __m128i pairs[SIZE];
+    for (int j = 0; j < SIZE / 2; ++j) {
+      pairs[j] = _mm_unpacklo_epi16(rows[2 * j], rows[2 * j + 1]);
+      pairs[j + SIZE / 2] = _mm_unpackhi_epi16(rows[2 * j], rows[2 * j + 1]);
+    }
+    // pairs[0..3] hold columns 0-3 of row pairs 0..3, and pairs[4..7]
+    // columns 4-7.
+    for (int half = 0; half < 2; ++half) {
+      const __m128i* p = pairs + half * SIZE / 2;
+      const __m128i quads[] = {
+          _mm_unpacklo_epi32(p[0], p[1]),
+          _mm_unpackhi_epi32(p[0], p[1]),
+          _mm_unpacklo_epi32(p[2], p[3]),
+          _mm_unpackhi_epi32(p[2], p[3]),
+      };
+      uint8_t* const* dest = dest_rows + half * SIZE / 2;
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dest[0]),
+          _mm_unpacklo_epi64(quads[0], quads[2]));
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dest[1]),
+          _mm_unpackhi_epi64(quads[0], quads[2]));
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dest[2]),
+          _mm_unpacklo_epi64(quads[1], quads[3]));
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dest[3]),
+          _mm_unpackhi_epi64(quads[1], quads[3]));
+    }
+  }
+};
+
+// Transposes 4x4 32-bit pixels with two rounds of interleaving.
+template <>
+struct TransposeKernel<4> {
+  enum { SIZE = 4 };
+  static void Transpose(
+      const uint8_t* const* src_rows, uint8_t* const* dest_rows) {
+    __m128i rows[SIZE];
+    for (int j = 0; j < SIZE; ++j) {
+      rows[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_rows[j]));
+    }
+    const __m128i pairs[] = {
+        _mm_unpacklo_epi32(rows[0], rows[1]),
+        _mm_unpacklo_epi32(rows[2], rows[3]),
+        _mm_unpackhi_epi32(rows[0], rows[1]),
+        _mm_unpackhi_epi32(rows[2], rows[3]),
+    };
+    for (int i = 0; i < SIZE / 2; ++i) {
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dest_rows[2 * i]),
+          _mm_unpacklo_epi64(pairs[2 * i], pairs[2 * i + 1]));
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dest_rows[2 * i + 1]),
+          _mm_unpackhi_epi64(pairs[2 * i], pairs[2 * i + 1]));
+    }
+  }
+};
+#elif defined(JFBVIEW_PIXEL_BUFFER_NEON)
+// Transposes 4x4 32-bit pixels by transposing 2x2 blocks of pixels, then
+// swapping the off-diagonal blocks.
+template <>
+struct TransposeKernel<4> {
+  enum { SIZE = 4 };
+  static void Transpose(
+      const uint8_t* const* src_rows, uint8_t* const* dest_rows) {
+    uint32x4_t rows[SIZE];
+    for (int j = 0; j < SIZE; ++j) {
+      rows[j] = vreinterpretq_u32_u8(vld1q_u8(src_rows[j]));
+    }
+    const uint32x4x2_t top = vtrnq_u32(rows[0], rows[1]);
+    const uint32x4x2_t bottom = vtrnq_u32(rows[2], rows[3]);
+    const uint32x4_t columns[] = {
+        vcombine_u32(vget_low_u32(top.val[0]), vget_low_u32(bottom.val[0])),
+        vcombine_u32(vget_low_u32(top.val[1]), vget_low_u32(bottom.val[1])),
+        vcombine_u32(vget_high_u32(top.val[0]), vget_high_u32(bottom.val[0])),
+        vcombine_u32(vget_high_u32(top.val[1]), vget_high_u32(bottom.val[1])),
+    };
+    for (int i = 0; i < SIZE; ++i) {
+      vst1q_u8(dest_rows[i], vreinterpretq_u8_u32(columns[i]));
+    }
+  }
+};
+#endif
+
+// Rotates source rows [y_begin, y_end) of a width x height region of DEPTH
+// byte pixels at src by a quarter turn into dest, clockwise or
+// counterclockwise. Strides are in bytes.
+template <int DEPTH>
+void RotateQuarterTurn(
+    const uint8_t* src, size_t src_stride, int width, int height,
+    bool clockwise, uint8_t* dest, size_t dest_stride, int y_begin,
+    int y_end) {
+  typedef TransposeKernel<DEPTH> Kernel;
+  const int n = Kernel::SIZE;
+  // Source pixel (x, y) goes to (height - 1 - y, x) when turning clockwise,
+  // and to (y, width - 1 - x) otherwise.
+  const auto get_dest = [=](int x, int y) {
+    return clockwise
+               ? dest + x * dest_stride + (height - 1 - y) * DEPTH
+               : dest + (width - 1 - x) * dest_stride + y * DEPTH;
+  };
+  const auto rotate_pixels = [=](int x0, int x1, int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        memcpy(get_dest(x, y), src + y * src_stride + x * DEPTH, DEPTH);
+      }
+    }
+  };
+  for (int block_y = y_begin; block_y < y_end;
+       block_y += ROTATE_BLOCK_SIZE) {
+    const int block_y_end = std::min(y_end, block_y + ROTATE_BLOCK_SIZE);
+    for (int block_x = 0; block_x < width; block_x += ROTATE_BLOCK_SIZE) {
+      const int block_x_end = std::min(width, block_x + ROTATE_BLOCK_SIZE);
+      int y = block_y;
+      for (; y + n <= block_y_end; y += n) {
+        int x = block_x;
+        for (; x + n <= block_x_end; x += n) {
+          // Clockwise, the columns of the block are read bottom up, so the
+          // source rows are given in reverse order.
+          const uint8_t* src_rows[Kernel::SIZE];
+          uint8_t* dest_rows[Kernel::SIZE];
+          for (int i = 0; i < n; ++i) {
+            src_rows[i] = src + (clockwise ? y + n - 1 - i : y + i) *
+                                    src_stride +
+                          x * DEPTH;
+            dest_rows[i] = clockwise ? get_dest(x + i, y + n - 1)
+                                     : get_dest(x + i, y);
+          }
+          Kernel::Transpose(src_rows, dest_rows);
+        }
+        rotate_pixels(x, block_x_end, y, y + n);
+      }
+      rotate_pixels(block_x, block_x_end, y, block_y_end);
+    }
+  }
+}
+
+// Copies width pixels of DEPTH bytes from src to dest in reverse order.
+template <int DEPTH>
+void ReverseRow(const uint8_t* src, int width, uint8_t* dest) {
+  for (int x = 0; x < width; ++x) {
+    memcpy(dest + (width - 1 - x) * DEPTH, src + x * DEPTH, DEPTH);
+  }
+}
+
+// Returns whether pixels of layout store each channel in a whole byte, so that
+// they can be filtered byte by byte.
+bool HasByteChannels(PixelLayout layout) {
+  switch (layout) {
+    case PixelLayout::XRGB8888:
+    case PixelLayout::XBGR8888:
+    case PixelLayout::BGRX8888:
+    case PixelLayout::RGB888:
+    case PixelLayout::BGR888:
+    case PixelLayout::GRAY8:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Copies size bytes from src to dest, which must not overlap, for memory
+// that is mapped uncached and write-combined: dest is written in aligned
+// blocks that fill whole write-combining lines, with SSE2 non-temporal stores
+// that bypass the CPU caches where available. FinishStreamingStores() must be
+// called before the data is handed over to another thread.
+void StreamCopy(uint8_t* dest, const uint8_t* src, size_t size) {
+#if defined(JFBVIEW_PIXEL_BUFFER_SSE2) || defined(JFBVIEW_PIXEL_BUFFER_NEON)
+  // 1. Copy up to the first block boundary in dest.
+  const size_t head = std::min(
+      size, (STREAM_BLOCK_SIZE -
+             reinterpret_cast<uintptr_t>(dest) % STREAM_BLOCK_SIZE) %
+                STREAM_BLOCK_SIZE);
+  memcpy(dest, src, head);
+  dest += head;
+  src += head;
+  size -= head;
+
+  // 2. Copy whole blocks.
+  for (; size >= STREAM_BLOCK_SIZE;
+       dest += STREAM_BLOCK_SIZE, src += STREAM_BLOCK_SIZE,
+       size -= STREAM_BLOCK_SIZE) {
+#if defined(JFBVIEW_PIXEL_BUFFER_SSE2)
+    const __m128i* src_block = reinterpret_cast<const __m128i*>(src);
+    __m128i* dest_block = reinterpret_cast<__m128i*>(dest);
+    const __m128i a = _mm_loadu_si128(src_block),
+                  b = _mm_loadu_si128(src_block + 1),
+                  c = _mm_loadu_si128(src_block + 2),
+                  d = _mm_loadu_si128(src_block + 3);
+    _mm_stream_si128(dest_block, a);
+    _mm_stream_si128(dest_block + 1, b);
+    _mm_stream_si128(dest_block + 2, c);
+    _mm_stream_si128(dest_block + 3, d);
+#else
+    const uint8x16_t a = vld1q_u8(src), b = vld1q_u8(src + 16),
+                     c = vld1q_u8(src + 32), d = vld1q_u8(src + 48);
+    vst1q_u8(dest, a);
+    vst1q_u8(dest + 16, b);
+    vst1q_u8(dest + 32, c);
+    vst1q_u8(dest + 48, d);
+#endif
+  }
+#endif
+
+  // 3. Copy the rest.
+  memcpy(dest, src, size);
+}
+
+// Makes the writes of StreamCopy() on the calling thread visible to others.
+void FinishStreamingStores() {
+#if defined(JFBVIEW_PIXEL_BUFFER_SSE2)
+  _mm_sfence();
+#endif
+}
+
+// Executes f over the rows [0, num_rows) as ParallelFor() does, but in chunks
+// of rows and with at most as many threads at once as settings say.
+void ParallelForRows(
+    int num_rows, const PixelBuffer::WriteSettings& settings,
+    const std::function<void(int, int)>& f) {
+  const int num_rows_per_chunk = (settings.NumRowsPerChunk > 0)
+                                     ? settings.NumRowsPerChunk
+                                     : NUM_ROWS_PER_CHUNK;
+  if (settings.NumThreads <= 0) {
+    ParallelFor(0, num_rows, num_rows_per_chunk, f);
+    return;
+  }
+  // Start one task per thread, each of which takes chunks until none are left.
+  const int num_chunks = (num_rows + num_rows_per_chunk - 1) /
+                         num_rows_per_chunk;
+  std::atomic<int> next_chunk(0);
+  ParallelFor(0, std::min(settings.NumThreads, num_chunks), 1, [&](int, int) {
+    for (int chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++) {
+      const int begin = chunk * num_rows_per_chunk;
+      f(begin, std::min(begin + num_rows_per_chunk, num_rows));
+    }
+  });
+}
+
+}  // namespace
+
 PixelBuffer::PixelBuffer(
     const PixelBuffer::Size& size, const PixelBuffer::Format* format)
     : _size(size),
@@ -75,9 +600,264 @@ void PixelBuffer::WritePixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   _pixel_writer_impl->WritePixel(_format->Pack(r, g, b), GetPixelAddress(x, y));
 }
 
-void PixelBuffer::Copy(
+void PixelBuffer::WriteRow(int x, int y, const uint8_t* rgba, int width) {
+  assert((x >= 0) && (x + width <= _size.Width));
+  if (_row_converter != nullptr) {
+    _row_converter(rgba, width, GetPixelAddress(x, y));
+    return;
+  }
+  // Pixels are packed in chunks into a buffer on the stack, then stored with
+  // the writer for our depth. This makes two virtual calls per chunk instead
+  // of two per pixel.
+  uint32_t values[NUM_PIXELS_PER_PACK];
+  const int depth = _format->GetDepth();
+  uint8_t* dest = GetPixelAddress(x, y);
+  for (int i = 0; i < width; i += NUM_PIXELS_PER_PACK) {
+    const int n = std::min(NUM_PIXELS_PER_PACK, width - i);
+    _format->PackRow(rgba + i * 4, n, values);
+    _pixel_writer_impl->WritePixels(values, n, dest + i * depth);
+  }
+}
+
+void PixelBuffer::Clear(const PixelBuffer::Rect& rect) {
+  assert(_size.Width >= rect.X + rect.Width);
+  assert(_size.Height >= rect.Y + rect.Height);
+  if (rect.Width <= 0) {
+    return;
+  }
+  for (int y = 0; y < rect.Height; ++y) {
+    memset(
+        GetPixelAddress(rect.X, rect.Y + y), 0,
+        rect.Width * _format->GetDepth());
+  }
+}
+
+void PixelBuffer::Move(
+    const PixelBuffer::Rect& src_rect, int dest_x, int dest_y) {
+  assert(_size.Width >= src_rect.X + src_rect.Width);
+  assert(_size.Height >= src_rect.Y + src_rect.Height);
+  assert((dest_x >= 0) && (_size.Width >= dest_x + src_rect.Width));
+  assert((dest_y >= 0) && (_size.Height >= dest_y + src_rect.Height));
+  if ((src_rect.Width <= 0) || (src_rect.Height <= 0)) {
+    return;
+  }
+  // When moving down, rows are moved bottom up so that none is overwritten
+  // before it is moved.
+  const size_t row_size =
+      static_cast<size_t>(src_rect.Width) * _format->GetDepth();
+  for (int i = 0; i < src_rect.Height; ++i) {
+    const int y = (dest_y > src_rect.Y) ? src_rect.Height - 1 - i : i;
+    memmove(
+        GetPixelAddress(dest_x, dest_y + y),
+        GetPixelAddress(src_rect.X, src_rect.Y + y), row_size);
+  }
+}
+
+void PixelBuffer::Scale(
+    const PixelBuffer::Rect& src_rect, const PixelBuffer::Rect& dest_rect,
+    PixelBuffer* dest, ScaleFilter filter) const {
+  assert(_format->GetDepth() == dest->_format->GetDepth());
+  assert(_size.Width >= src_rect.X + src_rect.Width);
+  assert(_size.Height >= src_rect.Y + src_rect.Height);
+  assert(dest->_size.Width >= dest_rect.X + dest_rect.Width);
+  assert(dest->_size.Height >= dest_rect.Y + dest_rect.Height);
+  if ((src_rect.Width <= 0) || (src_rect.Height <= 0) ||
+      (dest_rect.Width <= 0) || (dest_rect.Height <= 0)) {
+    return;
+  }
+  if ((filter == SMOOTH) && HasByteChannels(_format->GetLayout()) &&
+      (dest->_format->GetLayout() == _format->GetLayout())) {
+    ScaleSmooth(src_rect, dest_rect, dest);
+    return;
+  }
+
+  // 1. Find the source column sampled by each destination column, at the
+  // center of the destination pixel.
+  const int depth = _format->GetDepth();
+  std::vector<int> src_offsets(dest_rect.Width);
+  for (int x = 0; x < dest_rect.Width; ++x) {
+    src_offsets[x] = static_cast<int>(
+                         (2LL * x + 1) * src_rect.Width /
+                         (2LL * dest_rect.Width)) *
+                     depth;
+  }
+
+  // 2. Launch workers to fill destination rows.
+  ParallelFor(0, dest_rect.Height, NUM_ROWS_PER_CHUNK, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      const int src_y = src_rect.Y + static_cast<int>(
+                                         (2LL * y + 1) * src_rect.Height /
+                                         (2LL * dest_rect.Height));
+      const uint8_t* src_row = GetPixelAddress(src_rect.X, src_y);
+      uint8_t* dest_row = dest->GetPixelAddress(dest_rect.X, dest_rect.Y + y);
+      for (int x = 0; x < dest_rect.Width; ++x, dest_row += depth) {
+        memcpy(dest_row, src_row + src_offsets[x], depth);
+      }
+    }
+  });
+}
+
+void PixelBuffer::ScaleSmooth(
     const PixelBuffer::Rect& src_rect, const PixelBuffer::Rect& dest_rect,
     PixelBuffer* dest) const {
+  // 1. Compute filter taps along each axis. The filter is separable, so each
+  // destination row is computed by blending source rows into a row of
+  // intermediate values, which is then filtered horizontally.
+  const int depth = _format->GetDepth();
+  const ScaleTaps x_taps = ComputeScaleTaps(src_rect.Width, dest_rect.Width);
+  const ScaleTaps y_taps =
+      ComputeScaleTaps(src_rect.Height, dest_rect.Height);
+
+  // 2. Launch workers to fill destination rows.
+  ParallelFor(0, dest_rect.Height, NUM_ROWS_PER_CHUNK, [&](int begin, int end) {
+    std::vector<uint16_t> blended_row(src_rect.Width * depth);
+    std::vector<const uint8_t*> src_rows;
+    for (int y = begin; y < end; ++y) {
+      const int num_rows = y_taps.Offsets[y + 1] - y_taps.Offsets[y];
+      src_rows.clear();
+      for (int row = 0; row < num_rows; ++row) {
+        src_rows.push_back(
+            GetPixelAddress(src_rect.X, src_rect.Y + y_taps.Begins[y] + row));
+      }
+      BlendRows(
+          src_rows.data(), y_taps.Weights.data() + y_taps.Offsets[y], num_rows,
+          src_rect.Width * depth, blended_row.data());
+      uint8_t* dest_row = dest->GetPixelAddress(dest_rect.X, dest_rect.Y + y);
+      switch (depth) {
+        case 1:
+          ResampleRow<1>(blended_row.data(), x_taps, dest_row);
+          break;
+        case 3:
+          ResampleRow<3>(blended_row.data(), x_taps, dest_row);
+          break;
+        case 4:
+          ResampleRow<4>(blended_row.data(), x_taps, dest_row);
+          break;
+        default:
+          assert(false);
+      }
+    }
+  });
+}
+
+void PixelBuffer::Rotate(
+    const PixelBuffer::Rect& src_rect, int rotation, PixelBuffer* dest,
+    int dest_x, int dest_y, const ColorTransform* transform) const {
+  rotation = ((rotation % 360) + 360) % 360;
+  assert(rotation % 90 == 0);
+  const bool is_quarter_turn = (rotation == 90) || (rotation == 270);
+  const int dest_width = is_quarter_turn ? src_rect.Height : src_rect.Width;
+  const int dest_height = is_quarter_turn ? src_rect.Width : src_rect.Height;
+  assert(_format->GetDepth() == dest->_format->GetDepth());
+  assert(_size.Width >= src_rect.X + src_rect.Width);
+  assert(_size.Height >= src_rect.Y + src_rect.Height);
+  assert(dest->_size.Width >= dest_x + dest_width);
+  assert(dest->_size.Height >= dest_y + dest_height);
+  assert((transform == nullptr) || (transform->GetFormat() == _format));
+  if ((src_rect.Width <= 0) || (src_rect.Height <= 0)) {
+    return;
+  }
+  if (rotation == 0) {
+    Copy(
+        src_rect, Rect(dest_x, dest_y, src_rect.Width, src_rect.Height), dest,
+        transform);
+    return;
+  }
+
+  // 1. Launch workers to rotate source rows. A half turn reverses rows and
+  // their order; a quarter turn writes each block of source rows to a block
+  // of destination columns.
+  const int depth = _format->GetDepth();
+  const uint8_t* src = GetPixelAddress(src_rect.X, src_rect.Y);
+  uint8_t* dest_origin = dest->GetPixelAddress(dest_x, dest_y);
+  const size_t src_stride =
+      static_cast<size_t>(_allocated_size.Width) * depth;
+  const size_t dest_stride =
+      static_cast<size_t>(dest->_allocated_size.Width) * depth;
+  ParallelFor(0, src_rect.Height, ROTATE_BLOCK_SIZE, [&](int begin, int end) {
+    if (rotation == 180) {
+      for (int y = begin; y < end; ++y) {
+        const uint8_t* src_row = src + y * src_stride;
+        uint8_t* dest_row = dest_origin + (dest_height - 1 - y) * dest_stride;
+        switch (depth) {
+          case 1:
+            ReverseRow<1>(src_row, src_rect.Width, dest_row);
+            break;
+          case 2:
+            ReverseRow<2>(src_row, src_rect.Width, dest_row);
+            break;
+          case 3:
+            ReverseRow<3>(src_row, src_rect.Width, dest_row);
+            break;
+          case 4:
+            ReverseRow<4>(src_row, src_rect.Width, dest_row);
+            break;
+          default:
+            assert(false);
+        }
+      }
+      return;
+    }
+    const bool clockwise = rotation == 90;
+    switch (depth) {
+      case 1:
+        RotateQuarterTurn<1>(
+            src, src_stride, src_rect.Width, src_rect.Height, clockwise,
+            dest_origin, dest_stride, begin, end);
+        break;
+      case 2:
+        RotateQuarterTurn<2>(
+            src, src_stride, src_rect.Width, src_rect.Height, clockwise,
+            dest_origin, dest_stride, begin, end);
+        break;
+      case 3:
+        RotateQuarterTurn<3>(
+            src, src_stride, src_rect.Width, src_rect.Height, clockwise,
+            dest_origin, dest_stride, begin, end);
+        break;
+      case 4:
+        RotateQuarterTurn<4>(
+            src, src_stride, src_rect.Width, src_rect.Height, clockwise,
+            dest_origin, dest_stride, begin, end);
+        break;
+      default:
+        assert(false);
+    }
+  });
+
+  // 2. Apply the transform to the written pixels in place.
+  if ((transform != nullptr) && !transform->IsIdentity()) {
+    ParallelFor(0, dest_height, NUM_ROWS_PER_CHUNK, [&](int begin, int end) {
+      for (int y = begin; y < end; ++y) {
+        uint8_t* dest_row = dest_origin + y * dest_stride;
+        transform->Apply(dest_row, dest_width, dest_row);
+      }
+    });
+  }
+}
+
+PixelBuffer::Rect PixelBuffer::RotateRect(
+    const PixelBuffer::Rect& rect, const PixelBuffer::Size& size,
+    int rotation) {
+  switch (((rotation % 360) + 360) % 360) {
+    case 90:
+      return Rect(
+          size.Height - rect.Y - rect.Height, rect.X, rect.Height, rect.Width);
+    case 180:
+      return Rect(
+          size.Width - rect.X - rect.Width, size.Height - rect.Y - rect.Height,
+          rect.Width, rect.Height);
+    case 270:
+      return Rect(
+          rect.Y, size.Width - rect.X - rect.Width, rect.Height, rect.Width);
+    default:
+      return rect;
+  }
+}
+
+void PixelBuffer::Copy(
+    const PixelBuffer::Rect& src_rect, const PixelBuffer::Rect& dest_rect,
+    PixelBuffer* dest, const ColorTransform* transform) const {
   assert(dest_rect.Width >= src_rect.Width);
   assert(dest_rect.Height >= src_rect.Height);
   assert(_format->GetDepth() == dest->_format->GetDepth());
@@ -85,6 +865,10 @@ void PixelBuffer::Copy(
   assert(_size.Height >= src_rect.Y + src_rect.Height);
   assert(dest->_size.Width >= dest_rect.X + dest_rect.Width);
   assert(dest->_size.Height >= dest_rect.Y + dest_rect.Height);
+  assert((transform == nullptr) || (transform->GetFormat() == _format));
+  if ((transform != nullptr) && transform->IsIdentity()) {
+    transform = nullptr;
+  }
 
   const int margin_top = (dest_rect.Height - src_rect.Height) / 2;
   const int margin_bottom = dest_rect.Height - margin_top - src_rect.Height;
@@ -106,17 +890,13 @@ void PixelBuffer::Copy(
 
   // Launch workers to copy source rows.
   const int src_row_size = src_rect.Width * _format->GetDepth();
-  ExecuteInParallel([=](int num_threads, int i) {
-    const int num_rows_per_thread = src_rect.Height / num_threads;
-    const int height = (i == num_threads - 1)
-                           ? (src_rect.Height - i * num_rows_per_thread)
-                           : num_rows_per_thread;
-    const int src_y_begin = src_rect.Y + i * num_rows_per_thread;
-    const int dest_y_begin = dest_rect.Y + margin_top + i * num_rows_per_thread;
-
-    for (int y = 0; y < height; ++y) {
-      const int src_y = src_y_begin + y;
-      const int dest_y = dest_y_begin + y;
+  const WriteSettings& settings = dest->_write_settings;
+  const bool use_streaming_stores =
+      settings.UseStreamingStores && SupportsStreamingStores();
+  ParallelForRows(src_rect.Height, settings, [=](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      const int src_y = src_rect.Y + y;
+      const int dest_y = dest_rect.Y + margin_top + y;
       // 1. Clear un-overwritten left and right margins.
       if (margin_left) {
         memset(
@@ -130,9 +910,19 @@ void PixelBuffer::Copy(
             0, margin_right * dest->_format->GetDepth());
       }
       // 2. Copy row content.
-      void* src_row = GetPixelAddress(src_rect.X, src_y);
-      void* dest_row = dest->GetPixelAddress(dest_rect.X + margin_left, dest_y);
-      memcpy(dest_row, src_row, src_row_size);
+      const uint8_t* src_row = GetPixelAddress(src_rect.X, src_y);
+      uint8_t* dest_row =
+          dest->GetPixelAddress(dest_rect.X + margin_left, dest_y);
+      if (transform != nullptr) {
+        transform->Apply(src_row, src_rect.Width, dest_row);
+      } else if (use_streaming_stores) {
+        StreamCopy(dest_row, src_row, src_row_size);
+      } else {
+        memcpy(dest_row, src_row, src_row_size);
+      }
+    }
+    if (use_streaming_stores) {
+      FinishStreamingStores();
     }
   });
 }
@@ -163,40 +953,120 @@ void PixelBuffer::Init() {
       fprintf(stderr, "Unsupported color depth %d", _format->GetDepth());
       abort();
   }
+  // Set up row converter.
+  _row_converter = GetPixelRowConverter(_format->GetLayout());
+}
+
+void PixelBuffer::Format::PackRow(
+    const uint8_t* rgba, int width, uint32_t* dest) const {
+  for (int x = 0; x < width; ++x, rgba += 4) {
+    dest[x] = Pack(rgba[0], rgba[1], rgba[2]);
+  }
+}
+
+PixelLayout PixelBuffer::Format::GetLayout() const {
+  return PixelLayout::GENERIC;
 }
 
 void PixelBuffer::PixelWriterImpl1::WritePixel(uint32_t value, void* dest) {
   *(reinterpret_cast<uint8_t*>(dest)) = static_cast<uint8_t>(value);
 }
 
+void PixelBuffer::PixelWriterImpl1::WritePixels(
+    const uint32_t* values, int n, void* dest) {
+  uint8_t* p = reinterpret_cast<uint8_t*>(dest);
+  for (int i = 0; i < n; ++i) {
+    p[i] = static_cast<uint8_t>(values[i]);
+  }
+}
+
 void PixelBuffer::PixelWriterImpl2::WritePixel(uint32_t value, void* dest) {
   *(reinterpret_cast<uint16_t*>(dest)) = static_cast<uint16_t>(value);
 }
 
+void PixelBuffer::PixelWriterImpl2::WritePixels(
+    const uint32_t* values, int n, void* dest) {
+  uint16_t* p = reinterpret_cast<uint16_t*>(dest);
+  for (int i = 0; i < n; ++i) {
+    p[i] = static_cast<uint16_t>(values[i]);
+  }
+}
+
 void PixelBuffer::PixelWriterImpl3LittleEndian::WritePixel(
     uint32_t value, void* dest) {
   *(reinterpret_cast<uint16_t*>(dest)) = static_cast<uint16_t>(value);
   *(reinterpret_cast<uint8_t*>(dest) + 2) = static_cast<uint8_t>(value >> 16);
 }
 
+void PixelBuffer::PixelWriterImpl3LittleEndian::WritePixels(
+    const uint32_t* values, int n, void* dest) {
+  uint8_t* p = reinterpret_cast<uint8_t*>(dest);
+  for (int i = 0; i < n; ++i, p += 3) {
+    p[0] = static_cast<uint8_t>(values[i]);
+    p[1] = static_cast<uint8_t>(values[i] >> 8);
+    p[2] = static_cast<uint8_t>(values[i] >> 16);
+  }
+}
+
 void PixelBuffer::PixelWriterImpl3BigEndian::WritePixel(
     uint32_t value, void* dest) {
   *(reinterpret_cast<uint16_t*>(dest)) = static_cast<uint16_t>(value >> 8);
   *(reinterpret_cast<uint8_t*>(dest) + 2) = static_cast<uint8_t>(value);
 }
 
+void PixelBuffer::PixelWriterImpl3BigEndian::WritePixels(
+    const uint32_t* values, int n, void* dest) {
+  uint8_t* p = reinterpret_cast<uint8_t*>(dest);
+  for (int i = 0; i < n; ++i, p += 3) {
+    p[0] = static_cast<uint8_t>(values[i] >> 16);
+    p[1] = static_cast<uint8_t>(values[i] >> 8);
+    p[2] = static_cast<uint8_t>(values[i]);
+  }
+}
+
 void PixelBuffer::PixelWriterImpl4::WritePixel(uint32_t value, void* dest) {
   *(reinterpret_cast<uint32_t*>(dest)) = static_cast<uint32_t>(value);
 }
 
-int PixelBuffer::GetBufferByteSize() const {
-  return _size.Width * _size.Height * _format->GetDepth();
+void PixelBuffer::PixelWriterImpl4::WritePixels(
+    const uint32_t* values, int n, void* dest) {
+  memcpy(dest, values, n * sizeof(uint32_t));
+}
+
+size_t PixelBuffer::GetBufferByteSize() const {
+  return static_cast<size_t>(_size.Width) * _size.Height * _format->GetDepth();
+}
+
+const PixelBuffer::Format* PixelBuffer::GetFormat() const { return _format; }
+
+uint8_t* PixelBuffer::GetContiguousData() {
+  if ((_offset.Width != 0) || (_size.Width != _allocated_size.Width)) {
+    return nullptr;
+  }
+  return _buffer + _offset.Height * _allocated_size.Width * _format->GetDepth();
+}
+
+void PixelBuffer::SetWriteSettings(const PixelBuffer::WriteSettings& settings) {
+  _write_settings = settings;
+}
+
+const PixelBuffer::WriteSettings& PixelBuffer::GetWriteSettings() const {
+  return _write_settings;
+}
+
+bool PixelBuffer::SupportsStreamingStores() {
+#if defined(JFBVIEW_PIXEL_BUFFER_SSE2) || defined(JFBVIEW_PIXEL_BUFFER_NEON)
+  return true;
+#else
+  return false;
+#endif
 }
 
 uint8_t* PixelBuffer::GetPixelAddress(int x, int y) const {
   assert((x >= 0) && (x < _size.Width));
   assert((y >= 0) && (y < _size.Height));
-  return _buffer +
-         ((y + _offset.Height) * _allocated_size.Width + (x + _offset.Width)) *
-             _format->GetDepth();
+  return _buffer + (static_cast<size_t>(y + _offset.Height) *
+                        _allocated_size.Width +
+                    (x + _offset.Width)) *
+                       _format->GetDepth();
 }
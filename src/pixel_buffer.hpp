@@ -22,8 +22,13 @@
 #ifndef PIXEL_BUFFER_HPP
 #define PIXEL_BUFFER_HPP
 
+#include <cstddef>
 #include <cstdint>
 
+#include "pixel_converter.hpp"
+
+class ColorTransform;
+
 // A class that represents a rectangular matrix of pixels.
 class PixelBuffer {
  public:
@@ -41,6 +46,13 @@ class PixelBuffer {
     virtual int GetDepth() const = 0;
     // Method to pack an RGB tuple into a pixel value.
     virtual uint32_t Pack(uint8_t r, uint8_t g, uint8_t b) const = 0;
+    // Packs width pixels, given as 4 bytes each in the order r, g, b and an
+    // ignored byte, into dest. The default implementation calls Pack() for
+    // each pixel.
+    virtual void PackRow(const uint8_t* rgba, int width, uint32_t* dest) const;
+    // Returns the layout of pixel values, if it is one with a specialized
+    // converter. The default implementation returns PixelLayout::GENERIC.
+    virtual PixelLayout GetLayout() const;
     // This is required to keep C++ happy.
     virtual ~Format() {}
   };
@@ -54,6 +66,26 @@ class PixelBuffer {
     explicit Rect(int x = 0, int y = 0, int width = 0, int height = 0)
         : X(x), Y(y), Width(width), Height(height) {}
   };
+  // How Copy() writes to a buffer. The defaults suit ordinary memory.
+  // Framebuffer memory is usually mapped uncached and write-combined, so
+  // writing to it is often fastest with few threads and streaming stores.
+  struct WriteSettings {
+    // Maximum number of threads writing at the same time, or 0 for as many as
+    // ParallelFor() uses.
+    int NumThreads;
+    // Number of rows written by a thread at a time, or 0 for the default.
+    int NumRowsPerChunk;
+    // Whether to write with stores that fill whole write-combining lines and
+    // bypass the CPU caches. Ignored if SupportsStreamingStores() is false.
+    bool UseStreamingStores;
+
+    explicit WriteSettings(
+        int num_threads = 0, int num_rows_per_chunk = 0,
+        bool use_streaming_stores = false)
+        : NumThreads(num_threads),
+          NumRowsPerChunk(num_rows_per_chunk),
+          UseStreamingStores(use_streaming_stores) {}
+  };
 
   // Constructs a new PixelBuffer object, and allocate memory. Will take
   // ownership of allocated memory. Does NOT take ownership of format.
@@ -70,47 +102,112 @@ class PixelBuffer {
   Size GetSize() const;
   // Returns a rect covering the buffer exactly.
   Rect GetRect() const;
+  // Returns the size of the allocated buffer in bytes.
+  size_t GetBufferByteSize() const;
+  // Returns the color format of this buffer.
+  const Format* GetFormat() const;
+  // Returns the pixels of this buffer, stored as WritePixel() does, if its
+  // rows follow each other without padding, and nullptr otherwise. This is the
+  // case for buffers that allocated their own memory.
+  uint8_t* GetContiguousData();
+
+  // Sets how Copy() writes to this buffer.
+  void SetWriteSettings(const WriteSettings& settings);
+  // Returns how Copy() writes to this buffer.
+  const WriteSettings& GetWriteSettings() const;
+  // Returns whether streaming stores are implemented on this CPU.
+  static bool SupportsStreamingStores();
 
   // Writes a pixel value to a location in the buffer.
   void WritePixel(int x, int y, uint8_t r, uint8_t g, uint8_t b);
+  // Writes width pixels to positions (x, y) through (x + width - 1, y). rgba
+  // holds 4 bytes per pixel, as in Format::PackRow().
+  void WriteRow(int x, int y, const uint8_t* rgba, int width);
+
+  // Sets a region of the buffer to black.
+  void Clear(const Rect& rect);
+  // Moves a region of the buffer so that its top-left corner is at
+  // (dest_x, dest_y). The region and its destination may overlap.
+  void Move(const Rect& src_rect, int dest_x, int dest_y);
+
+  // Filters used by Scale().
+  enum ScaleFilter {
+    // Nearest neighbor sampling.
+    NEAREST,
+    // Bilinear interpolation when enlarging, and averaging over the covered
+    // source pixels (box filter) when shrinking. This only applies to layouts
+    // that store each channel in a byte; others fall back to NEAREST.
+    SMOOTH,
+  };
+
+  // Scales a region in the current pixel buffer to fill a region of another
+  // pixel buffer of the same format, using the given filter. This is
+  // multi-threaded.
+  void Scale(
+      const Rect& src_rect, const Rect& dest_rect, PixelBuffer* dest,
+      ScaleFilter filter = NEAREST) const;
+
+  // Rotates a region in the current pixel buffer clockwise by rotation
+  // degrees, a multiple of 90, and writes it to another pixel buffer of the
+  // same format with its top-left corner at (dest_x, dest_y). If transform is
+  // not nullptr, it is applied to written pixels as in Copy(). This is
+  // multi-threaded.
+  void Rotate(
+      const Rect& src_rect, int rotation, PixelBuffer* dest, int dest_x,
+      int dest_y, const ColorTransform* transform = nullptr) const;
+
+  // Returns where rect, on a buffer of the given size, ends up when the whole
+  // buffer is rotated clockwise by rotation degrees, a multiple of 90.
+  static Rect RotateRect(const Rect& rect, const Size& size, int rotation);
 
   // Copies a region in the current pixel buffer to another pixel buffer. The
   // destination region must be at least as large in both dimensions than the
   // source region. The source region is centered if the destination region is
-  // larger, and the unaffected areas are set to black. This is multi-threaded.
+  // larger, and the unaffected areas are set to black. If transform is not
+  // nullptr, it is applied to copied pixels; it must have been constructed
+  // for the format of this buffer. This is multi-threaded, and writes to dest
+  // as set by its SetWriteSettings().
   void Copy(
-      const Rect& src_rect, const Rect& dest_rect, PixelBuffer* dest) const;
+      const Rect& src_rect, const Rect& dest_rect, PixelBuffer* dest,
+      const ColorTransform* transform = nullptr) const;
 
  private:
   // Prototype for a method that writes a pixel value to a location.
   class PixelWriterImpl {
    public:
     virtual void WritePixel(uint32_t value, void* dest) = 0;
+    // Writes n consecutive pixel values starting at dest.
+    virtual void WritePixels(const uint32_t* values, int n, void* dest) = 0;
   };
   // A pixel writer impl for depth = 1.
   class PixelWriterImpl1 : public PixelWriterImpl {
    public:
     void WritePixel(uint32_t value, void* dest) override;
+    void WritePixels(const uint32_t* values, int n, void* dest) override;
   } _pixel_writer_impl_1;
   // A pixel writer impl for depth = 2.
   class PixelWriterImpl2 : public PixelWriterImpl {
    public:
     void WritePixel(uint32_t value, void* dest) override;
+    void WritePixels(const uint32_t* values, int n, void* dest) override;
   } _pixel_writer_impl_2;
   // A pixel writer impl for depth = 3.
   class PixelWriterImpl3LittleEndian : public PixelWriterImpl {
    public:
     void WritePixel(uint32_t value, void* dest) override;
+    void WritePixels(const uint32_t* values, int n, void* dest) override;
   } _pixel_writer_impl_3_little_endian;
   // A pixel writer impl for depth = 3.
   class PixelWriterImpl3BigEndian : public PixelWriterImpl {
    public:
     void WritePixel(uint32_t value, void* dest) override;
+    void WritePixels(const uint32_t* values, int n, void* dest) override;
   } _pixel_writer_impl_3_big_endian;
   // A pixel writer impl for depth = 4.
   class PixelWriterImpl4 : public PixelWriterImpl {
    public:
     void WritePixel(uint32_t value, void* dest) override;
+    void WritePixels(const uint32_t* values, int n, void* dest) override;
   } _pixel_writer_impl_4;
 
   // Size of the buffer.
@@ -134,11 +231,17 @@ class PixelBuffer {
   // Pixel writer implementation for current buffer. One of
   // _pixel_writer_impl_*.
   PixelWriterImpl* _pixel_writer_impl;
+  // Converter for the layout of _format, or nullptr if WriteRow() must go
+  // through _format and _pixel_writer_impl.
+  PixelRowConverter _row_converter;
+  // How Copy() writes to this buffer.
+  WriteSettings _write_settings;
 
   // Common initialization called by both constructors.
   void Init();
-  // Returns the size of the buffer in bytes.
-  int GetBufferByteSize() const;
+  // Implements Scale() with the SMOOTH filter.
+  void ScaleSmooth(
+      const Rect& src_rect, const Rect& dest_rect, PixelBuffer* dest) const;
   // Returns the address in memory corresponding to the pixel (x, y).
   uint8_t* GetPixelAddress(int x, int y) const;
 
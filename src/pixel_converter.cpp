@@ -0,0 +1,458 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file defines converters from RGBA pixels to common framebuffer pixel
+// layouts. Every layout has a portable converter instantiated from a template,
+// and SIMD kernels where the instruction set suits it. Kernels convert as many
+// whole vectors as fit in a row, and leave the rest to the portable converter.
+
+#include "pixel_converter.hpp"
+
+#include <cstring>
+
+// SSE2 is part of the x86-64 baseline, while AVX2 is detected at run time,
+// which needs GCC or Clang. NEON kernels assume little endian byte order.
+#if defined(__SSE2__)
+#define JFBVIEW_PIXEL_CONVERTER_SSE2
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define JFBVIEW_PIXEL_CONVERTER_AVX2
+#endif
+#endif
+#if defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#define JFBVIEW_PIXEL_CONVERTER_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Compile-time description of a pixel layout. DEPTH is in bytes; offsets and
+// lengths are in bits.
+template <
+    int DEPTH_, int RED_OFFSET_, int RED_LENGTH_, int GREEN_OFFSET_,
+    int GREEN_LENGTH_, int BLUE_OFFSET_, int BLUE_LENGTH_>
+struct Layout {
+  enum {
+    DEPTH = DEPTH_,
+    RED_OFFSET = RED_OFFSET_,
+    RED_LENGTH = RED_LENGTH_,
+    GREEN_OFFSET = GREEN_OFFSET_,
+    GREEN_LENGTH = GREEN_LENGTH_,
+    BLUE_OFFSET = BLUE_OFFSET_,
+    BLUE_LENGTH = BLUE_LENGTH_,
+  };
+};
+
+typedef Layout<4, 16, 8, 8, 8, 0, 8> XRGB8888Layout;
+typedef Layout<4, 0, 8, 8, 8, 16, 8> XBGR8888Layout;
+typedef Layout<4, 8, 8, 16, 8, 24, 8> BGRX8888Layout;
+typedef Layout<2, 11, 5, 5, 6, 0, 5> RGB565Layout;
+typedef Layout<2, 0, 5, 5, 6, 11, 5> BGR565Layout;
+typedef Layout<3, 16, 8, 8, 8, 0, 8> RGB888Layout;
+typedef Layout<3, 0, 8, 8, 8, 16, 8> BGR888Layout;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+const bool IS_BIG_ENDIAN = true;
+#else
+const bool IS_BIG_ENDIAN = false;
+#endif
+
+// Returns whether L has the given properties.
+template <typename L>
+bool Matches(
+    int bits_per_pixel, int red_offset, int red_length, int green_offset,
+    int green_length, int blue_offset, int blue_length) {
+  return (bits_per_pixel == L::DEPTH * 8) && (red_offset == L::RED_OFFSET) &&
+         (red_length == L::RED_LENGTH) && (green_offset == L::GREEN_OFFSET) &&
+         (green_length == L::GREEN_LENGTH) &&
+         (blue_offset == L::BLUE_OFFSET) && (blue_length == L::BLUE_LENGTH);
+}
+
+// Packs an RGBA pixel into a pixel value in layout L.
+template <typename L>
+inline uint32_t Pack(const uint8_t* rgba) {
+  return ((static_cast<uint32_t>(rgba[0]) >> (8 - L::RED_LENGTH))
+          << L::RED_OFFSET) |
+         ((static_cast<uint32_t>(rgba[1]) >> (8 - L::GREEN_LENGTH))
+          << L::GREEN_OFFSET) |
+         ((static_cast<uint32_t>(rgba[2]) >> (8 - L::BLUE_LENGTH))
+          << L::BLUE_OFFSET);
+}
+
+// Stores a pixel value of DEPTH bytes in native byte order.
+template <int DEPTH>
+inline void Store(uint32_t value, uint8_t* dest);
+
+template <>
+inline void Store<2>(uint32_t value, uint8_t* dest) {
+  const uint16_t value16 = static_cast<uint16_t>(value);
+  memcpy(dest, &value16, sizeof(value16));
+}
+
+template <>
+inline void Store<3>(uint32_t value, uint8_t* dest) {
+  if (IS_BIG_ENDIAN) {
+    dest[0] = static_cast<uint8_t>(value >> 16);
+    dest[1] = static_cast<uint8_t>(value >> 8);
+    dest[2] = static_cast<uint8_t>(value);
+  } else {
+    dest[0] = static_cast<uint8_t>(value);
+    dest[1] = static_cast<uint8_t>(value >> 8);
+    dest[2] = static_cast<uint8_t>(value >> 16);
+  }
+}
+
+template <>
+inline void Store<4>(uint32_t value, uint8_t* dest) {
+  memcpy(dest, &value, sizeof(value));
+}
+
+// Portable converter for layout L.
+template <typename L>
+void ConvertRowScalar(const uint8_t* rgba, int width, uint8_t* dest) {
+  for (int x = 0; x < width; ++x, rgba += 4, dest += L::DEPTH) {
+    Store<L::DEPTH>(Pack<L>(rgba), dest);
+  }
+}
+
+// Converter for PixelLayout::GRAY8. Simple enough for compilers to vectorize.
+void ConvertRowGray8(const uint8_t* rgba, int width, uint8_t* dest) {
+  for (int x = 0; x < width; ++x, rgba += 4) {
+    dest[x] = RGBToGray(rgba[0], rgba[1], rgba[2]);
+  }
+}
+
+// Runs Kernel over a row, then converts the remaining pixels with the
+// portable converter. Kernel::Convert() returns the number of pixels it
+// converted.
+template <typename L, typename Kernel>
+void ConvertRow(const uint8_t* rgba, int width, uint8_t* dest) {
+  const int num_converted = Kernel::Convert(rgba, width, dest);
+  ConvertRowScalar<L>(
+      rgba + num_converted * 4, width - num_converted,
+      dest + num_converted * L::DEPTH);
+}
+
+#ifdef JFBVIEW_PIXEL_CONVERTER_SSE2
+
+// Packs the RGBA pixel in each 32-bit lane of v into layout L.
+template <typename L>
+inline __m128i PackSSE2(__m128i v) {
+  const __m128i red = _mm_slli_epi32(
+      _mm_and_si128(
+          _mm_srli_epi32(v, 8 - L::RED_LENGTH),
+          _mm_set1_epi32((1 << L::RED_LENGTH) - 1)),
+      L::RED_OFFSET);
+  const __m128i green = _mm_slli_epi32(
+      _mm_and_si128(
+          _mm_srli_epi32(v, 16 - L::GREEN_LENGTH),
+          _mm_set1_epi32((1 << L::GREEN_LENGTH) - 1)),
+      L::GREEN_OFFSET);
+  const __m128i blue = _mm_slli_epi32(
+      _mm_and_si128(
+          _mm_srli_epi32(v, 24 - L::BLUE_LENGTH),
+          _mm_set1_epi32((1 << L::BLUE_LENGTH) - 1)),
+      L::BLUE_OFFSET);
+  return _mm_or_si128(_mm_or_si128(red, green), blue);
+}
+
+// SSE2 kernels, by depth. Packed 24-bit pixels are left to the portable
+// converter, as SSE2 has no byte shuffles.
+template <typename L, int DEPTH = L::DEPTH>
+struct SSE2Kernel {
+  static int Convert(
+      const uint8_t* /* rgba */, int /* width */, uint8_t* /* dest */) {
+    return 0;
+  }
+};
+
+template <typename L>
+struct SSE2Kernel<L, 4> {
+  static int Convert(const uint8_t* rgba, int width, uint8_t* dest) {
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      const __m128i v =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + x * 4));
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dest + x * 4), PackSSE2<L>(v));
+    }
+    return x;
+  }
+};
+
+template <typename L>
+struct SSE2Kernel<L, 2> {
+  static int Convert(const uint8_t* rgba, int width, uint8_t* dest) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      const __m128i lo = PackSSE2<L>(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + x * 4)));
+      const __m128i hi = PackSSE2<L>(_mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(rgba + x * 4 + 16)));
+      // SSE2 can only narrow with signed saturation, so sign extend the
+      // 16-bit values first to keep them intact.
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(dest + x * 2),
+          _mm_packs_epi32(
+              _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16),
+              _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16)));
+    }
+    return x;
+  }
+};
+
+#endif
+
+#ifdef JFBVIEW_PIXEL_CONVERTER_AVX2
+
+// Same as PackSSE2(), with 8 pixels at a time.
+template <typename L>
+__attribute__((target("avx2"))) inline __m256i PackAVX2(__m256i v) {
+  const __m256i red = _mm256_slli_epi32(
+      _mm256_and_si256(
+          _mm256_srli_epi32(v, 8 - L::RED_LENGTH),
+          _mm256_set1_epi32((1 << L::RED_LENGTH) - 1)),
+      L::RED_OFFSET);
+  const __m256i green = _mm256_slli_epi32(
+      _mm256_and_si256(
+          _mm256_srli_epi32(v, 16 - L::GREEN_LENGTH),
+          _mm256_set1_epi32((1 << L::GREEN_LENGTH) - 1)),
+      L::GREEN_OFFSET);
+  const __m256i blue = _mm256_slli_epi32(
+      _mm256_and_si256(
+          _mm256_srli_epi32(v, 24 - L::BLUE_LENGTH),
+          _mm256_set1_epi32((1 << L::BLUE_LENGTH) - 1)),
+      L::BLUE_OFFSET);
+  return _mm256_or_si256(_mm256_or_si256(red, green), blue);
+}
+
+// AVX2 kernels, by depth.
+template <typename L, int DEPTH = L::DEPTH>
+struct AVX2Kernel {
+  static int Convert(
+      const uint8_t* /* rgba */, int /* width */, uint8_t* /* dest */) {
+    return 0;
+  }
+};
+
+template <typename L>
+struct AVX2Kernel<L, 4> {
+  __attribute__((target("avx2"))) static int Convert(
+      const uint8_t* rgba, int width, uint8_t* dest) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      const __m256i v =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rgba + x * 4));
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i*>(dest + x * 4), PackAVX2<L>(v));
+    }
+    return x;
+  }
+};
+
+template <typename L>
+struct AVX2Kernel<L, 2> {
+  __attribute__((target("avx2"))) static int Convert(
+      const uint8_t* rgba, int width, uint8_t* dest) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      const __m256i lo = PackAVX2<L>(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rgba + x * 4)));
+      const __m256i hi = PackAVX2<L>(_mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(rgba + x * 4 + 32)));
+      // Narrowing works within 128-bit halves, so the 64-bit quarters of the
+      // result come out as lo0, hi0, lo1, hi1 and must be put back in order.
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i*>(dest + x * 2),
+          _mm256_permute4x64_epi64(
+              _mm256_packus_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    return x;
+  }
+};
+
+#endif
+
+#ifdef JFBVIEW_PIXEL_CONVERTER_NEON
+
+// NEON kernels, by depth. These load 16 pixels at a time, split into one
+// vector per channel.
+template <typename L, int DEPTH = L::DEPTH>
+struct NEONKernel;
+
+template <typename L>
+struct NEONKernel<L, 4> {
+  static_assert(
+      (L::RED_LENGTH == 8) && (L::GREEN_LENGTH == 8) && (L::BLUE_LENGTH == 8),
+      "32-bit NEON kernel only supports byte aligned channels");
+  static int Convert(const uint8_t* rgba, int width, uint8_t* dest) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      const uint8x16x4_t src = vld4q_u8(rgba + x * 4);
+      uint8x16x4_t out;
+      out.val[0] = out.val[1] = out.val[2] = out.val[3] = vdupq_n_u8(0);
+      out.val[L::RED_OFFSET / 8] = src.val[0];
+      out.val[L::GREEN_OFFSET / 8] = src.val[1];
+      out.val[L::BLUE_OFFSET / 8] = src.val[2];
+      vst4q_u8(dest + x * 4, out);
+    }
+    return x;
+  }
+};
+
+template <typename L>
+struct NEONKernel<L, 3> {
+  static_assert(
+      (L::RED_LENGTH == 8) && (L::GREEN_LENGTH == 8) && (L::BLUE_LENGTH == 8),
+      "24-bit NEON kernel only supports byte aligned channels");
+  static int Convert(const uint8_t* rgba, int width, uint8_t* dest) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      const uint8x16x4_t src = vld4q_u8(rgba + x * 4);
+      uint8x16x3_t out;
+      out.val[L::RED_OFFSET / 8] = src.val[0];
+      out.val[L::GREEN_OFFSET / 8] = src.val[1];
+      out.val[L::BLUE_OFFSET / 8] = src.val[2];
+      vst3q_u8(dest + x * 3, out);
+    }
+    return x;
+  }
+};
+
+template <typename L>
+struct NEONKernel<L, 2> {
+  static_assert(
+      (L::GREEN_OFFSET == 5) && (L::GREEN_LENGTH == 6) &&
+          (L::RED_LENGTH == 5) && (L::BLUE_LENGTH == 5),
+      "16-bit NEON kernel only supports 565 layouts");
+  // Returns 8 pixel values from 8 pixels of each channel. Each channel is
+  // moved to the top of a 16-bit lane, then shifted into place below the
+  // previous one with a shift right and insert.
+  static uint16x8_t Pack(uint8x8_t red, uint8x8_t green, uint8x8_t blue) {
+    const uint8x8_t top = L::RED_OFFSET > L::BLUE_OFFSET ? red : blue;
+    const uint8x8_t bottom = L::RED_OFFSET > L::BLUE_OFFSET ? blue : red;
+    uint16x8_t value = vshll_n_u8(top, 8);
+    value = vsriq_n_u16(value, vshll_n_u8(green, 8), 5);
+    return vsriq_n_u16(value, vshll_n_u8(bottom, 8), 11);
+  }
+  static int Convert(const uint8_t* rgba, int width, uint8_t* dest) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      const uint8x16x4_t src = vld4q_u8(rgba + x * 4);
+      const uint16x8_t lo = Pack(
+          vget_low_u8(src.val[0]), vget_low_u8(src.val[1]),
+          vget_low_u8(src.val[2]));
+      const uint16x8_t hi = Pack(
+          vget_high_u8(src.val[0]), vget_high_u8(src.val[1]),
+          vget_high_u8(src.val[2]));
+      vst1q_u8(dest + x * 2, vreinterpretq_u8_u16(lo));
+      vst1q_u8(dest + x * 2 + 16, vreinterpretq_u8_u16(hi));
+    }
+    return x;
+  }
+};
+
+#endif
+
+// Returns the fastest converter for layout L supported by the CPU.
+template <typename L>
+PixelRowConverter SelectConverter() {
+#ifdef JFBVIEW_PIXEL_CONVERTER_AVX2
+  __builtin_cpu_init();
+  if ((L::DEPTH != 3) && __builtin_cpu_supports("avx2")) {
+    return &ConvertRow<L, AVX2Kernel<L>>;
+  }
+#endif
+#ifdef JFBVIEW_PIXEL_CONVERTER_SSE2
+  if (L::DEPTH != 3) {
+    return &ConvertRow<L, SSE2Kernel<L>>;
+  }
+#endif
+#ifdef JFBVIEW_PIXEL_CONVERTER_NEON
+  return &ConvertRow<L, NEONKernel<L>>;
+#endif
+  return &ConvertRowScalar<L>;
+}
+
+}  // namespace
+
+PixelLayout DetectPixelLayout(
+    int bits_per_pixel, int red_offset, int red_length, int green_offset,
+    int green_length, int blue_offset, int blue_length) {
+#define JFBVIEW_MATCH_LAYOUT(layout)                                      \
+  if (Matches<layout##Layout>(                                            \
+          bits_per_pixel, red_offset, red_length, green_offset,           \
+          green_length, blue_offset, blue_length)) {                      \
+    return PixelLayout::layout;                                           \
+  }
+  JFBVIEW_MATCH_LAYOUT(XRGB8888)
+  JFBVIEW_MATCH_LAYOUT(XBGR8888)
+  JFBVIEW_MATCH_LAYOUT(BGRX8888)
+  JFBVIEW_MATCH_LAYOUT(RGB565)
+  JFBVIEW_MATCH_LAYOUT(BGR565)
+  JFBVIEW_MATCH_LAYOUT(RGB888)
+  JFBVIEW_MATCH_LAYOUT(BGR888)
+#undef JFBVIEW_MATCH_LAYOUT
+  return PixelLayout::GENERIC;
+}
+
+PixelRowConverter GetPixelRowConverter(PixelLayout layout) {
+  switch (layout) {
+    case PixelLayout::XRGB8888:
+      return SelectConverter<XRGB8888Layout>();
+    case PixelLayout::XBGR8888:
+      return SelectConverter<XBGR8888Layout>();
+    case PixelLayout::BGRX8888:
+      return SelectConverter<BGRX8888Layout>();
+    case PixelLayout::RGB565:
+      return SelectConverter<RGB565Layout>();
+    case PixelLayout::BGR565:
+      return SelectConverter<BGR565Layout>();
+    case PixelLayout::RGB888:
+      return SelectConverter<RGB888Layout>();
+    case PixelLayout::BGR888:
+      return SelectConverter<BGR888Layout>();
+    case PixelLayout::GRAY8:
+      return &ConvertRowGray8;
+    default:
+      return nullptr;
+  }
+}
+
+PixelRowConverter GetScalarPixelRowConverter(PixelLayout layout) {
+  switch (layout) {
+    case PixelLayout::XRGB8888:
+      return &ConvertRowScalar<XRGB8888Layout>;
+    case PixelLayout::XBGR8888:
+      return &ConvertRowScalar<XBGR8888Layout>;
+    case PixelLayout::BGRX8888:
+      return &ConvertRowScalar<BGRX8888Layout>;
+    case PixelLayout::RGB565:
+      return &ConvertRowScalar<RGB565Layout>;
+    case PixelLayout::BGR565:
+      return &ConvertRowScalar<BGR565Layout>;
+    case PixelLayout::RGB888:
+      return &ConvertRowScalar<RGB888Layout>;
+    case PixelLayout::BGR888:
+      return &ConvertRowScalar<BGR888Layout>;
+    case PixelLayout::GRAY8:
+      return &ConvertRowGray8;
+    default:
+      return nullptr;
+  }
+}
@@ -0,0 +1,72 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file declares converters from RGBA pixels to common framebuffer pixel
+// layouts.
+
+#ifndef PIXEL_CONVERTER_HPP
+#define PIXEL_CONVERTER_HPP
+
+#include <cstdint>
+
+// Pixel layouts with specialized converters. As with DRM format codes, names
+// list the fields of a pixel value from the most to the least significant bit,
+// and X marks unused bits, which are set to 0. Pixel values are stored in
+// native byte order, like PixelBuffer::WritePixel() does.
+enum class PixelLayout {
+  // Any other layout. Pixels are converted with PixelBuffer::Format::Pack().
+  GENERIC,
+  XRGB8888,
+  XBGR8888,
+  BGRX8888,
+  RGB565,
+  BGR565,
+  RGB888,
+  BGR888,
+  // One byte of grey level per pixel, as on greyscale panels.
+  GRAY8,
+};
+
+// A function that converts width pixels, given as 4 bytes each in the order r,
+// g, b and an ignored byte, into pixel values stored at dest.
+typedef void (*PixelRowConverter)(
+    const uint8_t* rgba, int width, uint8_t* dest);
+
+// Returns the grey level of an RGB color, as stored in PixelLayout::GRAY8. The
+// weights match the ones MuPDF uses when drawing into grey pixmaps.
+inline uint8_t RGBToGray(uint8_t r, uint8_t g, uint8_t b) {
+  return static_cast<uint8_t>((77 * r + 151 * g + 28 * b + 128) >> 8);
+}
+
+// Returns the layout for pixels of bits_per_pixel bits with the given offset
+// and length, in bits, of each color channel, or PixelLayout::GENERIC if it is
+// not one of the specialized layouts. Greyscale layouts are not detected here,
+// as they are not described by color channels.
+extern PixelLayout DetectPixelLayout(
+    int bits_per_pixel, int red_offset, int red_length, int green_offset,
+    int green_length, int blue_offset, int blue_length);
+
+// Returns the fastest converter for layout supported by the CPU, or nullptr
+// for PixelLayout::GENERIC.
+extern PixelRowConverter GetPixelRowConverter(PixelLayout layout);
+
+// Returns the portable converter for layout that does not use SIMD
+// instructions, or nullptr for PixelLayout::GENERIC.
+extern PixelRowConverter GetScalarPixelRowConverter(PixelLayout layout);
+
+#endif
@@ -25,71 +25,143 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <utility>
 
 #include "document.hpp"
 #include "framebuffer.hpp"
+#include "multithreading.hpp"
 
-const float Viewer::MAX_ZOOM = 10.0f;
+const float Viewer::MAX_ZOOM = 50.0f;
 const float Viewer::MIN_ZOOM = 0.1f;
 
 namespace {
 
-// A PixelWriter that writes pixel values to a in-memory buffer. Each pixel is
-// stored as three consecutive ints representing the r, g, and b values.
+// Distance around the view within which tiles are preloaded, in pixels.
+const int PREFETCH_MARGIN = Viewer::TILE_SIZE;
+
+// Time within which a screen should render while navigating in
+// QUALITY_ADAPTIVE mode, in seconds. This is about the interval between
+// repeated key presses.
+const double DRAFT_RENDER_TIME_BUDGET = 0.04;
+// Weight of a new measurement in the moving average of render times.
+const double RENDER_TIME_SMOOTHING = 0.25;
+
+// Number of recently shown views whose tiles may be scaled to stand in for
+// missing tiles at another zoom ratio.
+const int NUM_RECENT_VIEWS = 4;
+// Maximum ratio between the zoom ratios of a missing tile and of the tiles
+// scaled to stand in for it. Beyond this, scaled tiles are too blurry, or take
+// too many tiles to cover the missing one.
+const float MAX_STAND_IN_ZOOM_RATIO = 4.0f;
+
+// Returns the number of tiles that may be visible at once on a screen of the
+// given size, when the view is not aligned to tiles.
+int GetNumTilesPerScreen(const PixelBuffer::Size& screen_size) {
+  return (screen_size.Width / Viewer::TILE_SIZE + 2) *
+         (screen_size.Height / Viewer::TILE_SIZE + 2);
+}
+
+// Returns the region of a rendered page of page_size covered by a tile.
+Document::PageRect GetTileRect(
+    const Document::PageSize& page_size, int tile_x, int tile_y) {
+  const int x = tile_x * Viewer::TILE_SIZE, y = tile_y * Viewer::TILE_SIZE;
+  return Document::PageRect(
+      x, y, std::min<int>(Viewer::TILE_SIZE, page_size.Width - x),
+      std::min<int>(Viewer::TILE_SIZE, page_size.Height - y));
+}
+
+// Returns the document quality corresponding to a render quality other than
+// QUALITY_ADAPTIVE.
+Document::Quality GetDocumentQuality(Viewer::RenderQuality quality) {
+  switch (quality) {
+    case Viewer::QUALITY_FAST:
+      return Document::FAST;
+    case Viewer::QUALITY_NORMAL:
+      return Document::NORMAL;
+    default:
+      return Document::BEST;
+  }
+}
+
+// A PixelWriter that writes pixel values to a in-memory buffer.
 class PixelBufferWriter : public Document::PixelWriter {
  public:
-  // Constructs a PixelBuffer writer with the given settings. buffer_width
-  // gives the number of pixels in a row in the buffer. buffer is the target
-  // buffer.
-  PixelBufferWriter(PixelBuffer* buffer, Viewer::ColorMode color_mode)
-      : _buffer(buffer), _color_mode(color_mode) {}
+  // Constructs a PixelBuffer writer. buffer is the target buffer.
+  explicit PixelBufferWriter(PixelBuffer* buffer) : _buffer(buffer) {}
   // See PixelWriter.
   void Write(int x, int y, uint8_t r, uint8_t g, uint8_t b) override {
-    switch (_color_mode) {
-      case Viewer::ColorMode::NORMAL:
+    _buffer->WritePixel(x, y, r, g, b);
+  }
+  // See PixelWriter.
+  void WriteRow(int y, const uint8_t* rgba, int width) override {
+    _buffer->WriteRow(0, y, rgba, width);
+  }
+  // See PixelWriter. Layouts that store whole bytes in the order of a
+  // DirectBuffer format are exposed directly.
+  bool GetDirectBuffer(DirectBuffer* buffer) override {
+    switch (_buffer->GetFormat()->GetLayout()) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+      case PixelLayout::BGRX8888:
+        buffer->PixelFormat = DirectBuffer::BGRX;
         break;
-      case Viewer::ColorMode::INVERTED:
-        r = UINT8_MAX - r;
-        g = UINT8_MAX - g;
-        b = UINT8_MAX - b;
+#else
+      case PixelLayout::XRGB8888:
+        buffer->PixelFormat = DirectBuffer::BGRX;
         break;
-      case Viewer::ColorMode::SEPIA:
-        r = ::std::min(
-            static_cast<uint32_t>(r * 0.393f + g * 0.769f + b * 0.189f),
-            static_cast<uint32_t>(UINT8_MAX));
-        g = ::std::min(
-            static_cast<uint32_t>(r * 0.349f + g * 0.686f + b * 0.168f),
-            static_cast<uint32_t>(UINT8_MAX));
-        b = ::std::min(
-            static_cast<uint32_t>(r * 0.272f + g * 0.534f + b * 0.131f),
-            static_cast<uint32_t>(UINT8_MAX));
+      case PixelLayout::XBGR8888:
+        buffer->PixelFormat = DirectBuffer::RGBX;
+        break;
+#endif
+      case PixelLayout::GRAY8:
+        buffer->PixelFormat = DirectBuffer::GRAY;
         break;
       default:
-        fprintf(stderr, "Unknown color mode %d", _color_mode);
-        abort();
+        return false;
     }
-    _buffer->WritePixel(x, y, r, g, b);
+    buffer->Data = _buffer->GetContiguousData();
+    buffer->Width = _buffer->GetSize().Width;
+    buffer->Height = _buffer->GetSize().Height;
+    return buffer->Data != nullptr;
   }
 
  private:
   // The destination buffer.
   PixelBuffer* _buffer;
-  // The current color mode.
-  Viewer::ColorMode _color_mode;
 };
 
 }  // namespace
 
 Viewer::Viewer(
     Document* doc, Framebuffer* fb, const Viewer::State& state,
-    int render_cache_size)
+    int render_cache_size, RenderCachePolicy render_cache_policy,
+    size_t render_cache_memory, bool progressive, int render_deadline_ms)
     : _doc(doc),
       _fb(fb),
       _state(state),
-      _render_cache(this, render_cache_size) {
+      _num_tiles_per_screen(GetNumTilesPerScreen(fb->GetSize())),
+      _progressive(progressive),
+      _render_deadline_ms(std::max(0, render_deadline_ms)),
+      _is_refining(false),
+      _num_render_overruns(0),
+      _is_navigating(false),
+      _seconds_per_pixel(),
+      _render_cache(
+          this,
+          static_cast<int>(std::min<long long>(
+              INT_MAX,
+              static_cast<long long>(render_cache_size) *
+                  _num_tiles_per_screen)),
+          render_cache_policy) {
   assert(_doc != nullptr);
   assert(_fb != nullptr);
+  _render_cache.SetSizeBudget(render_cache_memory);
+  // Room for the visible tiles, the prefetch margin around them, and the
+  // views of both neighboring pages.
+  _render_cache.SetMaxNumPendingPrefetches(4 * _num_tiles_per_screen);
 }
 
 Viewer::~Viewer() {}
@@ -97,6 +169,569 @@ Viewer::~Viewer() {}
 void Viewer::Render() {
   // 1. Process state.
   int page = std::max(0, std::min(_doc->GetNumPages() - 1, _state.Page));
+  _state.Brightness = std::max<int>(
+      MIN_BRIGHTNESS, std::min<int>(MAX_BRIGHTNESS, _state.Brightness));
+  const float zoom =
+      RenderCacheKey(page, GetActualZoom(page), _state.Rotation).GetZoom();
+  const RenderQuality quality = GetRenderQuality();
+  const bool is_draft =
+      (_state.Quality == QUALITY_ADAPTIVE) && (quality != QUALITY_BEST);
+
+  // 2. Compute the area actually visible on screen.
+  const PixelBuffer::Size& screen_size = _fb->GetSize();
+  const Document::PageSize& page_size =
+      _doc->GetPageSize(page, zoom, _state.Rotation);
+  const PixelBuffer::Rect src_rect = GetViewRect(
+      PixelBuffer::Size(page_size.Width, page_size.Height), _state.XOffset,
+      _state.YOffset);
+
+  // 3. Cancel prefetches that are of no use from this view, such as those of
+  // pages we have moved away from or of another quality. Then request all
+  // visible tiles up front, so that missing tiles are rendered by the cache's
+  // loader threads while we wait for the first ones.
+  const RenderCacheKey view_key(
+      page, zoom, _state.Rotation, 0, 0, false, quality);
+  _render_cache.CancelPrefetches([&view_key](const RenderCacheKey& key) {
+    return (key.Rotation == view_key.Rotation) &&
+           (key.Quality == view_key.Quality) &&
+           (std::abs(key.Page - view_key.Page) <= 1) &&
+           ((key.Page != view_key.Page) ||
+            (key.ZoomSteps == view_key.ZoomSteps));
+  });
+  PrepareTiles(page, zoom, src_rect, quality, 0);
+  const CancellationToken::Clock::time_point deadline =
+      CancellationToken::Clock::now() +
+      std::chrono::milliseconds(_render_deadline_ms);
+  bool is_overrun = false;
+
+  // 4. Blit visible tiles to framebuffer, applying the color mode. A view
+  // smaller than the screen is centered, and the margins are cleared. Missing
+  // tiles are stood in for by cached tiles of a recent view at another zoom
+  // ratio, scaled to this one, while they are rendered in the background.
+  // Otherwise, tiles that miss the deadline are finished in the background,
+  // and are shown partially rendered or as previews until then. While
+  // drafting, tiles that have already been rendered at full quality are used
+  // as they are. Only the parts of the view that are not already on screen
+  // are drawn. On a double buffered framebuffer, the screen is flipped to
+  // show everything at once.
+  const int screen_x = (screen_size.Width - src_rect.Width) / 2;
+  const int screen_y = (screen_size.Height - src_rect.Height) / 2;
+  _fb->BeginFrame();
+  ScreenContents* const contents =
+      &_screen_contents[_fb->GetBufferIndex() % 2];
+  const std::vector<PixelBuffer::Rect> dirty_rects =
+      UpdateScreen(contents, view_key, src_rect, screen_x, screen_y);
+  _is_refining = false;
+  for (const PixelBuffer::Rect& dirty_rect : dirty_rects) {
+    for (int tile_y = dirty_rect.Y / TILE_SIZE;
+         tile_y * TILE_SIZE < dirty_rect.Y + dirty_rect.Height; ++tile_y) {
+      for (int tile_x = dirty_rect.X / TILE_SIZE;
+           tile_x * TILE_SIZE < dirty_rect.X + dirty_rect.Width; ++tile_x) {
+        const Document::PageRect tile_rect =
+            GetTileRect(page_size, tile_x, tile_y);
+        // Intersection of the tile and dirty_rect, in page coordinates.
+        const int x_begin = std::max(dirty_rect.X, tile_rect.X);
+        const int y_begin = std::max(dirty_rect.Y, tile_rect.Y);
+        const int x_end = std::min(
+            dirty_rect.X + dirty_rect.Width, tile_rect.X + tile_rect.Width);
+        const int y_end = std::min(
+            dirty_rect.Y + dirty_rect.Height, tile_rect.Y + tile_rect.Height);
+        const RenderCacheKey key(
+            page, zoom, _state.Rotation, tile_x, tile_y, false, quality);
+        const RenderCacheKey preview_key(
+            page, zoom, _state.Rotation, tile_x, tile_y, true, quality);
+        RenderCache::Handle tile_handle;
+        if (is_draft) {
+          tile_handle = _render_cache.TryGet(RenderCacheKey(
+              page, zoom, _state.Rotation, tile_x, tile_y, false,
+              QUALITY_BEST));
+        }
+        if (tile_handle == nullptr) {
+          tile_handle = _render_cache.TryGet(key);
+        }
+        bool is_stand_in = false;
+        if (tile_handle != nullptr) {
+          // Already rendered.
+        } else if (ScaleFromOtherZoom(key)) {
+          // The tile itself was requested in step 3.
+          is_stand_in = true;
+        } else if (_progressive) {
+          // Show a preview below.
+        } else if (_render_deadline_ms > 0) {
+          bool is_complete;
+          tile_handle = _render_cache.Get(key, deadline, &is_complete);
+          if (!is_complete) {
+            _render_cache.Prepare(key, 0);
+            _render_cache.Prepare(preview_key, 0);
+            _is_refining = true;
+            is_overrun = true;
+          }
+        } else {
+          tile_handle = _render_cache.Get(key);
+        }
+        const PixelBuffer* tile;
+        if (tile_handle != nullptr) {
+          tile = tile_handle->get();
+        } else if (is_stand_in) {
+          tile = _preview_buffer.get();
+          _is_refining = true;
+        } else {
+          // Show a preview scaled up to the size of the tile until the tile
+          // has been rendered in the background. In progressive mode we wait
+          // for the preview; past the deadline, we only use it if it is
+          // ready.
+          const RenderCache::Handle preview_handle =
+              _progressive ? _render_cache.Get(preview_key)
+                           : _render_cache.TryGet(preview_key);
+          if (preview_handle == nullptr) {
+            _fb->Clear(PixelBuffer::Rect(
+                screen_x + x_begin - src_rect.X,
+                screen_y + y_begin - src_rect.Y, x_end - x_begin,
+                y_end - y_begin));
+            _is_refining = true;
+            continue;
+          }
+          const PixelBuffer* preview = preview_handle->get();
+          preview->Scale(
+              preview->GetRect(),
+              PixelBuffer::Rect(0, 0, tile_rect.Width, tile_rect.Height),
+              GetPreviewBuffer(), PixelBuffer::SMOOTH);
+          tile = _preview_buffer.get();
+          _is_refining = true;
+        }
+        _fb->Render(
+            *tile,
+            PixelBuffer::Rect(
+                x_begin - tile_rect.X, y_begin - tile_rect.Y, x_end - x_begin,
+                y_end - y_begin),
+            screen_x + x_begin - src_rect.X, screen_y + y_begin - src_rect.Y,
+            GetColorTransform(tile->GetFormat()));
+      }
+    }
+  }
+  _fb->EndFrame();
+
+  if (is_overrun) {
+    ++_num_render_overruns;
+  }
+  // A draft is replaced at full quality once navigation stops.
+  if (is_draft) {
+    _is_refining = true;
+  }
+  contents->IsComplete = !_is_refining;
+
+  // 5. Store corrected state.
+  _state.Page = page;
+  _state.NumPages = _doc->GetNumPages();
+  if ((_state.Zoom != ZOOM_TO_WIDTH) && (_state.Zoom != ZOOM_TO_FIT)) {
+    _state.Zoom = zoom;
+  }
+  _state.ActualZoom = zoom;
+  _state.XOffset = src_rect.X;
+  _state.YOffset = src_rect.Y;
+  _state.PageWidth = page_size.Width;
+  _state.PageHeight = page_size.Height;
+  _state.ScreenWidth = screen_size.Width;
+  _state.ScreenHeight = screen_size.Height;
+  _recent_views.erase(
+      std::remove(_recent_views.begin(), _recent_views.end(), view_key),
+      _recent_views.end());
+  _recent_views.insert(_recent_views.begin(), view_key);
+  if (static_cast<int>(_recent_views.size()) > NUM_RECENT_VIEWS) {
+    _recent_views.pop_back();
+  }
+
+  // 6. Preload tiles around the view, then the views of neighboring pages
+  // that scrolling would show, prioritized by distance. We favor the next
+  // page, since that is where readers usually go. In ZOOM_* modes,
+  // neighboring pages may need a different zoom ratio. With a memory budget,
+  // we only preload as many screens as fit alongside the current one;
+  // otherwise preloading would just evict the visible tiles.
+  int num_screens = _render_cache.GetSize() / _num_tiles_per_screen;
+  const size_t render_cache_memory = _render_cache.GetSizeBudget();
+  if (render_cache_memory > 0) {
+    const size_t screen_byte_size = static_cast<size_t>(screen_size.Width) *
+                                    screen_size.Height *
+                                    _fb->GetFormat()->GetDepth();
+    const size_t num_screens_in_budget =
+        render_cache_memory / std::max<size_t>(1, screen_byte_size);
+    num_screens = static_cast<int>(
+        std::min<size_t>(num_screens, num_screens_in_budget + 1));
+  }
+  if (num_screens > 1) {
+    const PixelBuffer::Rect prefetch_rect(
+        src_rect.X - PREFETCH_MARGIN, src_rect.Y - PREFETCH_MARGIN,
+        src_rect.Width + 2 * PREFETCH_MARGIN,
+        src_rect.Height + 2 * PREFETCH_MARGIN);
+    PrepareTiles(page, zoom, prefetch_rect, quality, 1);
+    if (page < _doc->GetNumPages() - 1) {
+      const float next_zoom =
+          RenderCacheKey(page + 1, GetActualZoom(page + 1), _state.Rotation)
+              .GetZoom();
+      const Document::PageSize& next_page_size =
+          _doc->GetPageSize(page + 1, next_zoom, _state.Rotation);
+      PrepareTiles(
+          page + 1, next_zoom,
+          GetViewRect(
+              PixelBuffer::Size(next_page_size.Width, next_page_size.Height),
+              src_rect.X, 0),
+          quality, 2);
+    }
+    if ((num_screens > 2) && (page > 0)) {
+      const float previous_zoom =
+          RenderCacheKey(page - 1, GetActualZoom(page - 1), _state.Rotation)
+              .GetZoom();
+      const Document::PageSize& previous_page_size =
+          _doc->GetPageSize(page - 1, previous_zoom, _state.Rotation);
+      PrepareTiles(
+          page - 1, previous_zoom,
+          GetViewRect(
+              PixelBuffer::Size(
+                  previous_page_size.Width, previous_page_size.Height),
+              src_rect.X, INT_MAX),
+          quality, 3);
+    }
+  }
+}
+
+bool Viewer::IsRefining() const { return _is_refining; }
+
+void Viewer::Invalidate() {
+  for (ScreenContents& contents : _screen_contents) {
+    contents.IsValid = false;
+  }
+}
+
+std::vector<PixelBuffer::Rect> Viewer::UpdateScreen(
+    ScreenContents* contents, const RenderCacheKey& view_key,
+    const PixelBuffer::Rect& src_rect, int screen_x, int screen_y) {
+  // 1. Compare with what is on screen. Margins only need clearing if the view
+  // moved on screen. If the same view is shown, only scrolled, the part still
+  // visible is moved into place.
+  const bool is_same_layout =
+      contents->IsValid && (contents->ScreenX == screen_x) &&
+      (contents->ScreenY == screen_y) &&
+      (contents->ViewRect.Width == src_rect.Width) &&
+      (contents->ViewRect.Height == src_rect.Height);
+  const bool is_same_view =
+      is_same_layout && contents->IsComplete &&
+      (contents->ViewKey == view_key) &&
+      (contents->ColorMode == _state.ColorMode) &&
+      (contents->Brightness == _state.Brightness);
+  const PixelBuffer::Rect old_rect = contents->ViewRect;
+  const int x_begin = std::max(src_rect.X, old_rect.X);
+  const int y_begin = std::max(src_rect.Y, old_rect.Y);
+  const int x_end = std::min(
+      src_rect.X + src_rect.Width, old_rect.X + old_rect.Width);
+  const int y_end = std::min(
+      src_rect.Y + src_rect.Height, old_rect.Y + old_rect.Height);
+
+  contents->IsValid = true;
+  contents->ViewKey = view_key;
+  contents->ViewRect = src_rect;
+  contents->ScreenX = screen_x;
+  contents->ScreenY = screen_y;
+  contents->ColorMode = _state.ColorMode;
+  contents->Brightness = _state.Brightness;
+
+  // 2. Redraw everything if the view changed or does not overlap.
+  std::vector<PixelBuffer::Rect> dirty_rects;
+  if (!is_same_view || (x_begin >= x_end) || (y_begin >= y_end)) {
+    if (!is_same_layout) {
+      const PixelBuffer::Size& screen_size = _fb->GetSize();
+      const PixelBuffer::Rect margins[] = {
+          PixelBuffer::Rect(0, 0, screen_size.Width, screen_y),
+          PixelBuffer::Rect(
+              0, screen_y + src_rect.Height, screen_size.Width,
+              screen_size.Height - screen_y - src_rect.Height),
+          PixelBuffer::Rect(0, screen_y, screen_x, src_rect.Height),
+          PixelBuffer::Rect(
+              screen_x + src_rect.Width, screen_y,
+              screen_size.Width - screen_x - src_rect.Width, src_rect.Height),
+      };
+      for (const PixelBuffer::Rect& margin : margins) {
+        if ((margin.Width > 0) && (margin.Height > 0)) {
+          _fb->Clear(margin);
+        }
+      }
+    }
+    dirty_rects.push_back(src_rect);
+    return dirty_rects;
+  }
+
+  // 3. Move the overlap of the old and new views, then return the strips
+  // above and below it, and to its left and right.
+  if ((old_rect.X != src_rect.X) || (old_rect.Y != src_rect.Y)) {
+    _fb->Move(
+        PixelBuffer::Rect(
+            screen_x + x_begin - old_rect.X, screen_y + y_begin - old_rect.Y,
+            x_end - x_begin, y_end - y_begin),
+        screen_x + x_begin - src_rect.X, screen_y + y_begin - src_rect.Y);
+  }
+  const PixelBuffer::Rect strips[] = {
+      PixelBuffer::Rect(
+          src_rect.X, src_rect.Y, src_rect.Width, y_begin - src_rect.Y),
+      PixelBuffer::Rect(
+          src_rect.X, y_end, src_rect.Width,
+          src_rect.Y + src_rect.Height - y_end),
+      PixelBuffer::Rect(
+          src_rect.X, y_begin, x_begin - src_rect.X, y_end - y_begin),
+      PixelBuffer::Rect(
+          x_end, y_begin, src_rect.X + src_rect.Width - x_end,
+          y_end - y_begin),
+  };
+  for (const PixelBuffer::Rect& strip : strips) {
+    if ((strip.Width > 0) && (strip.Height > 0)) {
+      dirty_rects.push_back(strip);
+    }
+  }
+  return dirty_rects;
+}
+
+int Viewer::GetNumRenderOverruns() const { return _num_render_overruns; }
+
+Viewer::RenderQuality Viewer::GetRenderQuality() {
+  // 1. Fixed qualities, and full quality unless the view keeps moving.
+  if (_state.Quality != QUALITY_ADAPTIVE) {
+    return _state.Quality;
+  }
+  if (!_is_navigating ||
+      (std::chrono::steady_clock::now() - _last_navigation_time >=
+       std::chrono::milliseconds(QUALITY_IDLE_MS))) {
+    return QUALITY_BEST;
+  }
+
+  // 2. While navigating, pick the best quality at which a screen's worth of
+  // tiles is expected to render within the budget, spread over the loader
+  // threads. Qualities that have not been measured yet are given a try.
+  const PixelBuffer::Size& screen_size = _fb->GetSize();
+  const double num_pixels_per_thread =
+      static_cast<double>(screen_size.Width) * screen_size.Height /
+      GetNumThreads();
+  std::lock_guard<std::mutex> lock(_render_time_mutex);
+  for (int quality = QUALITY_BEST; quality > QUALITY_FAST; --quality) {
+    if (_seconds_per_pixel[quality] * num_pixels_per_thread <=
+        DRAFT_RENDER_TIME_BUDGET) {
+      return static_cast<RenderQuality>(quality);
+    }
+  }
+  return QUALITY_FAST;
+}
+
+void Viewer::RecordRenderTime(
+    RenderQuality quality, int num_pixels, double seconds) {
+  const double seconds_per_pixel = seconds / std::max(1, num_pixels);
+  std::lock_guard<std::mutex> lock(_render_time_mutex);
+  double* average = &_seconds_per_pixel[quality];
+  *average = (*average == 0.0) ? seconds_per_pixel
+                               : *average + RENDER_TIME_SMOOTHING *
+                                                (seconds_per_pixel - *average);
+}
+
+PixelBuffer* Viewer::GetPreviewBuffer() {
+  if (_preview_buffer == nullptr) {
+    _preview_buffer.reset(
+        _fb->NewPixelBuffer(PixelBuffer::Size(TILE_SIZE, TILE_SIZE)));
+  }
+  return _preview_buffer.get();
+}
+
+bool Viewer::ScaleFromOtherZoom(const RenderCacheKey& key) {
+  // 1. Find recent views of the same page at other zoom ratios that are close
+  // enough, closest first.
+  std::vector<std::pair<float, RenderCacheKey>> candidates;
+  for (const RenderCacheKey& view_key : _recent_views) {
+    if ((view_key.Page != key.Page) || (view_key.Rotation != key.Rotation) ||
+        (view_key.Quality != key.Quality) ||
+        (view_key.ZoomSteps == key.ZoomSteps)) {
+      continue;
+    }
+    const float ratio =
+        static_cast<float>(std::max(view_key.ZoomSteps, key.ZoomSteps)) /
+        std::min(view_key.ZoomSteps, key.ZoomSteps);
+    if (ratio <= MAX_STAND_IN_ZOOM_RATIO) {
+      candidates.push_back(std::make_pair(ratio, view_key));
+    }
+  }
+  std::stable_sort(
+      candidates.begin(), candidates.end(),
+      [](const std::pair<float, RenderCacheKey>& a,
+         const std::pair<float, RenderCacheKey>& b) {
+        return a.first < b.first;
+      });
+
+  const Document::PageSize& page_size =
+      _doc->GetPageSize(key.Page, key.GetZoom(), key.Rotation);
+  const Document::PageRect tile_rect =
+      GetTileRect(page_size, key.TileX, key.TileY);
+  for (const auto& candidate : candidates) {
+    // 2. Find the tiles at the other zoom ratio covering the same part of the
+    // page, and make sure they are all cached.
+    const RenderCacheKey& view_key = candidate.second;
+    const Document::PageSize& src_page_size =
+        _doc->GetPageSize(key.Page, view_key.GetZoom(), key.Rotation);
+    const double x_scale =
+        static_cast<double>(src_page_size.Width) / page_size.Width;
+    const double y_scale =
+        static_cast<double>(src_page_size.Height) / page_size.Height;
+    const int src_x_begin = static_cast<int>(tile_rect.X * x_scale);
+    const int src_y_begin = static_cast<int>(tile_rect.Y * y_scale);
+    const int src_x_end = std::min<int>(
+        src_page_size.Width,
+        std::ceil((tile_rect.X + tile_rect.Width) * x_scale));
+    const int src_y_end = std::min<int>(
+        src_page_size.Height,
+        std::ceil((tile_rect.Y + tile_rect.Height) * y_scale));
+    if ((src_x_begin >= src_x_end) || (src_y_begin >= src_y_end)) {
+      continue;
+    }
+    std::vector<std::pair<RenderCacheKey, RenderCache::Handle>> src_tiles;
+    for (int tile_y = src_y_begin / TILE_SIZE;
+         tile_y * TILE_SIZE < src_y_end; ++tile_y) {
+      for (int tile_x = src_x_begin / TILE_SIZE;
+           tile_x * TILE_SIZE < src_x_end; ++tile_x) {
+        const RenderCacheKey src_key(
+            key.Page, view_key.GetZoom(), key.Rotation, tile_x, tile_y, false,
+            key.Quality);
+        RenderCache::Handle handle = _render_cache.TryGet(src_key);
+        if (handle == nullptr) {
+          break;
+        }
+        src_tiles.push_back(std::make_pair(src_key, std::move(handle)));
+      }
+    }
+    const int num_src_tiles =
+        ((src_x_end - 1) / TILE_SIZE - src_x_begin / TILE_SIZE + 1) *
+        ((src_y_end - 1) / TILE_SIZE - src_y_begin / TILE_SIZE + 1);
+    if (static_cast<int>(src_tiles.size()) != num_src_tiles) {
+      continue;
+    }
+
+    // 3. Scale the part of each source tile covering the tile into the
+    // matching part of the preview buffer. Boundaries between source tiles
+    // are mapped the same way on both sides, so that the parts fit together.
+    PixelBuffer* dest = GetPreviewBuffer();
+    for (const auto& src_tile : src_tiles) {
+      const PixelBuffer* src = src_tile.second->get();
+      const int src_tile_x = src_tile.first.TileX * TILE_SIZE;
+      const int src_tile_y = src_tile.first.TileY * TILE_SIZE;
+      const int x_begin = std::max<int>(
+          tile_rect.X, std::lround(src_tile_x / x_scale));
+      const int y_begin = std::max<int>(
+          tile_rect.Y, std::lround(src_tile_y / y_scale));
+      const int x_end = std::min<int>(
+          tile_rect.X + tile_rect.Width,
+          std::lround((src_tile_x + src->GetSize().Width) / x_scale));
+      const int y_end = std::min<int>(
+          tile_rect.Y + tile_rect.Height,
+          std::lround((src_tile_y + src->GetSize().Height) / y_scale));
+      if ((x_begin >= x_end) || (y_begin >= y_end)) {
+        continue;
+      }
+      const int src_part_x = std::max(
+          0, std::min(
+                 src->GetSize().Width - 1,
+                 static_cast<int>(x_begin * x_scale) - src_tile_x));
+      const int src_part_y = std::max(
+          0, std::min(
+                 src->GetSize().Height - 1,
+                 static_cast<int>(y_begin * y_scale) - src_tile_y));
+      const int src_part_x_end = std::min<int>(
+          src->GetSize().Width,
+          std::ceil(x_end * x_scale) - src_tile_x);
+      const int src_part_y_end = std::min<int>(
+          src->GetSize().Height,
+          std::ceil(y_end * y_scale) - src_tile_y);
+      src->Scale(
+          PixelBuffer::Rect(
+              src_part_x, src_part_y,
+              std::max(1, src_part_x_end - src_part_x),
+              std::max(1, src_part_y_end - src_part_y)),
+          PixelBuffer::Rect(
+              x_begin - tile_rect.X, y_begin - tile_rect.Y, x_end - x_begin,
+              y_end - y_begin),
+          dest, PixelBuffer::SMOOTH);
+    }
+    return true;
+  }
+  return false;
+}
+
+std::unique_ptr<PixelBuffer> Viewer::RotateFromOtherRotation(
+    const RenderCacheKey& key) {
+  const Document::PageSize& page_size =
+      _doc->GetPageSize(key.Page, key.GetZoom(), key.Rotation);
+  const Document::PageRect tile_rect =
+      GetTileRect(page_size, key.TileX, key.TileY);
+  for (int rotation = 90; rotation < 360; rotation += 90) {
+    // 1. Find the part of the page at the other rotation that turns into the
+    // tile, and make sure the tiles covering it are all cached. The page
+    // sizes must match exactly for the pixels to line up.
+    const int src_rotation = (key.Rotation + rotation) % 360;
+    const Document::PageSize& src_page_size =
+        _doc->GetPageSize(key.Page, key.GetZoom(), src_rotation);
+    const bool is_quarter_turn = (rotation == 90) || (rotation == 270);
+    if ((src_page_size.Width !=
+         (is_quarter_turn ? page_size.Height : page_size.Width)) ||
+        (src_page_size.Height !=
+         (is_quarter_turn ? page_size.Width : page_size.Height))) {
+      continue;
+    }
+    const PixelBuffer::Rect src_rect = PixelBuffer::RotateRect(
+        PixelBuffer::Rect(
+            tile_rect.X, tile_rect.Y, tile_rect.Width, tile_rect.Height),
+        PixelBuffer::Size(page_size.Width, page_size.Height), rotation);
+    std::vector<std::pair<RenderCacheKey, RenderCache::Handle>> src_tiles;
+    bool is_cached = true;
+    for (int tile_y = src_rect.Y / TILE_SIZE;
+         is_cached && (tile_y * TILE_SIZE < src_rect.Y + src_rect.Height);
+         ++tile_y) {
+      for (int tile_x = src_rect.X / TILE_SIZE;
+           is_cached && (tile_x * TILE_SIZE < src_rect.X + src_rect.Width);
+           ++tile_x) {
+        const RenderCacheKey src_key(
+            key.Page, key.GetZoom(), src_rotation, tile_x, tile_y, false,
+            key.Quality);
+        RenderCache::Handle handle = _render_cache.TryGet(src_key);
+        is_cached = handle != nullptr;
+        src_tiles.push_back(std::make_pair(src_key, std::move(handle)));
+      }
+    }
+    if (!is_cached) {
+      continue;
+    }
+
+    // 2. Rotate the part of each source tile within src_rect back into place.
+    // Turning the source page by the remaining angle gives this page.
+    std::unique_ptr<PixelBuffer> buffer(_fb->NewPixelBuffer(
+        PixelBuffer::Size(tile_rect.Width, tile_rect.Height)));
+    for (const auto& src_tile : src_tiles) {
+      const PixelBuffer* src = src_tile.second->get();
+      const int src_tile_x = src_tile.first.TileX * TILE_SIZE;
+      const int src_tile_y = src_tile.first.TileY * TILE_SIZE;
+      const int x_begin = std::max(src_rect.X, src_tile_x);
+      const int y_begin = std::max(src_rect.Y, src_tile_y);
+      const int x_end = std::min(
+          src_rect.X + src_rect.Width, src_tile_x + src->GetSize().Width);
+      const int y_end = std::min(
+          src_rect.Y + src_rect.Height, src_tile_y + src->GetSize().Height);
+      const PixelBuffer::Rect part = PixelBuffer::RotateRect(
+          PixelBuffer::Rect(x_begin, y_begin, x_end - x_begin, y_end - y_begin),
+          PixelBuffer::Size(src_page_size.Width, src_page_size.Height),
+          360 - rotation);
+      src->Rotate(
+          PixelBuffer::Rect(
+              x_begin - src_tile_x, y_begin - src_tile_y, x_end - x_begin,
+              y_end - y_begin),
+          360 - rotation, buffer.get(), part.X - tile_rect.X,
+          part.Y - tile_rect.Y);
+    }
+    return buffer;
+  }
+  return nullptr;
+}
+
+float Viewer::GetActualZoom(int page) const {
   float zoom = _state.Zoom;
   if (zoom == ZOOM_TO_WIDTH) {
     zoom = static_cast<float>(_fb->GetSize().Width) /
@@ -113,44 +748,64 @@ void Viewer::Render() {
             static_cast<float>(page_size.Height));
   }
   assert(zoom >= 0.0f);
-  zoom = std::max(MIN_ZOOM, std::min(MAX_ZOOM, zoom));
-
-  // 2. Render page to buffer.
-  PixelBuffer* buffer = _render_cache.Get(
-      RenderCacheKey(page, zoom, _state.Rotation, _state.ColorMode));
-
-  // 3. Compute the area actually visible on screen.
-  const PixelBuffer::Size &screen_size = _fb->GetSize(),
-                          &page_size = buffer->GetSize();
-  PixelBuffer::Rect src_rect;
-  src_rect.X = std::max(
-      0, std::min(page_size.Width - screen_size.Width - 1, _state.XOffset));
-  src_rect.Y = std::max(
-      0, std::min(page_size.Height - screen_size.Height - 1, _state.YOffset));
-  src_rect.Width = std::min(screen_size.Width, page_size.Width - src_rect.X);
-  src_rect.Height = std::min(screen_size.Height, page_size.Height - src_rect.Y);
-
-  // 4. Blit visible area to framebuffer.
-  _fb->Render(*buffer, src_rect);
+  return std::max(MIN_ZOOM, std::min(MAX_ZOOM, zoom));
+}
 
-  // 5. Store corrected state.
-  _state.Page = page;
-  _state.NumPages = _doc->GetNumPages();
-  if ((_state.Zoom != ZOOM_TO_WIDTH) && (_state.Zoom != ZOOM_TO_FIT)) {
-    _state.Zoom = zoom;
+const ColorTransform* Viewer::GetColorTransform(
+    const PixelBuffer::Format* format) {
+  ColorTransform::Mode mode;
+  switch (_state.ColorMode) {
+    case INVERTED:
+      mode = ColorTransform::INVERTED;
+      break;
+    case SEPIA:
+      mode = ColorTransform::SEPIA;
+      break;
+    default:
+      mode = ColorTransform::NORMAL;
+      break;
   }
-  _state.ActualZoom = zoom;
-  _state.XOffset = src_rect.X;
-  _state.YOffset = src_rect.Y;
-  _state.PageWidth = page_size.Width;
-  _state.PageHeight = page_size.Height;
-  _state.ScreenWidth = screen_size.Width;
-  _state.ScreenHeight = screen_size.Height;
+  if ((_color_transform == nullptr) ||
+      (_color_transform->GetFormat() != format) ||
+      (_color_transform->GetMode() != mode) ||
+      (_color_transform->GetBrightness() != _state.Brightness)) {
+    _color_transform.reset(
+        new ColorTransform(format, mode, _state.Brightness));
+  }
+  return _color_transform.get();
+}
 
-  // 6. Preload.
-  if ((_render_cache.GetSize() > 1) && (page < _doc->GetNumPages() - 1)) {
-    _render_cache.Prepare(
-        RenderCacheKey(page + 1, zoom, _state.Rotation, _state.ColorMode));
+PixelBuffer::Rect Viewer::GetViewRect(
+    const PixelBuffer::Size& page_size, int x_offset, int y_offset) const {
+  const PixelBuffer::Size& screen_size = _fb->GetSize();
+  PixelBuffer::Rect rect;
+  rect.X = std::max(
+      0, std::min(page_size.Width - screen_size.Width - 1, x_offset));
+  rect.Y = std::max(
+      0, std::min(page_size.Height - screen_size.Height - 1, y_offset));
+  rect.Width = std::min(screen_size.Width, page_size.Width - rect.X);
+  rect.Height = std::min(screen_size.Height, page_size.Height - rect.Y);
+  return rect;
+}
+
+void Viewer::PrepareTiles(
+    int page, float zoom, const PixelBuffer::Rect& rect, RenderQuality quality,
+    int priority) {
+  const Document::PageSize& page_size =
+      _doc->GetPageSize(page, zoom, _state.Rotation);
+  const int x_begin = std::max(0, rect.X),
+            y_begin = std::max(0, rect.Y),
+            x_end = std::min(page_size.Width, rect.X + rect.Width),
+            y_end = std::min(page_size.Height, rect.Y + rect.Height);
+  for (int tile_y = y_begin / TILE_SIZE; tile_y * TILE_SIZE < y_end;
+       ++tile_y) {
+    for (int tile_x = x_begin / TILE_SIZE; tile_x * TILE_SIZE < x_end;
+         ++tile_x) {
+      _render_cache.Prepare(
+          RenderCacheKey(
+              page, zoom, _state.Rotation, tile_x, tile_y, false, quality),
+          priority);
+    }
   }
 }
 
@@ -167,47 +822,135 @@ void Viewer::GetState(Viewer::State* state) const {
   state->ScreenWidth = _state.ScreenWidth;
   state->ScreenHeight = _state.ScreenHeight;
   state->ColorMode = _state.ColorMode;
+  state->Brightness = _state.Brightness;
+  state->Quality = _state.Quality;
+}
+
+void Viewer::SetState(const State& state) {
+  if ((state.Page != _state.Page) || (state.Zoom != _state.Zoom) ||
+      (state.Rotation != _state.Rotation) ||
+      (state.XOffset != _state.XOffset) || (state.YOffset != _state.YOffset)) {
+    const auto now = std::chrono::steady_clock::now();
+    _is_navigating = (now - _last_navigation_time <
+                      std::chrono::milliseconds(QUALITY_IDLE_MS));
+    _last_navigation_time = now;
+  }
+  _state = state;
+}
+
+Viewer::RenderCacheKey::RenderCacheKey(
+    int page, float zoom, int rotation, int tile_x, int tile_y,
+    bool is_preview, RenderQuality quality)
+    : Page(page),
+      ZoomSteps(static_cast<int>(lroundf(zoom * ZOOM_STEPS_PER_UNIT))),
+      Rotation(((rotation % 360) + 360) % 360),
+      TileX(tile_x),
+      TileY(tile_y),
+      IsPreview(is_preview),
+      Quality(quality) {
+  ZoomSteps = std::max(1, ZoomSteps);
 }
 
-void Viewer::SetState(const State& state) { _state = state; }
+float Viewer::RenderCacheKey::GetZoom() const {
+  return static_cast<float>(ZoomSteps) / ZOOM_STEPS_PER_UNIT;
+}
 
-bool Viewer::RenderCacheKey::operator<(
+bool Viewer::RenderCacheKey::operator==(
     const Viewer::RenderCacheKey& other) const {
-  if (Page != other.Page) {
-    return Page < other.Page;
-  }
-  const int rotation_mod = Rotation % 360,
-            other_rotation_mod = other.Rotation % 360;
-  if (rotation_mod != other_rotation_mod) {
-    return rotation_mod < other_rotation_mod;
-  }
-  if (fabs(Zoom / other.Zoom - 1.0f) >= 0.1f) {
-    return Zoom < other.Zoom;
-  }
-  if (ColorMode != other.ColorMode) {
-    return ColorMode < other.ColorMode;
-  }
-  return false;
+  return (Page == other.Page) && (ZoomSteps == other.ZoomSteps) &&
+         (Rotation == other.Rotation) && (TileX == other.TileX) &&
+         (TileY == other.TileY) && (IsPreview == other.IsPreview) &&
+         (Quality == other.Quality);
+}
+
+size_t Viewer::RenderCacheKey::Hash::operator()(
+    const Viewer::RenderCacheKey& key) const {
+  size_t hash = std::hash<int>()(key.Page);
+  hash = hash * 31 + std::hash<int>()(key.ZoomSteps);
+  hash = hash * 31 + std::hash<int>()(key.Rotation);
+  hash = hash * 31 + std::hash<int>()(key.TileX);
+  hash = hash * 31 + std::hash<int>()(key.TileY);
+  hash = hash * 31 + std::hash<bool>()(key.IsPreview);
+  hash = hash * 31 + std::hash<int>()(key.Quality);
+  return hash;
 }
 
-Viewer::RenderCache::RenderCache(Viewer* parent, int size)
-    : Cache<RenderCacheKey, PixelBuffer*>(size), _parent(parent) {}
+Viewer::RenderCache::RenderCache(
+    Viewer* parent, int size, RenderCachePolicy policy)
+    : Cache<
+          RenderCacheKey, std::unique_ptr<PixelBuffer>, RenderCacheKey::Hash>(
+          size, GetNumThreads(),
+          policy == GDSF ? std::unique_ptr<EvictionPolicy>(
+                               new GDSFCacheEvictionPolicy<
+                                   RenderCacheKey, RenderCacheKey::Hash>())
+                         : nullptr),
+      _parent(parent) {}
 
 Viewer::RenderCache::~RenderCache() { Clear(); }
 
-PixelBuffer* Viewer::RenderCache::Load(const RenderCacheKey& key) {
-  const Document::PageSize& page_size =
-      _parent->_doc->GetPageSize(key.Page, key.Zoom, key.Rotation);
+std::unique_ptr<PixelBuffer> Viewer::RenderCache::Load(
+    const RenderCacheKey& key) {
+  const CancellationToken token;
+  return LoadCancellable(key, token);
+}
+
+std::unique_ptr<PixelBuffer> Viewer::RenderCache::LoadCancellable(
+    const RenderCacheKey& key, const CancellationToken& token) {
+  // 1. Find the region of the rendered page covered by the tile. A preview
+  // covers the same part of the page rendered at a lower zoom ratio.
+  float zoom = key.GetZoom();
+  Document::PageRect region = GetTileRect(
+      _parent->_doc->GetPageSize(key.Page, zoom, key.Rotation), key.TileX,
+      key.TileY);
+  if (key.IsPreview) {
+    zoom /= PREVIEW_SCALE;
+    const Document::PageSize& preview_page_size =
+        _parent->_doc->GetPageSize(key.Page, zoom, key.Rotation);
+    const int x = std::min(
+        region.X / PREVIEW_SCALE, std::max(0, preview_page_size.Width - 1));
+    const int y = std::min(
+        region.Y / PREVIEW_SCALE, std::max(0, preview_page_size.Height - 1));
+    region = Document::PageRect(
+        x, y,
+        std::min(
+            (region.Width + PREVIEW_SCALE - 1) / PREVIEW_SCALE,
+            preview_page_size.Width - x),
+        std::min(
+            (region.Height + PREVIEW_SCALE - 1) / PREVIEW_SCALE,
+            preview_page_size.Height - y));
+  }
+  assert((region.Width > 0) && (region.Height > 0));
 
-  PixelBuffer* buffer = _parent->_fb->NewPixelBuffer(
-      PixelBuffer::Size(page_size.Width, page_size.Height));
-  PixelBufferWriter writer(buffer, key.ColorMode);
-  _parent->_doc->Render(&writer, key.Page, key.Zoom, key.Rotation);
+  // 2. Turning a page by quarter turns does not change its pixels, so a tile
+  // cached at another rotation is simply rotated.
+  if (!key.IsPreview) {
+    std::unique_ptr<PixelBuffer> buffer = _parent->RotateFromOtherRotation(key);
+    if (buffer != nullptr) {
+      return buffer;
+    }
+  }
+
+  // 3. Render it. Complete renders of tiles other than previews are timed
+  // for QUALITY_ADAPTIVE.
+  std::unique_ptr<PixelBuffer> buffer(_parent->_fb->NewPixelBuffer(
+      PixelBuffer::Size(region.Width, region.Height)));
+  PixelBufferWriter writer(buffer.get());
+  const auto render_start_time = std::chrono::steady_clock::now();
+  _parent->_doc->Render(
+      &writer, key.Page, zoom, key.Rotation, region,
+      GetDocumentQuality(key.Quality), &token);
+  const std::chrono::duration<double> render_time =
+      std::chrono::steady_clock::now() - render_start_time;
+  if (!key.IsPreview && !token.IsCancelled()) {
+    _parent->RecordRenderTime(
+        key.Quality, region.Width * region.Height, render_time.count());
+  }
 
   return buffer;
 }
 
-void Viewer::RenderCache::Discard(
-    const RenderCacheKey& key, PixelBuffer* const& value) {
-  delete value;
+size_t Viewer::RenderCache::GetValueSize(
+    const RenderCacheKey& /* key */,
+    const std::unique_ptr<PixelBuffer>& value) const {
+  return value->GetBufferByteSize();
 }
@@ -23,6 +23,10 @@
 #define VIEWER_HPP
 
 #include "cache.hpp"
+#include "color_transform.hpp"
+#include <chrono>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 class Document;
@@ -31,8 +35,18 @@ class PixelBuffer;
 
 class Viewer {
  public:
-  // Default number of rendered pages to keep in cache.
+  // Default number of screens' worth of rendered tiles to keep in cache.
   enum { DEFAULT_RENDER_CACHE_SIZE = 8 };
+  // Render cache size that effectively lifts the limit on the number of
+  // cached tiles, for use with a memory budget.
+  enum { UNLIMITED_RENDER_CACHE_SIZE = 1 << 20 };
+  // Pages are rendered in square tiles of this size in pixels, so that only
+  // the visible part of a page is rendered and memory use does not grow with
+  // zoom.
+  enum { TILE_SIZE = 256 };
+  // In progressive mode, previews of missing tiles are rendered at this
+  // fraction of the zoom ratio.
+  enum { PREVIEW_SCALE = 4 };
 
   // Zoom modes.
   enum {
@@ -42,13 +56,46 @@ class Viewer {
     ZOOM_TO_WIDTH = -4,
   };
 
-  // Color mode.
+  // Render cache eviction policies.
+  enum RenderCachePolicy {
+    // Evict the least recently viewed page.
+    LRU,
+    // Evict the page that is cheapest to re-render for the memory it takes
+    // up, favoring frequently viewed pages (GreedyDual-Size-Frequency).
+    GDSF,
+  };
+
+  // Color mode. Color modes are applied when a rendered page is copied to the
+  // screen, so switching them does not re-render anything.
   enum ColorMode {
     NORMAL,
     INVERTED,
     SEPIA,
   };
 
+  // Render quality profiles.
+  enum RenderQuality {
+    // No anti-aliasing, color management or image interpolation.
+    QUALITY_FAST,
+    // Anti-aliased text, less anti-aliased graphics, and no color management.
+    QUALITY_NORMAL,
+    // Full quality.
+    QUALITY_BEST,
+    // While the view keeps moving, e.g. while a key is held down, the best of
+    // the above at which pages are expected to render quickly, judging by
+    // measured render times. QUALITY_BEST otherwise.
+    QUALITY_ADAPTIVE,
+  };
+  // For QUALITY_ADAPTIVE, the view counts as moving while it has moved twice
+  // within this many milliseconds.
+  enum { QUALITY_IDLE_MS = 300 };
+
+  // Range of brightness levels, in percent.
+  enum {
+    MIN_BRIGHTNESS = 5,
+    MAX_BRIGHTNESS = 200,
+  };
+
   // Maximum zoom ratio.
   static const float MAX_ZOOM;
   // Minimum zoom ratio.
@@ -97,6 +144,11 @@ class Viewer {
     bool UseButton;
     // Current color mode.
     enum ColorMode ColorMode;
+    // Brightness in percent, applied along with the color mode. Values below
+    // 100 dim the screen.
+    int Brightness;
+    // Render quality profile.
+    enum RenderQuality Quality;
 
     State(
         int page = 0, float zoom = ZOOM_TO_WIDTH, int rotation = 0,
@@ -107,20 +159,41 @@ class Viewer {
           XOffset(x_offset),
           YOffset(y_offset),
           ColorMode(NORMAL),
+          Brightness(ColorTransform::DEFAULT_BRIGHTNESS),
+          Quality(QUALITY_BEST),
           Interval(0),
           ShowProgress(false),
           UseButton(false) {}
   };
 
   // Constructs a new Viewer object. Does not take ownership of the document or
-  // the framebuffer object.
+  // the framebuffer object. render_cache_size is the number of screens' worth
+  // of tiles to cache. render_cache_memory limits the total size of rendered
+  // tiles in the cache in bytes, or 0 for no limit. If progressive is true,
+  // Render() does not wait for missing tiles, and shows low resolution
+  // previews of them instead. Otherwise, if render_deadline_ms is positive,
+  // Render() waits at most that long for missing tiles, and shows whatever is
+  // available of tiles that miss the deadline.
   Viewer(
       Document* doc, Framebuffer* fb, const State& state = State(),
-      int render_cache_size = DEFAULT_RENDER_CACHE_SIZE);
+      int render_cache_size = DEFAULT_RENDER_CACHE_SIZE,
+      RenderCachePolicy render_cache_policy = LRU,
+      size_t render_cache_memory = 0, bool progressive = false,
+      int render_deadline_ms = 0);
   virtual ~Viewer();
 
   // Renders the present view to the framebuffer.
   void Render();
+  // Returns whether the last call to Render() showed previews of tiles that
+  // are still being rendered. If so, Render() should be called again shortly
+  // to show them in full quality.
+  bool IsRefining() const;
+  // Forgets what is on screen, so that the next call to Render() redraws all
+  // of it. Call this after something else drew on the screen, or after the
+  // screen was lost, e.g. to another virtual terminal.
+  void Invalidate();
+  // Returns the number of calls to Render() that missed the render deadline.
+  int GetNumRenderOverruns() const;
 
   // Stores the current state in the given pointer. Must be called AFTER at
   // least one call to Render().
@@ -136,41 +209,167 @@ class Viewer {
   Framebuffer* _fb;
   // Settings.
   State _state;
+  // Number of tiles that may be visible on screen at once.
+  int _num_tiles_per_screen;
+  // Whether to show previews of missing tiles instead of waiting for them.
+  const bool _progressive;
+  // Maximum time Render() waits for missing tiles, or 0 for no limit.
+  const int _render_deadline_ms;
+  // Whether the last call to Render() showed previews or partial tiles.
+  bool _is_refining;
+  // Number of calls to Render() that missed the render deadline.
+  int _num_render_overruns;
+  // Time at which SetState() last moved the view.
+  std::chrono::steady_clock::time_point _last_navigation_time;
+  // Whether the last move of the view closely followed the one before.
+  bool _is_navigating;
+  // Lock guarding _seconds_per_pixel, which is updated by loader threads.
+  std::mutex _render_time_mutex;
+  // Moving average of the time it took to render a pixel at each quality, or
+  // 0 if not measured yet.
+  double _seconds_per_pixel[QUALITY_ADAPTIVE];
+  // Buffer of TILE_SIZE x TILE_SIZE pixels that previews and renders at other
+  // zoom ratios are scaled into before being copied to the screen. Allocated
+  // on first use.
+  std::unique_ptr<PixelBuffer> _preview_buffer;
+  // Transform applying the color mode and brightness, rebuilt whenever they
+  // change.
+  std::unique_ptr<ColorTransform> _color_transform;
+
+  // Returns _preview_buffer, allocating it if needed.
+  PixelBuffer* GetPreviewBuffer();
+  // Returns the actual zoom ratio for a page under the current settings,
+  // resolving ZOOM_* modes and clamping to [MIN_ZOOM, MAX_ZOOM].
+  float GetActualZoom(int page) const;
+  // Returns the quality to render the view at, resolving QUALITY_ADAPTIVE.
+  RenderQuality GetRenderQuality();
+  // Records that rendering num_pixels at quality took the given time.
+  void RecordRenderTime(RenderQuality quality, int num_pixels, double seconds);
+  // Returns the transform for the current color mode and brightness, for
+  // pixels in format.
+  const ColorTransform* GetColorTransform(const PixelBuffer::Format* format);
+  // Returns the area of a rendered page of page_size shown on screen at the
+  // given offsets, which are clamped to the page.
+  PixelBuffer::Rect GetViewRect(
+      const PixelBuffer::Size& page_size, int x_offset, int y_offset) const;
+  // Requests the tiles covering rect on a page to be rendered in the
+  // background at the given quality.
+  void PrepareTiles(
+      int page, float zoom, const PixelBuffer::Rect& rect,
+      RenderQuality quality, int priority);
 
-  // Key to the render cache.
+  // Key to the render cache, identifying a tile of a rendered page.
   struct RenderCacheKey {
+    // Number of zoom steps per unit of zoom ratio. Zoom ratios are rounded to
+    // the nearest step so that keys can be hashed and compared exactly.
+    enum { ZOOM_STEPS_PER_UNIT = 1000 };
+
     // Page number, starting from 0.
     int Page;
-    // Zoom ratio at which the buffer was rendered. This must be the actual
-    // ratio, and NOT one of the ZOOM_* constants.
-    float Zoom;
-    // Rotation in clockwise degrees.
+    // Zoom ratio at which the buffer was rendered, in ZOOM_STEPS_PER_UNIT
+    // steps. This must be the actual ratio, and NOT one of the ZOOM_*
+    // constants.
+    int ZoomSteps;
+    // Rotation in clockwise degrees, normalized to [0, 360).
     int Rotation;
-    // Color mode.
-    enum ColorMode ColorMode;
+    // Column and row of the tile in the rendered page. The tile covers
+    // TILE_SIZE pixels from (TileX * TILE_SIZE, TileY * TILE_SIZE), or less at
+    // the right and bottom edges of the page.
+    int TileX, TileY;
+    // Whether this is a preview of the tile, rendered at 1 / PREVIEW_SCALE of
+    // the zoom ratio and not scaled up.
+    bool IsPreview;
+    // Quality the tile is rendered at. Never QUALITY_ADAPTIVE.
+    RenderQuality Quality;
 
     RenderCacheKey(
-        int page, float zoom, int rotation, enum ColorMode color_mode)
-        : Page(page), Zoom(zoom), Rotation(rotation), ColorMode(color_mode) {}
+        int page, float zoom, int rotation, int tile_x = 0, int tile_y = 0,
+        bool is_preview = false, RenderQuality quality = QUALITY_BEST);
+
+    // Returns the quantized zoom ratio.
+    float GetZoom() const;
+
+    bool operator==(const RenderCacheKey& other) const;
 
-    // This is required as this class will be inserted into a map.
-    bool operator<(const RenderCacheKey& other) const;
+    // Hash function, as this class is used as the key of a hash map.
+    struct Hash {
+      size_t operator()(const RenderCacheKey& key) const;
+    };
   };
   // Render cache class.
-  class RenderCache : public Cache<RenderCacheKey, PixelBuffer*> {
+  class RenderCache : public Cache<
+                          RenderCacheKey, std::unique_ptr<PixelBuffer>,
+                          RenderCacheKey::Hash> {
    public:
-    RenderCache(Viewer* parent, int size);
+    RenderCache(Viewer* parent, int size, RenderCachePolicy policy);
     virtual ~RenderCache();
 
    protected:
-    PixelBuffer* Load(const RenderCacheKey& key) override;
-    void Discard(const RenderCacheKey& key, PixelBuffer* const& value) override;
+    std::unique_ptr<PixelBuffer> Load(const RenderCacheKey& key) override;
+    std::unique_ptr<PixelBuffer> LoadCancellable(
+        const RenderCacheKey& key, const CancellationToken& token) override;
+    size_t GetValueSize(
+        const RenderCacheKey& key,
+        const std::unique_ptr<PixelBuffer>& value) const override;
 
    private:
     Viewer* _parent;
   };
   // Render cache.
   RenderCache _render_cache;
+  // Keys to the first tile of recently shown views, most recent first. Tiles
+  // of these views may still be cached, and are scaled to stand in for
+  // missing tiles after zooming.
+  std::vector<RenderCacheKey> _recent_views;
+
+  // Scales cached tiles of the page of key, at the closest recently shown
+  // zoom ratio, into _preview_buffer to stand in for the tile of key. Returns
+  // false if there is no such zoom ratio with all the needed tiles cached.
+  bool ScaleFromOtherZoom(const RenderCacheKey& key);
+  // Returns the tile of key rotated from cached tiles of the same page at
+  // another rotation, or nullptr if there is no rotation with all the needed
+  // tiles cached. Thread-safe.
+  std::unique_ptr<PixelBuffer> RotateFromOtherRotation(
+      const RenderCacheKey& key);
+
+  // What Render() last drew on a framebuffer buffer.
+  struct ScreenContents {
+    // Whether the rest of this describes what is on screen.
+    bool IsValid;
+    // Key to the first tile of the view shown.
+    RenderCacheKey ViewKey;
+    // Area of the rendered page shown, and where its top-left corner is on
+    // screen.
+    PixelBuffer::Rect ViewRect;
+    int ScreenX, ScreenY;
+    // Color mode and brightness the view was drawn with.
+    enum ColorMode ColorMode;
+    int Brightness;
+    // Whether the view was drawn entirely from complete tiles, with no
+    // previews or stand-ins that still need refining.
+    bool IsComplete;
+
+    ScreenContents()
+        : IsValid(false),
+          ViewKey(0, 1.0f, 0),
+          ScreenX(0),
+          ScreenY(0),
+          ColorMode(NORMAL),
+          Brightness(0),
+          IsComplete(false) {}
+  };
+  // What is on each buffer of the framebuffer, indexed by
+  // Framebuffer::GetBufferIndex().
+  ScreenContents _screen_contents[2];
+
+  // Prepares the screen described by contents for showing src_rect of the
+  // view of view_key with its top-left corner at (screen_x, screen_y), and
+  // updates contents accordingly. Clears margins that are not already
+  // cleared, and moves the part of a scrolled view that stays on screen.
+  // Returns the areas of the view, in page coordinates, left to draw.
+  std::vector<PixelBuffer::Rect> UpdateScreen(
+      ScreenContents* contents, const RenderCacheKey& view_key,
+      const PixelBuffer::Rect& src_rect, int screen_x, int screen_y);
 };
 
 #endif
@@ -0,0 +1,200 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file implements a framebuffer that lives in memory.
+
+#include "virtual_framebuffer.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "file_utils.hpp"
+
+namespace {
+
+// Bit fields of a pixel format, as found in fb_var_screeninfo.
+struct PixelFormatSpec {
+  const char* Name;
+  int BitsPerPixel;
+  int RedOffset, RedLength;
+  int GreenOffset, GreenLength;
+  int BlueOffset, BlueLength;
+  // Whether pixels are grey levels, and the bit fields are ignored.
+  bool IsGray;
+};
+
+// Supported pixel formats. Names give channels from the most significant
+// bits to the least.
+const PixelFormatSpec PIXEL_FORMATS[] = {
+    {"rgb565", 16, 11, 5, 5, 6, 0, 5, false},
+    {"bgr565", 16, 0, 5, 5, 6, 11, 5, false},
+    {"xrgb8888", 32, 16, 8, 8, 8, 0, 8, false},
+    {"xbgr8888", 32, 0, 8, 8, 8, 16, 8, false},
+    {"bgrx8888", 32, 8, 8, 16, 8, 24, 8, false},
+    {"rgb888", 24, 16, 8, 8, 8, 0, 8, false},
+    {"bgr888", 24, 0, 8, 8, 8, 16, 8, false},
+    {"gray8", 8, 0, 8, 0, 8, 0, 8, true},
+};
+
+// Maximum width and height of a virtual framebuffer, in pixels.
+const int MAX_SIZE = 16384;
+
+// Placeholder in dump paths for the frame number.
+const char* const FRAME_NUMBER_PLACEHOLDER = "%d";
+
+}  // namespace
+
+const char* const VirtualFramebuffer::DEFAULT_PIXEL_FORMAT = "xrgb8888";
+
+VirtualFramebuffer* VirtualFramebuffer::Open(
+    const std::string& spec, int rotation, bool double_buffered) {
+  std::unique_ptr<VirtualFramebuffer> fb(
+      new VirtualFramebuffer(spec, rotation));
+
+  // 1. Split the spec into size, pixel format and dump path.
+  std::string size_spec = spec, format_name = DEFAULT_PIXEL_FORMAT;
+  const size_t colon = size_spec.find(':');
+  if (colon != std::string::npos) {
+    fb->_dump_path = size_spec.substr(colon + 1);
+    size_spec.erase(colon);
+  }
+  const size_t at = size_spec.find('@');
+  if (at != std::string::npos) {
+    format_name = size_spec.substr(at + 1);
+    size_spec.erase(at);
+  }
+  int width, height;
+  char trailing;
+  const PixelFormatSpec* format = nullptr;
+  for (const PixelFormatSpec& candidate : PIXEL_FORMATS) {
+    if (format_name == candidate.Name) {
+      format = &candidate;
+    }
+  }
+  if ((sscanf(size_spec.c_str(), "%dx%d%c", &width, &height, &trailing) !=
+       2) ||
+      (width <= 0) || (width > MAX_SIZE) || (height <= 0) ||
+      (height > MAX_SIZE) || (format == nullptr)) {
+    fprintf(stderr, "Invalid virtual framebuffer \"%s\"\n", spec.c_str());
+    return nullptr;
+  }
+
+  // 2. Describe the screen as a framebuffer device would, with room for two
+  // pages if double buffered.
+  fb_var_screeninfo& vinfo = fb->_vinfo;
+  memset(&vinfo, 0, sizeof(vinfo));
+  vinfo.xres = vinfo.xres_virtual = width;
+  vinfo.yres = height;
+  vinfo.yres_virtual = double_buffered ? 2 * height : height;
+  vinfo.bits_per_pixel = format->BitsPerPixel;
+  vinfo.grayscale = format->IsGray ? 1 : 0;
+  vinfo.red.offset = format->RedOffset;
+  vinfo.red.length = format->RedLength;
+  vinfo.green.offset = format->GreenOffset;
+  vinfo.green.length = format->GreenLength;
+  vinfo.blue.offset = format->BlueOffset;
+  vinfo.blue.length = format->BlueLength;
+  fb->_is_double_buffered = double_buffered;
+
+  // 3. Allocate the pages, black.
+  const int line_length = width * format->BitsPerPixel / 8;
+  fb->_buffer.assign(
+      static_cast<size_t>(line_length) * vinfo.yres_virtual, 0);
+  fb->InitPages(fb->_buffer.data(), line_length, vinfo.yres_virtual);
+  return fb.release();
+}
+
+VirtualFramebuffer::VirtualFramebuffer(const std::string& spec, int rotation)
+    : Framebuffer(rotation), _spec(spec), _num_frames(0) {}
+
+std::string VirtualFramebuffer::GetDebugInfoString() {
+  std::ostringstream out;
+
+  out << "Device:\t\t\t" << VIRTUAL_FRAMEBUFFER_PREFIX << _spec << std::endl;
+  out << "Visible resolution:\t" << _vinfo.xres << " x " << _vinfo.yres
+      << std::endl;
+  out << "Rotation:\t\t" << _rotation << std::endl;
+  out << "Double buffered:\t" << (_is_double_buffered ? "yes" : "no")
+      << std::endl;
+  out << "Bits per pixel:\t\t" << _vinfo.bits_per_pixel << std::endl;
+  out << "Frames shown:\t\t" << _num_frames << std::endl;
+
+  return out.str();
+}
+
+std::vector<uint8_t> VirtualFramebuffer::GetFrame() const {
+  const int depth = _format->GetDepth();
+  const size_t num_pixels = static_cast<size_t>(_vinfo.xres) * _vinfo.yres;
+  const uint8_t* src = _buffer.data() + _front * num_pixels * depth;
+  std::vector<uint8_t> rgb(num_pixels * 3);
+  for (size_t i = 0; i < num_pixels; ++i, src += depth) {
+    // Read pixel values the way PixelBuffer writes them.
+    uint32_t value;
+    switch (depth) {
+      case 1:
+        value = src[0];
+        break;
+      case 2: {
+        uint16_t value_16;
+        memcpy(&value_16, src, 2);
+        value = value_16;
+        break;
+      }
+      case 3:
+        value = src[0] | (src[1] << 8) | (src[2] << 16);
+        break;
+      default:
+        memcpy(&value, src, 4);
+        break;
+    }
+    _format->Unpack(value, &rgb[i * 3], &rgb[i * 3 + 1], &rgb[i * 3 + 2]);
+  }
+  return rgb;
+}
+
+bool VirtualFramebuffer::DumpFrame(const std::string& path) const {
+  const std::vector<uint8_t> rgb = GetFrame();
+  std::string contents = "P6\n" + std::to_string(_vinfo.xres) + " " +
+                         std::to_string(_vinfo.yres) + "\n255\n";
+  contents.append(rgb.begin(), rgb.end());
+  return WriteFileAtomically(path, contents);
+}
+
+int VirtualFramebuffer::GetNumFrames() const { return _num_frames; }
+
+bool VirtualFramebuffer::ShowPage(int /* index */) { return true; }
+
+void VirtualFramebuffer::OnFrameShown() {
+  if (!_dump_path.empty()) {
+    std::string path = _dump_path;
+    const size_t placeholder = path.find(FRAME_NUMBER_PLACEHOLDER);
+    if (placeholder != std::string::npos) {
+      path.replace(
+          placeholder, strlen(FRAME_NUMBER_PLACEHOLDER),
+          std::to_string(_num_frames));
+    }
+    if (!DumpFrame(path)) {
+      perror(("Error dumping frame to \"" + path + "\"").c_str());
+    }
+  }
+  ++_num_frames;
+}
@@ -0,0 +1,80 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                           *
+ *  Copyright (C) 2012-2020 Chuan Ji                                         *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *   http://www.apache.org/licenses/LICENSE-2.0                              *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// This file declares a framebuffer that lives in memory.
+
+#ifndef VIRTUAL_FRAMEBUFFER_HPP
+#define VIRTUAL_FRAMEBUFFER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "framebuffer.hpp"
+
+// A framebuffer in memory, without a display, e.g. for tests and benchmarks.
+// Frames on screen can be read back, or dumped to image files as they are
+// shown.
+class VirtualFramebuffer : public Framebuffer {
+ public:
+  // Name of the pixel format used if a spec does not give one.
+  static const char* const DEFAULT_PIXEL_FORMAT;
+
+  // Factory method. spec is WIDTHxHEIGHT[@FORMAT][:DUMP_PATH], e.g.
+  // 1920x1080@rgb565. FORMAT is one of rgb565, bgr565, xrgb8888, xbgr8888,
+  // bgrx8888, rgb888, bgr888 and gray8. If DUMP_PATH is given, each frame is
+  // written there with DumpFrame() as it is shown; a %d in DUMP_PATH is
+  // replaced by the number of the frame, starting from 0. Returns nullptr if
+  // spec is invalid. Caller owns returned object. See Framebuffer::Open() for
+  // the other arguments.
+  static VirtualFramebuffer* Open(
+      const std::string& spec, int rotation, bool double_buffered);
+
+  // See Framebuffer.
+  std::string GetDebugInfoString() override;
+
+  // Returns the pixels on screen as 3 bytes each in the order r, g, b, row by
+  // row. Pixels are in the orientation of the device, before rotation.
+  std::vector<uint8_t> GetFrame() const;
+  // Writes the pixels on screen to a binary PPM file, as GetFrame() returns
+  // them. Returns false on failure.
+  bool DumpFrame(const std::string& path) const;
+  // Returns the number of frames shown so far.
+  int GetNumFrames() const;
+
+ protected:
+  // See Framebuffer. Pages are shown immediately.
+  bool ShowPage(int index) override;
+  // See Framebuffer.
+  void OnFrameShown() override;
+
+ private:
+  // The spec the framebuffer was opened with.
+  const std::string _spec;
+  // Memory of all pages.
+  std::vector<uint8_t> _buffer;
+  // Path pattern that frames are dumped to, or the empty string.
+  std::string _dump_path;
+  // Number of frames shown so far.
+  int _num_frames;
+
+  // Contructors are disallowed. Use factory method Open() instead.
+  VirtualFramebuffer(const std::string& spec, int rotation);
+};
+
+#endif
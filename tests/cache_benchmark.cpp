@@ -0,0 +1,97 @@
+// Measures Cache::Get() latency while other threads keep the cache busy with
+// prefetches and lookups of their own. Run without arguments; prints latency
+// percentiles in microseconds.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../src/cache.hpp"
+
+namespace {
+
+// Number of threads issuing prefetches and lookups concurrently.
+const int NUM_PREFETCHERS = 8;
+// Number of distinct keys.
+const int NUM_KEYS = 64;
+// Maximum number of cached entries.
+const int CACHE_SIZE = 16;
+// Simulated time it takes to load a value.
+const std::chrono::microseconds LOAD_TIME(200);
+// Number of timed Get() calls.
+const int NUM_SAMPLES = 5000;
+
+// A cache whose loads take a fixed amount of CPU time.
+class BusyCache : public Cache<int, int> {
+ public:
+  BusyCache() : Cache<int, int>(CACHE_SIZE) {}
+  ~BusyCache() { Clear(); }
+
+ protected:
+  int Load(const int& key) override {
+    const auto end_time = std::chrono::steady_clock::now() + LOAD_TIME;
+    while (std::chrono::steady_clock::now() < end_time) {
+    }
+    return key;
+  }
+};
+
+}  // namespace
+
+int main() {
+  BusyCache cache;
+  std::atomic<bool> stopping(false);
+
+  // 1. Start prefetchers. Each one behaves like a viewer: it prefetches a few
+  // keys, then waits for one of them.
+  std::vector<std::thread> prefetchers;
+  for (int i = 0; i < NUM_PREFETCHERS; ++i) {
+    prefetchers.push_back(std::thread([&cache, &stopping, i] {
+      std::mt19937 random(i);
+      std::uniform_int_distribution<int> key_distribution(0, NUM_KEYS - 1);
+      while (!stopping) {
+        const int key = key_distribution(random);
+        cache.Prepare((key + 1) % NUM_KEYS, 1);
+        cache.Prepare((key + 2) % NUM_KEYS, 2);
+        cache.Get(key);
+      }
+    }));
+  }
+
+  // 2. Time Get() calls from the main thread.
+  std::mt19937 random(NUM_PREFETCHERS);
+  std::uniform_int_distribution<int> key_distribution(0, NUM_KEYS - 1);
+  std::vector<double> latencies;
+  latencies.reserve(NUM_SAMPLES);
+  for (int i = 0; i < NUM_SAMPLES; ++i) {
+    const int key = key_distribution(random);
+    const auto start_time = std::chrono::steady_clock::now();
+    cache.Get(key);
+    const std::chrono::duration<double, std::micro> latency =
+        std::chrono::steady_clock::now() - start_time;
+    latencies.push_back(latency.count());
+  }
+
+  stopping = true;
+  for (std::thread& prefetcher : prefetchers) {
+    prefetcher.join();
+  }
+
+  // 3. Report.
+  std::sort(latencies.begin(), latencies.end());
+  double total = 0.0;
+  for (double latency : latencies) {
+    total += latency;
+  }
+  printf(
+      "Get() latency with %d prefetchers over %d samples (us): "
+      "mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+      NUM_PREFETCHERS, NUM_SAMPLES, total / latencies.size(),
+      latencies[latencies.size() / 2], latencies[latencies.size() * 9 / 10],
+      latencies[latencies.size() * 99 / 100], latencies.back());
+  return 0;
+}
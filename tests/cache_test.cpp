@@ -0,0 +1,513 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../src/cache.hpp"
+
+namespace {
+
+// A cache that maps each key to its square and records calls to Load() and
+// Discard(). Loads can be held back with Block() to inspect scheduling order.
+class SquareCache : public Cache<int, int> {
+ public:
+  explicit SquareCache(int size, int num_loader_threads = 1)
+      : Cache<int, int>(size, num_loader_threads),
+        _blocked(false),
+        _num_discarded(0) {}
+  ~SquareCache() { Clear(); }
+
+  void Block() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _blocked = true;
+  }
+  void Unblock() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _blocked = false;
+    }
+    _condition.notify_all();
+  }
+  std::vector<int> GetLoadedKeys() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _loaded_keys;
+  }
+  int GetNumDiscarded() const { return _num_discarded; }
+  bool IsDiscarded(int key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _discarded_keys.count(key) > 0;
+  }
+
+ protected:
+  int Load(const int& key) override {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _loaded_keys.push_back(key);
+    _condition.wait(lock, [this] { return !_blocked; });
+    return key * key;
+  }
+  void Discard(const int& key, const int& value) override {
+    EXPECT_EQ(value, key * key);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _discarded_keys.insert(key);
+    ++_num_discarded;
+  }
+
+ private:
+  std::mutex _mutex;
+  std::condition_variable _condition;
+  bool _blocked;
+  std::vector<int> _loaded_keys;
+  std::set<int> _discarded_keys;
+  std::atomic<int> _num_discarded;
+};
+
+// A cache whose values are as large as their keys.
+class SizedCache : public Cache<int, int> {
+ public:
+  explicit SizedCache(int size) : Cache<int, int>(size, 1) {}
+  ~SizedCache() { Clear(); }
+
+ protected:
+  int Load(const int& key) override { return key; }
+  size_t GetValueSize(const int& /* key */, const int& value) const override {
+    return value;
+  }
+};
+
+// A cache whose values are move-only.
+class MoveOnlyCache : public Cache<int, std::unique_ptr<int>> {
+ public:
+  explicit MoveOnlyCache(int size) : Cache<int, std::unique_ptr<int>>(size) {}
+  ~MoveOnlyCache() { Clear(); }
+
+ protected:
+  std::unique_ptr<int> Load(const int& key) override {
+    return std::unique_ptr<int>(new int(key));
+  }
+};
+
+// A cache whose loads keep going until they are cancelled or released with
+// Release(). Cancelled loads return -1.
+class CancellableCache : public Cache<int, int> {
+ public:
+  CancellableCache()
+      : Cache<int, int>(100, 1), _is_released(false), _num_started(0) {}
+  ~CancellableCache() { Clear(); }
+
+  void Release() { _is_released = true; }
+  int GetNumStarted() const { return _num_started; }
+
+ protected:
+  int Load(const int& key) override { return key; }
+  int LoadCancellable(const int& key, const CancellationToken& token) override {
+    ++_num_started;
+    while (!_is_released) {
+      if (token.IsCancelled()) {
+        return -1;
+      }
+      std::this_thread::yield();
+    }
+    return key;
+  }
+
+ private:
+  std::atomic<bool> _is_released;
+  std::atomic<int> _num_started;
+};
+
+// A cache whose first loads throw. Loads wait for Release() once Block() has
+// been called.
+class FailingCache : public Cache<int, int> {
+ public:
+  explicit FailingCache(int num_failures)
+      : Cache<int, int>(100, 1),
+        _num_failures(num_failures),
+        _blocked(false),
+        _num_started(0) {}
+  ~FailingCache() { Clear(); }
+
+  void Block() { _blocked = true; }
+  void Release() { _blocked = false; }
+  int GetNumStarted() const { return _num_started; }
+
+ protected:
+  int Load(const int& key) override {
+    ++_num_started;
+    while (_blocked) {
+      std::this_thread::yield();
+    }
+    if (_num_failures.fetch_sub(1) > 0) {
+      throw std::runtime_error("load failed");
+    }
+    return key;
+  }
+
+ private:
+  std::atomic<int> _num_failures;
+  std::atomic<bool> _blocked;
+  std::atomic<int> _num_started;
+};
+
+}  // namespace
+
+TEST(Cache, GetLoadsValue) {
+  SquareCache cache(4);
+  EXPECT_EQ(*cache.Get(3), 9);
+  EXPECT_EQ(*cache.Get(3), 9);
+  EXPECT_EQ(cache.GetLoadedKeys(), std::vector<int>({3}));
+}
+
+TEST(Cache, EvictsAndDiscards) {
+  SquareCache cache(3);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(*cache.Get(i), i * i);
+  }
+  EXPECT_EQ(cache.GetLoadedKeys().size(), 10);
+  EXPECT_GE(cache.GetNumDiscarded(), 7);
+}
+
+TEST(Cache, EvictsLeastRecentlyUsed) {
+  SquareCache cache(3);
+  cache.Get(1);
+  cache.Get(2);
+  cache.Get(1);
+  cache.Get(3);
+  cache.Get(1);
+  EXPECT_EQ(cache.GetLoadedKeys(), std::vector<int>({1, 2, 3}));
+  cache.Get(2);
+  EXPECT_EQ(cache.GetLoadedKeys(), std::vector<int>({1, 2, 3, 2}));
+}
+
+TEST(Cache, EvictsToStayWithinSizeBudget) {
+  SizedCache cache(100);
+  cache.SetSizeBudget(100);
+  cache.Get(40);
+  cache.Get(50);
+  EXPECT_EQ(cache.GetTotalValueSize(), 90);
+  cache.Get(30);
+  EXPECT_EQ(cache.GetTotalValueSize(), 80);
+  // An entry larger than the budget is still kept on its own.
+  cache.Get(200);
+  EXPECT_EQ(cache.GetTotalValueSize(), 200);
+  EXPECT_EQ(*cache.Get(200), 200);
+}
+
+TEST(Cache, PinnedValuesSurviveEviction) {
+  SquareCache cache(2);
+  SquareCache::Handle pinned = cache.Get(3);
+  for (int i = 10; i < 15; ++i) {
+    cache.Get(i);
+  }
+  // Wait for the entry evicted by the last load to be discarded.
+  while (!cache.IsDiscarded(13)) {
+    std::this_thread::yield();
+  }
+  EXPECT_FALSE(cache.IsDiscarded(3));
+  EXPECT_EQ(*pinned, 9);
+  pinned.reset();
+  while (!cache.IsDiscarded(3)) {
+    std::this_thread::yield();
+  }
+}
+
+TEST(Cache, SupportsMoveOnlyValues) {
+  MoveOnlyCache cache(3);
+  EXPECT_EQ(**cache.Get(2), 2);
+  cache.Get(3);
+  cache.Get(4);
+  EXPECT_EQ(**cache.Get(2), 2);
+}
+
+TEST(Cache, ClearDiscardsEverything) {
+  std::unique_ptr<SquareCache> cache(new SquareCache(100));
+  for (int i = 0; i < 10; ++i) {
+    cache->Get(i);
+  }
+  cache->Clear();
+  EXPECT_EQ(cache->GetNumDiscarded(), 10);
+}
+
+TEST(Cache, CollapsesDuplicateRequests) {
+  SquareCache cache(100);
+  cache.Block();
+  cache.Prepare(0);
+  while (cache.GetLoadedKeys().empty()) {
+    std::this_thread::yield();
+  }
+  for (int i = 0; i < 20; ++i) {
+    cache.Prepare(1);
+  }
+  cache.Unblock();
+  EXPECT_EQ(*cache.Get(1), 1);
+  EXPECT_EQ(*cache.Get(0), 0);
+  EXPECT_EQ(cache.GetLoadedKeys(), std::vector<int>({0, 1}));
+}
+
+TEST(Cache, GetDoesNotWaitForPrefetches) {
+  SquareCache cache(100);
+  cache.Block();
+  // Occupy the only loader thread, then queue up prefetches.
+  cache.Prepare(0);
+  while (cache.GetLoadedKeys().empty()) {
+    std::this_thread::yield();
+  }
+  cache.Prepare(3, 3);
+  cache.Prepare(1, 1);
+  cache.Prepare(2, 2);
+  std::thread foreground([&cache] { EXPECT_EQ(*cache.Get(10), 100); });
+  // The foreground load starts while the loader thread is still busy.
+  while (cache.GetLoadedKeys().size() < 2) {
+    std::this_thread::yield();
+  }
+  cache.Unblock();
+  foreground.join();
+  // Let the prefetches drain before asking for anything else.
+  while (cache.GetLoadedKeys().size() < 5) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(*cache.Get(3), 9);
+  EXPECT_EQ(cache.GetLoadedKeys(), std::vector<int>({0, 10, 1, 2, 3}));
+}
+
+TEST(Cache, GetAttachesToLoadInFlight) {
+  SquareCache cache(100);
+  cache.Block();
+  cache.Prepare(7);
+  while (cache.GetLoadedKeys().empty()) {
+    std::this_thread::yield();
+  }
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.push_back(
+        std::thread([&cache] { EXPECT_EQ(*cache.Get(7), 49); }));
+  }
+  std::thread foreground([&cache] { EXPECT_EQ(*cache.Get(8), 64); });
+  while (cache.GetLoadedKeys().size() < 2) {
+    std::this_thread::yield();
+  }
+  cache.Unblock();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  foreground.join();
+  EXPECT_EQ(cache.GetLoadedKeys(), std::vector<int>({7, 8}));
+}
+
+TEST(Cache, DropsLeastUrgentPrefetchesWhenFull) {
+  SquareCache cache(100);
+  cache.Block();
+  cache.Prepare(0);
+  while (cache.GetLoadedKeys().empty()) {
+    std::this_thread::yield();
+  }
+  for (int i = 1; i <= SquareCache::DEFAULT_MAX_NUM_PENDING_PREFETCHES + 5;
+       ++i) {
+    cache.Prepare(i, i);
+  }
+  cache.Unblock();
+  EXPECT_EQ(*cache.Get(1), 1);
+  cache.Clear();
+  const std::vector<int> loaded_keys = cache.GetLoadedKeys();
+  for (int key : loaded_keys) {
+    EXPECT_LE(key, SquareCache::DEFAULT_MAX_NUM_PENDING_PREFETCHES);
+  }
+}
+
+TEST(Cache, KeepsConfiguredNumberOfPendingPrefetches) {
+  const int max_num_pending_prefetches = 20;
+  SquareCache cache(100);
+  cache.SetMaxNumPendingPrefetches(max_num_pending_prefetches);
+  cache.Block();
+  cache.Prepare(0);
+  while (cache.GetLoadedKeys().empty()) {
+    std::this_thread::yield();
+  }
+  for (int i = 1; i <= max_num_pending_prefetches + 5; ++i) {
+    cache.Prepare(i, i);
+  }
+  cache.Unblock();
+  while (static_cast<int>(cache.GetLoadedKeys().size()) <
+         max_num_pending_prefetches + 1) {
+    std::this_thread::yield();
+  }
+  cache.Clear();
+  std::vector<int> loaded_keys = cache.GetLoadedKeys();
+  std::sort(loaded_keys.begin(), loaded_keys.end());
+  EXPECT_EQ(loaded_keys.size(), max_num_pending_prefetches + 1);
+  EXPECT_EQ(loaded_keys.back(), max_num_pending_prefetches);
+}
+
+TEST(Cache, TryGetDoesNotLoad) {
+  SquareCache cache(2);
+  EXPECT_EQ(cache.TryGet(3), nullptr);
+  EXPECT_TRUE(cache.GetLoadedKeys().empty());
+  cache.Get(3);
+  EXPECT_EQ(*cache.TryGet(3), 9);
+
+  // A load in flight is not waited for.
+  cache.Block();
+  cache.Prepare(4);
+  while (cache.GetLoadedKeys().size() < 2) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(cache.TryGet(4), nullptr);
+  cache.Unblock();
+  EXPECT_EQ(*cache.Get(4), 16);
+}
+
+TEST(Cache, CancelsUnwantedPrefetches) {
+  CancellableCache cache;
+  cache.Prepare(1);
+  while (cache.GetNumStarted() < 1) {
+    std::this_thread::yield();
+  }
+  cache.Prepare(2);
+  cache.Prepare(3);
+  cache.CancelPrefetches([](const int& key) { return key == 3; });
+  cache.Release();
+  EXPECT_EQ(*cache.Get(3), 3);
+  EXPECT_EQ(cache.TryGet(1), nullptr);
+  EXPECT_EQ(cache.TryGet(2), nullptr);
+  EXPECT_EQ(cache.GetNumStarted(), 2);
+}
+
+TEST(Cache, DoesNotCancelLoadsForGet) {
+  CancellableCache cache;
+  std::thread foreground([&cache] { EXPECT_EQ(*cache.Get(5), 5); });
+  while (cache.GetNumStarted() < 1) {
+    std::this_thread::yield();
+  }
+  cache.CancelPrefetches([](const int& /* key */) { return false; });
+  cache.Release();
+  foreground.join();
+  EXPECT_EQ(*cache.TryGet(5), 5);
+}
+
+TEST(Cache, GetStopsAtDeadline) {
+  CancellableCache cache;
+  bool is_complete = true;
+
+  // A load on the calling thread is cut short, and its value is not cached.
+  EXPECT_EQ(
+      *cache.Get(
+          4,
+          CancellationToken::Clock::now() + std::chrono::milliseconds(10),
+          &is_complete),
+      -1);
+  EXPECT_FALSE(is_complete);
+  EXPECT_EQ(cache.TryGet(4), nullptr);
+
+  // A load in flight is only waited for until the deadline.
+  cache.Prepare(6);
+  while (cache.GetNumStarted() < 2) {
+    std::this_thread::yield();
+  }
+  is_complete = true;
+  EXPECT_EQ(
+      cache.Get(
+          6,
+          CancellationToken::Clock::now() + std::chrono::milliseconds(10),
+          &is_complete),
+      nullptr);
+  EXPECT_FALSE(is_complete);
+
+  cache.Release();
+  EXPECT_EQ(*cache.Get(6), 6);
+  EXPECT_EQ(
+      *cache.Get(
+          4, CancellationToken::Clock::now() + std::chrono::seconds(10),
+          &is_complete),
+      4);
+  EXPECT_TRUE(is_complete);
+}
+
+TEST(Cache, RecoversFromFailedLoads) {
+  // 1. A failed Get() throws, and leaves nothing behind for Clear() to wait
+  // for.
+  {
+    FailingCache cache(1);
+    EXPECT_THROW(cache.Get(1), std::runtime_error);
+    EXPECT_EQ(cache.TryGet(1), nullptr);
+    EXPECT_EQ(*cache.Get(1), 1);
+  }
+
+  // 2. Get() waiting for a failed prefetch loads the key itself.
+  FailingCache cache(1);
+  cache.Block();
+  cache.Prepare(2);
+  while (cache.GetNumStarted() < 1) {
+    std::this_thread::yield();
+  }
+  std::thread waiter([&cache] { EXPECT_EQ(*cache.Get(2), 2); });
+  cache.Release();
+  waiter.join();
+  EXPECT_EQ(cache.GetNumStarted(), 2);
+  cache.Clear();
+}
+
+TEST(Cache, ConcurrentAccess) {
+  SquareCache cache(5, 3);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.push_back(std::thread([&cache, i] {
+      for (int j = 0; j < 200; ++j) {
+        const int key = (i * 7 + j) % 13;
+        cache.Prepare((key + 1) % 13, 1 + j % 3);
+        EXPECT_EQ(*cache.Get(key), key * key);
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+TEST(LRUCacheEvictionPolicy, EvictsLeastRecentlyUsed) {
+  LRUCacheEvictionPolicy<int> policy;
+  policy.Insert(1, 0.0, 1);
+  policy.Insert(2, 0.0, 1);
+  policy.Insert(3, 0.0, 1);
+  policy.Touch(1);
+  EXPECT_EQ(policy.Evict(), 2);
+  EXPECT_EQ(policy.Evict(), 3);
+  policy.Insert(4, 0.0, 1);
+  EXPECT_EQ(policy.Evict(), 1);
+  EXPECT_EQ(policy.Evict(), 4);
+}
+
+TEST(GDSFCacheEvictionPolicy, EvictsCheapestPerByteFirst) {
+  GDSFCacheEvictionPolicy<int> policy;
+  policy.Insert(1, 1.0, 1);
+  policy.Insert(2, 10.0, 1);
+  policy.Insert(3, 1.0, 100);
+  policy.Insert(4, 100.0, 1);
+  EXPECT_EQ(policy.Evict(), 3);
+  EXPECT_EQ(policy.Evict(), 1);
+  EXPECT_EQ(policy.Evict(), 2);
+}
+
+TEST(GDSFCacheEvictionPolicy, FavorsFrequentlyUsed) {
+  GDSFCacheEvictionPolicy<int> policy;
+  policy.Insert(1, 1.0, 1);
+  policy.Insert(2, 1.5, 1);
+  policy.Touch(1);
+  policy.Insert(3, 10.0, 1);
+  EXPECT_EQ(policy.Evict(), 2);
+  EXPECT_EQ(policy.Evict(), 1);
+}
+
+TEST(GDSFCacheEvictionPolicy, NeverEvictsMostRecentlyInserted) {
+  GDSFCacheEvictionPolicy<int> policy;
+  policy.Insert(1, 10.0, 1);
+  policy.Insert(2, 1.0, 1);
+  EXPECT_EQ(policy.Evict(), 1);
+  EXPECT_EQ(policy.Evict(), 2);
+}
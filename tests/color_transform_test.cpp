@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../src/color_transform.hpp"
+
+namespace {
+
+// A format that packs pixels into bit fields of the given offsets and
+// lengths.
+class TestFormat : public PixelBuffer::Format {
+ public:
+  TestFormat(
+      int depth, int red_offset, int green_offset, int blue_offset,
+      int red_length = 8, int green_length = 8, int blue_length = 8)
+      : _depth(depth),
+        _offsets{red_offset, green_offset, blue_offset},
+        _lengths{red_length, green_length, blue_length} {}
+  int GetDepth() const override { return _depth; }
+  uint32_t Pack(uint8_t r, uint8_t g, uint8_t b) const override {
+    return ((static_cast<uint32_t>(r) >> (8 - _lengths[0])) << _offsets[0]) |
+           ((static_cast<uint32_t>(g) >> (8 - _lengths[1])) << _offsets[1]) |
+           ((static_cast<uint32_t>(b) >> (8 - _lengths[2])) << _offsets[2]);
+  }
+  // Returns the 8-bit value of channel c in value, with the precision of the
+  // format.
+  int Unpack(uint32_t value, int c) const {
+    const uint32_t field = (value >> _offsets[c]) & ((1u << _lengths[c]) - 1);
+    return field << (8 - _lengths[c]);
+  }
+
+ private:
+  int _depth;
+  int _offsets[3];
+  int _lengths[3];
+};
+
+const TestFormat XRGB8888(4, 16, 8, 0);
+const TestFormat RGB565(2, 11, 5, 0, 5, 6, 5);
+
+// A format of 8-bit grey levels.
+class GrayFormat : public PixelBuffer::Format {
+ public:
+  int GetDepth() const override { return 1; }
+  uint32_t Pack(uint8_t r, uint8_t g, uint8_t b) const override {
+    return RGBToGray(r, g, b);
+  }
+  PixelLayout GetLayout() const override { return PixelLayout::GRAY8; }
+};
+
+const GrayFormat GRAY8;
+
+// Transforms a single pixel.
+uint32_t Apply(const ColorTransform& transform, uint32_t value) {
+  uint8_t buffer[4];
+  memcpy(buffer, &value, sizeof(value));
+  transform.Apply(buffer, 1, buffer);
+  memcpy(&value, buffer, sizeof(value));
+  // Clear bytes beyond the pixel, which are left over from the input.
+  const int depth = transform.GetFormat()->GetDepth();
+  return depth < 4 ? value & ((1u << (8 * depth)) - 1) : value;
+}
+
+}  // namespace
+
+TEST(ColorTransform, NormalModeIsIdentity) {
+  EXPECT_TRUE(ColorTransform(&XRGB8888, ColorTransform::NORMAL).IsIdentity());
+  EXPECT_FALSE(
+      ColorTransform(&XRGB8888, ColorTransform::NORMAL, 50).IsIdentity());
+  EXPECT_FALSE(
+      ColorTransform(&XRGB8888, ColorTransform::INVERTED).IsIdentity());
+}
+
+TEST(ColorTransform, InvertsChannels) {
+  for (const TestFormat* format : {&XRGB8888, &RGB565}) {
+    const ColorTransform transform(format, ColorTransform::INVERTED);
+    for (int v = 0; v <= 255; v += 15) {
+      EXPECT_EQ(
+          Apply(transform, format->Pack(v, 255 - v, v / 2)),
+          format->Pack(255 - v, v, 255 - v / 2));
+    }
+  }
+}
+
+TEST(ColorTransform, AppliesSepiaToOriginalChannels) {
+  const ColorTransform transform(&XRGB8888, ColorTransform::SEPIA);
+  const uint32_t result = Apply(transform, XRGB8888.Pack(100, 150, 200));
+  // Each output channel must be computed from the input channels, and not
+  // from output channels computed before it.
+  EXPECT_NEAR(XRGB8888.Unpack(result, 0), 192, 1);
+  EXPECT_NEAR(XRGB8888.Unpack(result, 1), 171, 1);
+  EXPECT_NEAR(XRGB8888.Unpack(result, 2), 134, 1);
+  // Bright colors saturate.
+  EXPECT_EQ(
+      Apply(transform, XRGB8888.Pack(255, 255, 255)),
+      XRGB8888.Pack(255, 255, 239));
+}
+
+TEST(ColorTransform, ScalesBrightness) {
+  for (const TestFormat* format : {&XRGB8888, &RGB565}) {
+    for (ColorTransform::Mode mode :
+         {ColorTransform::NORMAL, ColorTransform::INVERTED}) {
+      const ColorTransform transform(format, mode, 50);
+      const uint32_t value = format->Pack(200, 100, 40);
+      const uint32_t result = Apply(transform, value);
+      for (int c = 0; c < 3; ++c) {
+        int expected = format->Unpack(value, c);
+        if (mode == ColorTransform::INVERTED) {
+          // Invert with the precision of the format.
+          expected = format->Unpack(~value, c);
+        }
+        EXPECT_NEAR(format->Unpack(result, c), expected / 2, 8)
+            << "channel " << c << " mode " << mode;
+      }
+    }
+  }
+}
+
+TEST(ColorTransform, TransformsRowsInPlace) {
+  const ColorTransform transform(&RGB565, ColorTransform::INVERTED, 80);
+  std::vector<uint16_t> row(37), expected(37);
+  for (size_t i = 0; i < row.size(); ++i) {
+    row[i] = static_cast<uint16_t>(RGB565.Pack(i * 7, i * 5, i * 3));
+    expected[i] = static_cast<uint16_t>(Apply(transform, row[i]));
+  }
+  uint8_t* bytes = reinterpret_cast<uint8_t*>(row.data());
+  transform.Apply(bytes, row.size(), bytes);
+  EXPECT_EQ(row, expected);
+}
+
+TEST(ColorTransform, TransformsGrayLevels) {
+  EXPECT_TRUE(ColorTransform(&GRAY8, ColorTransform::SEPIA).IsIdentity());
+  const ColorTransform inverted(&GRAY8, ColorTransform::INVERTED);
+  const ColorTransform darker(&GRAY8, ColorTransform::SEPIA, 50);
+  for (uint32_t value = 0; value <= UINT8_MAX; ++value) {
+    EXPECT_EQ(Apply(inverted, value), UINT8_MAX - value);
+    EXPECT_EQ(Apply(darker, value), (value + 1) / 2);
+  }
+}
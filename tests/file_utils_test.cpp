@@ -0,0 +1,34 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <string>
+
+#include "../src/file_utils.hpp"
+#include "test_utils.hpp"
+
+TEST(FileUtils, WritesAndReadsFile) {
+  const std::string path = MakeTempDir() + "/file";
+  std::string contents;
+  EXPECT_FALSE(ReadFile(path, &contents));
+
+  const std::string data("line 1\nline 2\0binary", 20);
+  EXPECT_TRUE(WriteFileAtomically(path, data));
+  EXPECT_TRUE(ReadFile(path, &contents));
+  EXPECT_EQ(contents, data);
+
+  EXPECT_TRUE(WriteFileAtomically(path, "replaced"));
+  EXPECT_TRUE(ReadFile(path, &contents));
+  EXPECT_EQ(contents, "replaced");
+}
+
+TEST(FileUtils, WriteFailsInMissingDirectory) {
+  EXPECT_FALSE(
+      WriteFileAtomically(MakeTempDir() + "/missing/file", "contents"));
+}
+
+TEST(FileUtils, CacheDirHonorsXdgCacheHome) {
+  const std::string base_dir = MakeTempDir() + "/cache";
+  setenv("XDG_CACHE_HOME", base_dir.c_str(), 1);
+  EXPECT_EQ(GetCacheDir(), base_dir + "/jfbview");
+  EXPECT_TRUE(WriteFileAtomically(GetCacheDir() + "/file", "contents"));
+}
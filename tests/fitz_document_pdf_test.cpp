@@ -1,16 +1,54 @@
 #include <gtest/gtest.h>
 
+#include <dirent.h>
+
 #include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <memory>
+#include <set>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "../src/cancellation_token.hpp"
+#include "../src/file_utils.hpp"
 #include "../src/fitz_document.hpp"
+#include "test_utils.hpp"
 
 namespace {
 
+// Points the cache directory at a temporary directory for all tests, so that
+// page bounds saved by FitzDocument do not end up in the user's cache.
+class TempCacheDirEnvironment : public ::testing::Environment {
+ public:
+  void SetUp() override {
+    setenv("XDG_CACHE_HOME", MakeTempDir().c_str(), 1);
+  }
+};
+::testing::Environment* const temp_cache_dir_environment =
+    ::testing::AddGlobalTestEnvironment(new TempCacheDirEnvironment());
+
+// Returns the paths of the page bounds files in the cache directory.
+std::vector<std::string> GetPageBoundsFiles() {
+  std::vector<std::string> paths;
+  const std::string cache_dir = GetCacheDir();
+  DIR* dir = opendir(cache_dir.c_str());
+  if (dir == nullptr) {
+    return paths;
+  }
+  while (const dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name.compare(0, 12, "page_bounds_") == 0) {
+      paths.push_back(cache_dir + "/" + name);
+    }
+  }
+  closedir(dir);
+  return paths;
+}
+
 class DummyPixelWriter : public Document::PixelWriter {
  public:
   DummyPixelWriter() : call_count(0) {}
@@ -23,6 +61,28 @@ class DummyPixelWriter : public Document::PixelWriter {
   std::atomic<int> call_count;
 };
 
+// A PixelWriter that stores pixels in memory, as r, g, b bytes.
+class MemoryPixelWriter : public Document::PixelWriter {
+ public:
+  MemoryPixelWriter(int width, int height)
+      : _width(width), _pixels(width * height * 3) {}
+  void Write(int x, int y, uint8_t r, uint8_t g, uint8_t b) override {
+    uint8_t* p = &_pixels[(y * _width + x) * 3];
+    p[0] = r;
+    p[1] = g;
+    p[2] = b;
+  }
+  // Returns the pixels of a row, starting from column x.
+  std::vector<uint8_t> GetRow(int x, int y, int width) const {
+    const auto begin = _pixels.begin() + (y * _width + x) * 3;
+    return std::vector<uint8_t>(begin, begin + width * 3);
+  }
+
+ private:
+  int _width;
+  std::vector<uint8_t> _pixels;
+};
+
 }  // namespace
 
 TEST(FitzDocumentPDF, ReturnsNullptrIfLoadingEmptyDocument) {
@@ -101,6 +161,84 @@ TEST(FitzDocumentPDF, CanLoadPasswordProtectedDocument) {
   EXPECT_EQ(result.SearchHits.size(), 1);
 }
 
+TEST(FitzDocumentPDF, RendersWithAndWithoutDisplayListCache) {
+  for (size_t display_list_cache_memory : {0, 1 << 20}) {
+    std::unique_ptr<Document> doc(FitzDocument::Open(
+        "testdata/bash.pdf", nullptr, display_list_cache_memory));
+    EXPECT_NE(doc.get(), nullptr);
+    for (float zoom : {1.0f, 0.5f, 1.0f}) {
+      const Document::PageSize page_size = doc->GetPageSize(3, zoom, 90);
+      DummyPixelWriter dummy_pixel_writer;
+      doc->Render(&dummy_pixel_writer, 3, zoom, 90);
+      EXPECT_EQ(
+          dummy_pixel_writer.GetCallCount(),
+          page_size.Width * page_size.Height)
+          << " at zoom " << zoom << " with display list cache memory "
+          << display_list_cache_memory;
+    }
+  }
+}
+
+TEST(FitzDocumentPDF, RendersRegions) {
+  std::unique_ptr<Document> doc(
+      FitzDocument::Open("testdata/bash.pdf", nullptr));
+  EXPECT_NE(doc.get(), nullptr);
+  const Document::PageSize page_size = doc->GetPageSize(3, 0.5f, 90);
+  MemoryPixelWriter page_writer(page_size.Width, page_size.Height);
+  doc->Render(&page_writer, 3, 0.5f, 90);
+
+  const Document::PageRect region(
+      page_size.Width / 3, page_size.Height / 4, page_size.Width / 2,
+      page_size.Height / 3);
+  MemoryPixelWriter region_writer(region.Width, region.Height);
+  doc->Render(&region_writer, 3, 0.5f, 90, region, Document::BEST, nullptr);
+  for (int y = 0; y < region.Height; ++y) {
+    EXPECT_EQ(
+        region_writer.GetRow(0, y, region.Width),
+        page_writer.GetRow(region.X, region.Y + y, region.Width))
+        << "row " << y;
+  }
+}
+
+TEST(FitzDocumentPDF, FastQualityDoesNotAntiAlias) {
+  std::unique_ptr<Document> doc(
+      FitzDocument::Open("testdata/bash.pdf", nullptr));
+  EXPECT_NE(doc.get(), nullptr);
+  const Document::PageSize page_size = doc->GetPageSize(3);
+  const Document::PageRect region(0, 0, page_size.Width, page_size.Height);
+  std::set<std::vector<uint8_t>> colors[2];
+  const Document::Quality qualities[2] = {Document::FAST, Document::BEST};
+  for (int i = 0; i < 2; ++i) {
+    MemoryPixelWriter writer(page_size.Width, page_size.Height);
+    doc->Render(&writer, 3, 1.0f, 0, region, qualities[i], nullptr);
+    for (int y = 0; y < page_size.Height; ++y) {
+      const std::vector<uint8_t> row = writer.GetRow(0, y, page_size.Width);
+      for (int x = 0; x < page_size.Width; ++x) {
+        colors[i].insert(
+            std::vector<uint8_t>(row.begin() + x * 3, row.begin() + x * 3 + 3));
+      }
+    }
+  }
+  // Anti-aliasing blends the edges of text into the background.
+  EXPECT_LT(colors[0].size(), colors[1].size());
+}
+
+TEST(FitzDocumentPDF, StopsRenderingWhenCancelled) {
+  std::unique_ptr<Document> doc(
+      FitzDocument::Open("testdata/bash.pdf", nullptr));
+  EXPECT_NE(doc.get(), nullptr);
+  const Document::PageSize page_size = doc->GetPageSize(3);
+  const Document::PageRect region(0, 0, page_size.Width, page_size.Height);
+  CancellationToken token;
+  token.Cancel();
+  MemoryPixelWriter writer(page_size.Width, page_size.Height);
+  doc->Render(&writer, 3, 1.0f, 0, region, Document::BEST, &token);
+  const std::vector<uint8_t> white_row(page_size.Width * 3, 0xff);
+  for (int y = 0; y < page_size.Height; ++y) {
+    EXPECT_EQ(writer.GetRow(0, y, page_size.Width), white_row) << "row " << y;
+  }
+}
+
 TEST(FitzDocumentPDF, MultithreadedAccess) {
   std::unique_ptr<Document> doc(
       FitzDocument::Open("testdata/bash.pdf", nullptr));
@@ -133,3 +271,89 @@ TEST(FitzDocumentPDF, MultithreadedAccess) {
   }
 }
 
+TEST(FitzDocumentPDF, SavesAndReloadsPageBounds) {
+  // 1. Work on a copy of the document, in a cache directory of its own.
+  const std::string dir = MakeTempDir();
+  setenv("XDG_CACHE_HOME", (dir + "/cache").c_str(), 1);
+  const std::string path = dir + "/bash.pdf";
+  std::string pdf;
+  ASSERT_TRUE(ReadFile("testdata/bash.pdf", &pdf));
+  ASSERT_TRUE(WriteFileAtomically(path, pdf));
+
+  // 2. Measuring a page starts measuring all of them, and the table is saved
+  // once done.
+  std::unique_ptr<Document> doc(FitzDocument::Open(path, nullptr));
+  ASSERT_NE(doc.get(), nullptr);
+  const int num_pages = doc->GetNumPages();
+  const Document::PageSize page_size = doc->GetPageSize(0);
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (GetPageBoundsFiles().empty() &&
+         (std::chrono::steady_clock::now() < deadline)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  doc.reset();
+  const std::vector<std::string> files = GetPageBoundsFiles();
+  ASSERT_EQ(files.size(), 1);
+
+  // 3. Replace the saved bounds with made-up ones, keeping the header and key
+  // lines, and check that a new instance uses them instead of measuring.
+  std::string contents;
+  ASSERT_TRUE(ReadFile(files[0], &contents));
+  size_t end_of_key = 0;
+  for (int i = 0; i < 3; ++i) {
+    end_of_key = contents.find('\n', end_of_key) + 1;
+    ASSERT_NE(end_of_key, 0u);
+  }
+  contents.resize(end_of_key);
+  for (int page = 0; page < num_pages; ++page) {
+    contents += "0 0 100 200\n";
+  }
+  ASSERT_TRUE(WriteFileAtomically(files[0], contents));
+  doc.reset(FitzDocument::Open(path, nullptr));
+  ASSERT_NE(doc.get(), nullptr);
+  const Document::PageSize saved_page_size = doc->GetPageSize(0);
+  EXPECT_NEAR(saved_page_size.Height, saved_page_size.Width * 2, 1);
+  EXPECT_NE(saved_page_size.Width, page_size.Width);
+  doc.reset();
+
+  // 4. Once the document changes, the saved bounds are ignored.
+  ASSERT_TRUE(WriteFileAtomically(path, pdf + "\n"));
+  doc.reset(FitzDocument::Open(path, nullptr));
+  ASSERT_NE(doc.get(), nullptr);
+  EXPECT_EQ(doc->GetPageSize(0).Width, page_size.Width);
+  EXPECT_EQ(doc->GetPageSize(0).Height, page_size.Height);
+}
+
+TEST(FitzDocumentPDF, SharesAndPrefetchesLoadedPages) {
+  // Without display list caching, every render records the page again.
+  std::unique_ptr<FitzDocument> doc(
+      FitzDocument::Open("testdata/bash.pdf", nullptr, 0));
+  ASSERT_NE(doc.get(), nullptr);
+  // Waits for background loads to bring the number of page loads to n.
+  const auto wait_for_num_page_loads = [&doc](int n) {
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while ((doc->GetNumPageLoads() < n) &&
+           (std::chrono::steady_clock::now() < deadline)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  };
+
+  // 1. Rendering, search and geometry queries on a page load it once, and
+  // its neighbours are loaded in the background.
+  DummyPixelWriter dummy_pixel_writer;
+  doc->Render(&dummy_pixel_writer, 5, 0.25f, 0);
+  doc->Render(&dummy_pixel_writer, 5, 0.5f, 0);
+  EXPECT_FALSE(doc->GetPageText(5).empty());
+  EXPECT_GT(doc->GetPageSize(5, 1.0f, 0).Width, 0);
+  wait_for_num_page_loads(3);
+  EXPECT_EQ(doc->GetNumPageLoads(), 3);
+
+  // 2. Moving on to a neighbour uses the prefetched page, and prefetches the
+  // next one along.
+  EXPECT_FALSE(doc->GetPageText(4).empty());
+  doc->Render(&dummy_pixel_writer, 6, 0.25f, 0);
+  wait_for_num_page_loads(5);
+  EXPECT_EQ(doc->GetNumPageLoads(), 5);
+}
@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../src/multithreading.hpp"
+
+TEST(Multithreading, DefaultNumThreadsIsPositive) {
+  EXPECT_GE(GetDefaultNumThreads(), 1);
+  EXPECT_GE(GetNumThreads(), 1);
+}
+
+TEST(Multithreading, ParallelForVisitsEachIndexOnce) {
+  for (int grain : {0, 1, 7, 64, 10000}) {
+    std::vector<std::atomic<int>> visits(1000);
+    ParallelFor(0, visits.size(), grain, [&](int begin, int end) {
+      EXPECT_LT(begin, end);
+      if (grain > 0) {
+        EXPECT_LE(end - begin, grain);
+      }
+      for (int i = begin; i < end; ++i) {
+        ++visits[i];
+      }
+    });
+    for (size_t i = 0; i < visits.size(); ++i) {
+      EXPECT_EQ(visits[i], 1) << " at index " << i << " with grain " << grain;
+    }
+  }
+}
+
+TEST(Multithreading, ParallelForHandlesEmptyRange) {
+  int call_count = 0;
+  ParallelFor(5, 5, 1, [&](int /* begin */, int /* end */) { ++call_count; });
+  ParallelFor(5, 0, 1, [&](int /* begin */, int /* end */) { ++call_count; });
+  EXPECT_EQ(call_count, 0);
+}
+
+TEST(Multithreading, NestedParallelFor) {
+  std::atomic<int> sum(0);
+  ParallelFor(0, 16, 1, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      ParallelFor(0, 100, 3, [&](int inner_begin, int inner_end) {
+        sum += inner_end - inner_begin;
+      });
+    }
+  });
+  EXPECT_EQ(sum, 1600);
+}
+
+TEST(Multithreading, ConcurrentCallers) {
+  std::atomic<int> sum(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.push_back(std::thread([&sum]() {
+      for (int j = 0; j < 50; ++j) {
+        ParallelFor(0, 200, 8, [&sum](int begin, int end) {
+          sum += end - begin;
+        });
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(sum, 8 * 50 * 200);
+}
@@ -0,0 +1,451 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../src/pixel_buffer.hpp"
+#include "../src/pixel_converter.hpp"
+
+namespace {
+
+// Bit fields of a pixel layout, as found in fb_var_screeninfo.
+struct LayoutSpec {
+  PixelLayout Layout;
+  int BitsPerPixel;
+  int RedOffset, RedLength;
+  int GreenOffset, GreenLength;
+  int BlueOffset, BlueLength;
+};
+
+const LayoutSpec LAYOUT_SPECS[] = {
+    {PixelLayout::XRGB8888, 32, 16, 8, 8, 8, 0, 8},
+    {PixelLayout::XBGR8888, 32, 0, 8, 8, 8, 16, 8},
+    {PixelLayout::BGRX8888, 32, 8, 8, 16, 8, 24, 8},
+    {PixelLayout::RGB565, 16, 11, 5, 5, 6, 0, 5},
+    {PixelLayout::BGR565, 16, 0, 5, 5, 6, 11, 5},
+    {PixelLayout::RGB888, 24, 16, 8, 8, 8, 0, 8},
+    {PixelLayout::BGR888, 24, 0, 8, 8, 8, 16, 8},
+};
+
+// A format that packs pixels with shifts, like Framebuffer's, and reports a
+// given layout.
+class TestFormat : public PixelBuffer::Format {
+ public:
+  TestFormat(const LayoutSpec& spec, PixelLayout layout)
+      : _spec(spec), _layout(layout) {}
+  int GetDepth() const override { return _spec.BitsPerPixel / 8; }
+  uint32_t Pack(uint8_t r, uint8_t g, uint8_t b) const override {
+    return ((static_cast<uint32_t>(r) >> (8 - _spec.RedLength))
+            << _spec.RedOffset) |
+           ((static_cast<uint32_t>(g) >> (8 - _spec.GreenLength))
+            << _spec.GreenOffset) |
+           ((static_cast<uint32_t>(b) >> (8 - _spec.BlueLength))
+            << _spec.BlueOffset);
+  }
+  PixelLayout GetLayout() const override { return _layout; }
+
+ private:
+  LayoutSpec _spec;
+  PixelLayout _layout;
+};
+
+// Returns width random RGBA pixels.
+std::vector<uint8_t> MakeRandomRow(int width, std::mt19937* random) {
+  std::uniform_int_distribution<int> distribution(0, UINT8_MAX);
+  std::vector<uint8_t> rgba(width * 4);
+  for (uint8_t& value : rgba) {
+    value = static_cast<uint8_t>(distribution(*random));
+  }
+  return rgba;
+}
+
+}  // namespace
+
+TEST(PixelConverter, DetectsLayouts) {
+  for (const LayoutSpec& spec : LAYOUT_SPECS) {
+    EXPECT_EQ(
+        DetectPixelLayout(
+            spec.BitsPerPixel, spec.RedOffset, spec.RedLength,
+            spec.GreenOffset, spec.GreenLength, spec.BlueOffset,
+            spec.BlueLength),
+        spec.Layout);
+  }
+  // RGB555.
+  EXPECT_EQ(DetectPixelLayout(16, 10, 5, 5, 5, 0, 5), PixelLayout::GENERIC);
+  // XRGB8888 with the wrong depth.
+  EXPECT_EQ(DetectPixelLayout(24, 16, 8, 8, 8, 0, 8), PixelLayout::RGB888);
+  EXPECT_EQ(DetectPixelLayout(16, 16, 8, 8, 8, 0, 8), PixelLayout::GENERIC);
+  EXPECT_EQ(GetPixelRowConverter(PixelLayout::GENERIC), nullptr);
+}
+
+TEST(PixelConverter, MatchesPackForAllLayoutsAndWidths) {
+  std::mt19937 random(0);
+  for (const LayoutSpec& spec : LAYOUT_SPECS) {
+    const TestFormat format(spec, PixelLayout::GENERIC);
+    const int depth = format.GetDepth();
+    PixelRowConverter converters[] = {GetPixelRowConverter(spec.Layout),
+                                      GetScalarPixelRowConverter(spec.Layout)};
+    for (int width = 1; width <= 70; ++width) {
+      const std::vector<uint8_t> rgba = MakeRandomRow(width, &random);
+      std::vector<uint8_t> expected(width * depth);
+      PixelBuffer expected_buffer(
+          PixelBuffer::Size(width, 1), &format, expected.data(),
+          PixelBuffer::Size(width, 1), PixelBuffer::Size(0, 0));
+      for (int x = 0; x < width; ++x) {
+        expected_buffer.WritePixel(
+            x, 0, rgba[x * 4], rgba[x * 4 + 1], rgba[x * 4 + 2]);
+      }
+      for (PixelRowConverter converter : converters) {
+        ASSERT_NE(converter, nullptr);
+        std::vector<uint8_t> actual(width * depth);
+        converter(rgba.data(), width, actual.data());
+        EXPECT_EQ(actual, expected)
+            << "layout " << static_cast<int>(spec.Layout) << " width "
+            << width;
+      }
+    }
+  }
+}
+
+TEST(PixelBuffer, WriteRowMatchesWritePixel) {
+  const int width = 37, height = 3;
+  std::mt19937 random(1);
+  for (const LayoutSpec& spec : LAYOUT_SPECS) {
+    for (PixelLayout layout : {PixelLayout::GENERIC, spec.Layout}) {
+      const TestFormat format(spec, layout);
+      const size_t num_bytes = width * height * format.GetDepth();
+      std::vector<uint8_t> expected(num_bytes), actual(num_bytes);
+      PixelBuffer expected_buffer(
+          PixelBuffer::Size(width, height), &format, expected.data(),
+          PixelBuffer::Size(width, height), PixelBuffer::Size(0, 0));
+      PixelBuffer actual_buffer(
+          PixelBuffer::Size(width, height), &format, actual.data(),
+          PixelBuffer::Size(width, height), PixelBuffer::Size(0, 0));
+      for (int y = 0; y < height; ++y) {
+        const std::vector<uint8_t> rgba = MakeRandomRow(width, &random);
+        for (int x = 0; x < width; ++x) {
+          expected_buffer.WritePixel(
+              x, y, rgba[x * 4], rgba[x * 4 + 1], rgba[x * 4 + 2]);
+        }
+        // Write the row in two spans to exercise x offsets.
+        actual_buffer.WriteRow(0, y, rgba.data(), 10);
+        actual_buffer.WriteRow(10, y, rgba.data() + 40, width - 10);
+      }
+      EXPECT_EQ(actual, expected)
+          << "layout " << static_cast<int>(layout) << " depth "
+          << format.GetDepth();
+    }
+  }
+}
+
+TEST(PixelConverter, ConvertsToGray) {
+  EXPECT_EQ(RGBToGray(0, 0, 0), 0);
+  EXPECT_EQ(RGBToGray(UINT8_MAX, UINT8_MAX, UINT8_MAX), UINT8_MAX);
+  EXPECT_LT(RGBToGray(0, 0, UINT8_MAX), RGBToGray(UINT8_MAX, 0, 0));
+  EXPECT_LT(RGBToGray(UINT8_MAX, 0, 0), RGBToGray(0, UINT8_MAX, 0));
+
+  std::mt19937 random(2);
+  const int width = 45;
+  const std::vector<uint8_t> rgba = MakeRandomRow(width, &random);
+  for (PixelRowConverter converter :
+       {GetPixelRowConverter(PixelLayout::GRAY8),
+        GetScalarPixelRowConverter(PixelLayout::GRAY8)}) {
+    ASSERT_NE(converter, nullptr);
+    std::vector<uint8_t> gray(width);
+    converter(rgba.data(), width, gray.data());
+    for (int x = 0; x < width; ++x) {
+      EXPECT_EQ(
+          gray[x], RGBToGray(rgba[x * 4], rgba[x * 4 + 1], rgba[x * 4 + 2]));
+    }
+  }
+}
+
+TEST(PixelBuffer, ExposesContiguousData) {
+  const TestFormat format(LAYOUT_SPECS[0], PixelLayout::XRGB8888);
+  PixelBuffer owned(PixelBuffer::Size(5, 4), &format);
+  EXPECT_NE(owned.GetContiguousData(), nullptr);
+
+  std::vector<uint8_t> memory(8 * 6 * 4);
+  PixelBuffer full_rows(
+      PixelBuffer::Size(8, 3), &format, memory.data(), PixelBuffer::Size(8, 6),
+      PixelBuffer::Size(0, 2));
+  EXPECT_EQ(full_rows.GetContiguousData(), memory.data() + 2 * 8 * 4);
+  PixelBuffer partial_rows(
+      PixelBuffer::Size(6, 3), &format, memory.data(), PixelBuffer::Size(8, 6),
+      PixelBuffer::Size(1, 2));
+  EXPECT_EQ(partial_rows.GetContiguousData(), nullptr);
+}
+
+TEST(PixelBuffer, ScalesWithNearestNeighbor) {
+  const TestFormat format(LAYOUT_SPECS[0], PixelLayout::XRGB8888);
+  // A 3x2 source, where each pixel value is its index.
+  std::vector<uint32_t> src_pixels = {0, 1, 2, 3, 4, 5};
+  PixelBuffer src(
+      PixelBuffer::Size(3, 2), &format,
+      reinterpret_cast<uint8_t*>(src_pixels.data()), PixelBuffer::Size(3, 2),
+      PixelBuffer::Size(0, 0));
+
+  std::vector<uint32_t> up_pixels(8 * 6, UINT32_MAX);
+  PixelBuffer up(
+      PixelBuffer::Size(8, 6), &format,
+      reinterpret_cast<uint8_t*>(up_pixels.data()), PixelBuffer::Size(8, 6),
+      PixelBuffer::Size(0, 0));
+  src.Scale(src.GetRect(), PixelBuffer::Rect(1, 1, 6, 4), &up);
+  for (int y = 0; y < 6; ++y) {
+    for (int x = 0; x < 8; ++x) {
+      const bool is_inside = (x >= 1) && (x < 7) && (y >= 1) && (y < 5);
+      EXPECT_EQ(
+          up_pixels[y * 8 + x],
+          is_inside ? ((y - 1) / 2) * 3 + (x - 1) / 2 : UINT32_MAX)
+          << x << ", " << y;
+    }
+  }
+
+  std::vector<uint32_t> down_pixels(1);
+  PixelBuffer down(
+      PixelBuffer::Size(1, 1), &format,
+      reinterpret_cast<uint8_t*>(down_pixels.data()), PixelBuffer::Size(1, 1),
+      PixelBuffer::Size(0, 0));
+  src.Scale(src.GetRect(), down.GetRect(), &down);
+  EXPECT_EQ(down_pixels[0], 4);
+}
+
+TEST(PixelBuffer, SmoothScalesUpWithBilinearInterpolation) {
+  const TestFormat format(LAYOUT_SPECS[0], PixelLayout::XRGB8888);
+  std::vector<uint32_t> src_pixels = {0x000000, 0xffffff};
+  PixelBuffer src(
+      PixelBuffer::Size(2, 1), &format,
+      reinterpret_cast<uint8_t*>(src_pixels.data()), PixelBuffer::Size(2, 1),
+      PixelBuffer::Size(0, 0));
+
+  std::vector<uint32_t> up_pixels(4 * 2);
+  PixelBuffer up(
+      PixelBuffer::Size(4, 2), &format,
+      reinterpret_cast<uint8_t*>(up_pixels.data()), PixelBuffer::Size(4, 2),
+      PixelBuffer::Size(0, 0));
+  src.Scale(src.GetRect(), up.GetRect(), &up, PixelBuffer::SMOOTH);
+  const std::vector<uint32_t> expected_row = {
+      0x000000, 0x404040, 0xbfbfbf, 0xffffff};
+  for (int y = 0; y < 2; ++y) {
+    for (int x = 0; x < 4; ++x) {
+      EXPECT_EQ(up_pixels[y * 4 + x], expected_row[x]) << x << ", " << y;
+    }
+  }
+}
+
+TEST(PixelBuffer, SmoothScalesDownByAveraging) {
+  const TestFormat format(LAYOUT_SPECS[0], PixelLayout::XRGB8888);
+  // Two 2x2 blocks, averaging to 100 and 25 in each channel.
+  std::vector<uint32_t> src_pixels = {
+      0x000000, 0x646464, 0x0a0a0a, 0x141414,
+      0xc8c8c8, 0x646464, 0x1e1e1e, 0x282828,
+  };
+  PixelBuffer src(
+      PixelBuffer::Size(4, 2), &format,
+      reinterpret_cast<uint8_t*>(src_pixels.data()), PixelBuffer::Size(4, 2),
+      PixelBuffer::Size(0, 0));
+
+  std::vector<uint32_t> down_pixels(2);
+  PixelBuffer down(
+      PixelBuffer::Size(2, 1), &format,
+      reinterpret_cast<uint8_t*>(down_pixels.data()), PixelBuffer::Size(2, 1),
+      PixelBuffer::Size(0, 0));
+  src.Scale(src.GetRect(), down.GetRect(), &down, PixelBuffer::SMOOTH);
+  EXPECT_EQ(down_pixels[0], 0x646464);
+  EXPECT_EQ(down_pixels[1], 0x191919);
+}
+
+TEST(PixelBuffer, SmoothScalingPreservesSolidColors) {
+  const PixelBuffer::Size sizes[] = {
+      PixelBuffer::Size(37, 23), PixelBuffer::Size(100, 9),
+      PixelBuffer::Size(5, 50), PixelBuffer::Size(1, 1)};
+  for (int layout : {0, 2, 5, 6}) {
+    const TestFormat format(
+        LAYOUT_SPECS[layout], LAYOUT_SPECS[layout].Layout);
+    PixelBuffer src(PixelBuffer::Size(37, 23), &format);
+    for (int y = 0; y < 23; ++y) {
+      for (int x = 0; x < 37; ++x) {
+        src.WritePixel(x, y, 0x12, 0x9a, 0xfe);
+      }
+    }
+    for (const PixelBuffer::Size& size : sizes) {
+      PixelBuffer dest(size, &format);
+      src.Scale(src.GetRect(), dest.GetRect(), &dest, PixelBuffer::SMOOTH);
+      const uint8_t* data = dest.GetContiguousData();
+      const int depth = format.GetDepth();
+      const uint32_t expected = format.Pack(0x12, 0x9a, 0xfe);
+      for (int i = 0; i < size.Width * size.Height; ++i) {
+        uint32_t value = 0;
+        memcpy(&value, data + i * depth, depth);
+        EXPECT_EQ(value, expected) << layout << ": " << i;
+      }
+    }
+  }
+}
+
+TEST(PixelBuffer, SmoothScalingFallsBackToNearestNeighbor) {
+  const TestFormat format(LAYOUT_SPECS[3], PixelLayout::RGB565);
+  std::vector<uint16_t> src_pixels = {0x0000, 0xffff};
+  PixelBuffer src(
+      PixelBuffer::Size(2, 1), &format,
+      reinterpret_cast<uint8_t*>(src_pixels.data()), PixelBuffer::Size(2, 1),
+      PixelBuffer::Size(0, 0));
+
+  std::vector<uint16_t> up_pixels(4);
+  PixelBuffer up(
+      PixelBuffer::Size(4, 1), &format,
+      reinterpret_cast<uint8_t*>(up_pixels.data()), PixelBuffer::Size(4, 1),
+      PixelBuffer::Size(0, 0));
+  src.Scale(src.GetRect(), up.GetRect(), &up, PixelBuffer::SMOOTH);
+  EXPECT_EQ(up_pixels, std::vector<uint16_t>({0x0000, 0x0000, 0xffff, 0xffff}));
+}
+
+TEST(PixelBuffer, RotatesByQuarterTurns) {
+  // One layout of each depth, with sizes that leave partial blocks.
+  const LayoutSpec gray8_spec = {PixelLayout::GRAY8, 8, 0, 8, 0, 8, 0, 8};
+  const LayoutSpec specs[] = {
+      gray8_spec, LAYOUT_SPECS[3], LAYOUT_SPECS[5], LAYOUT_SPECS[0]};
+  const int src_width = 141, src_height = 75;
+  const PixelBuffer::Rect src_rect(3, 2, 131, 70);
+  std::mt19937 random(42);
+  for (const LayoutSpec& spec : specs) {
+    const TestFormat format(spec, spec.Layout);
+    const int depth = format.GetDepth();
+    PixelBuffer src(PixelBuffer::Size(src_width, src_height), &format);
+    uint8_t* src_data = src.GetContiguousData();
+    for (int i = 0; i < src_width * src_height * depth; ++i) {
+      src_data[i] = static_cast<uint8_t>(random());
+    }
+    for (int rotation = 0; rotation < 360; rotation += 90) {
+      const bool is_quarter_turn = rotation % 180 != 0;
+      const int dest_width =
+          (is_quarter_turn ? src_rect.Height : src_rect.Width) + 5;
+      const int dest_height =
+          (is_quarter_turn ? src_rect.Width : src_rect.Height) + 5;
+      PixelBuffer dest(PixelBuffer::Size(dest_width, dest_height), &format);
+      src.Rotate(src_rect, rotation, &dest, 4, 1);
+      const uint8_t* dest_data = dest.GetContiguousData();
+      for (int y = 0; y < src_rect.Height; ++y) {
+        for (int x = 0; x < src_rect.Width; ++x) {
+          int dest_x = x, dest_y = y;
+          switch (rotation) {
+            case 90:
+              dest_x = src_rect.Height - 1 - y;
+              dest_y = x;
+              break;
+            case 180:
+              dest_x = src_rect.Width - 1 - x;
+              dest_y = src_rect.Height - 1 - y;
+              break;
+            case 270:
+              dest_x = y;
+              dest_y = src_rect.Width - 1 - x;
+              break;
+          }
+          const uint8_t* src_pixel =
+              src_data +
+              ((src_rect.Y + y) * src_width + src_rect.X + x) * depth;
+          const uint8_t* dest_pixel =
+              dest_data + ((1 + dest_y) * dest_width + 4 + dest_x) * depth;
+          ASSERT_EQ(memcmp(src_pixel, dest_pixel, depth), 0)
+              << depth << ", " << rotation << ": " << x << ", " << y;
+        }
+      }
+    }
+  }
+}
+
+TEST(PixelBuffer, RotatesRects) {
+  const PixelBuffer::Size size(10, 6);
+  const PixelBuffer::Rect rect(1, 2, 3, 1);
+  const PixelBuffer::Rect expected[] = {
+      PixelBuffer::Rect(1, 2, 3, 1), PixelBuffer::Rect(3, 1, 1, 3),
+      PixelBuffer::Rect(6, 3, 3, 1), PixelBuffer::Rect(2, 6, 1, 3)};
+  for (int i = 0; i < 4; ++i) {
+    const PixelBuffer::Rect rotated =
+        PixelBuffer::RotateRect(rect, size, i * 90);
+    EXPECT_EQ(rotated.X, expected[i].X) << i;
+    EXPECT_EQ(rotated.Y, expected[i].Y) << i;
+    EXPECT_EQ(rotated.Width, expected[i].Width) << i;
+    EXPECT_EQ(rotated.Height, expected[i].Height) << i;
+  }
+  EXPECT_EQ(PixelBuffer::RotateRect(rect, size, -90).X, 2);
+}
+
+TEST(PixelBuffer, MovesOverlappingRegions) {
+  const TestFormat format(LAYOUT_SPECS[0], PixelLayout::XRGB8888);
+  const PixelBuffer::Rect src_rect(1, 1, 4, 3);
+  const int moves[][2] = {{2, 0}, {0, 2}, {0, 0}, {2, 2}, {2, 1}};
+  for (const auto& move : moves) {
+    // A 6x5 buffer, where each pixel value is its index.
+    std::vector<uint32_t> pixels(6 * 5);
+    for (size_t i = 0; i < pixels.size(); ++i) {
+      pixels[i] = static_cast<uint32_t>(i);
+    }
+    const std::vector<uint32_t> original = pixels;
+    PixelBuffer buffer(
+        PixelBuffer::Size(6, 5), &format,
+        reinterpret_cast<uint8_t*>(pixels.data()), PixelBuffer::Size(6, 5),
+        PixelBuffer::Size(0, 0));
+    buffer.Move(src_rect, move[0], move[1]);
+    for (int y = 0; y < 5; ++y) {
+      for (int x = 0; x < 6; ++x) {
+        const int src_x = x - move[0] + src_rect.X;
+        const int src_y = y - move[1] + src_rect.Y;
+        const bool is_moved = (x >= move[0]) &&
+                              (x < move[0] + src_rect.Width) &&
+                              (y >= move[1]) && (y < move[1] + src_rect.Height);
+        EXPECT_EQ(
+            pixels[y * 6 + x],
+            is_moved ? original[src_y * 6 + src_x] : original[y * 6 + x])
+            << move[0] << ", " << move[1] << ": " << x << ", " << y;
+      }
+    }
+  }
+}
+
+TEST(PixelBuffer, CopiesWithAnyWriteSettings) {
+  // RGB888 rows of odd widths, at odd offsets, so that streaming copies have
+  // unaligned heads and tails.
+  const TestFormat format(LAYOUT_SPECS[5], PixelLayout::RGB888);
+  const int width = 203, height = 70;
+  std::mt19937 random(0);
+  std::vector<uint8_t> src_memory(width * height * 3);
+  std::uniform_int_distribution<int> distribution(0, UINT8_MAX);
+  for (uint8_t& value : src_memory) {
+    value = static_cast<uint8_t>(distribution(random));
+  }
+  PixelBuffer src(
+      PixelBuffer::Size(width, height), &format, src_memory.data(),
+      PixelBuffer::Size(width, height), PixelBuffer::Size(0, 0));
+
+  const PixelBuffer::Size allocated_size(width + 8, height + 5);
+  for (int num_threads : {0, 1, 3}) {
+    for (int num_rows_per_chunk : {0, 1, 16}) {
+      for (bool use_streaming_stores : {false, true}) {
+        std::vector<uint8_t> dest_memory(
+            allocated_size.Width * allocated_size.Height * 3, UINT8_MAX);
+        PixelBuffer dest(
+            PixelBuffer::Size(width, height), &format, dest_memory.data(),
+            allocated_size, PixelBuffer::Size(3, 2));
+        dest.SetWriteSettings(PixelBuffer::WriteSettings(
+            num_threads, num_rows_per_chunk, use_streaming_stores));
+        src.Copy(src.GetRect(), dest.GetRect(), &dest);
+        for (int y = 0; y < allocated_size.Height; ++y) {
+          for (int x = 0; x < allocated_size.Width * 3; ++x) {
+            const bool is_copied = (x >= 3 * 3) && (x < (3 + width) * 3) &&
+                                   (y >= 2) && (y < 2 + height);
+            ASSERT_EQ(
+                dest_memory[y * allocated_size.Width * 3 + x],
+                is_copied ? src_memory[(y - 2) * width * 3 + x - 3 * 3]
+                          : UINT8_MAX)
+                << num_threads << " " << num_rows_per_chunk << " "
+                << use_streaming_stores << ": " << x << ", " << y;
+          }
+        }
+      }
+    }
+  }
+}
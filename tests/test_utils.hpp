@@ -0,0 +1,18 @@
+// Helpers shared by tests.
+
+#ifndef TEST_UTILS_HPP
+#define TEST_UTILS_HPP
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <string>
+
+// Creates a fresh temporary directory.
+inline std::string MakeTempDir() {
+  char path[] = "/tmp/jfbview_test.XXXXXX";
+  EXPECT_NE(mkdtemp(path), nullptr);
+  return path;
+}
+
+#endif
@@ -0,0 +1,272 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../src/document.hpp"
+#include "../src/file_utils.hpp"
+#include "../src/framebuffer.hpp"
+#include "../src/viewer.hpp"
+#include "../src/virtual_framebuffer.hpp"
+#include "test_utils.hpp"
+
+namespace {
+
+// Opens a virtual framebuffer with the given spec.
+std::unique_ptr<VirtualFramebuffer> OpenVirtualFramebuffer(
+    const std::string& spec, int rotation = 0, bool double_buffered = false) {
+  return std::unique_ptr<VirtualFramebuffer>(
+      VirtualFramebuffer::Open(spec, rotation, double_buffered));
+}
+
+// Returns the r, g, b bytes of the pixel at (x, y) in a frame of the given
+// width.
+std::vector<uint8_t> GetPixel(
+    const std::vector<uint8_t>& frame, int width, int x, int y) {
+  const uint8_t* p = &frame[(y * width + x) * 3];
+  return std::vector<uint8_t>(p, p + 3);
+}
+
+// A document whose pages are 200x300 pixels at 100% zoom. Each pixel has its
+// page coordinates, modulo 256, as red and green, and 128 + the page number as
+// blue.
+class TestDocument : public Document {
+ public:
+  int GetNumPages() override { return 3; }
+  const PageSize GetPageSize(
+      int /* page */, float zoom, int /* rotation */) override {
+    return PageSize(
+        static_cast<int>(200 * zoom + 0.5f),
+        static_cast<int>(300 * zoom + 0.5f));
+  }
+  void Render(
+      PixelWriter* pw, int page, float /* zoom */, int /* rotation */,
+      const PageRect& region, Quality /* quality */,
+      const CancellationToken* /* token */) override {
+    std::vector<uint8_t> rgba(region.Width * 4);
+    for (int y = 0; y < region.Height; ++y) {
+      for (int x = 0; x < region.Width; ++x) {
+        rgba[x * 4] = static_cast<uint8_t>(region.X + x);
+        rgba[x * 4 + 1] = static_cast<uint8_t>(region.Y + y);
+        rgba[x * 4 + 2] = static_cast<uint8_t>(128 + page);
+      }
+      pw->WriteRow(y, rgba.data(), region.Width);
+    }
+  }
+  const OutlineItem* GetOutline() override { return nullptr; }
+  int Lookup(const OutlineItem* /* item */) override { return -1; }
+
+ protected:
+  std::vector<SearchHit> SearchOnPage(
+      const std::string& /* search_string */, int /* page */,
+      int /* context_length */) override {
+    return std::vector<SearchHit>();
+  }
+};
+
+// Checks that a frame shows the view of a TestDocument page described by
+// state, centered where it is smaller than the screen.
+void ExpectShowsView(
+    const std::vector<uint8_t>& frame, const Viewer::State& state) {
+  const int view_width = std::min(state.ScreenWidth, state.PageWidth);
+  const int view_height = std::min(state.ScreenHeight, state.PageHeight);
+  const int screen_x = (state.ScreenWidth - view_width) / 2;
+  const int screen_y = (state.ScreenHeight - view_height) / 2;
+  for (int y = 0; y < state.ScreenHeight; ++y) {
+    for (int x = 0; x < state.ScreenWidth; ++x) {
+      const int page_x = x - screen_x + state.XOffset;
+      const int page_y = y - screen_y + state.YOffset;
+      const bool is_page = (x >= screen_x) && (x < screen_x + view_width) &&
+                           (y >= screen_y) && (y < screen_y + view_height);
+      const std::vector<uint8_t> expected =
+          is_page ? std::vector<uint8_t>{static_cast<uint8_t>(page_x),
+                                         static_cast<uint8_t>(page_y),
+                                         static_cast<uint8_t>(
+                                             128 + state.Page)}
+                  : std::vector<uint8_t>{0, 0, 0};
+      ASSERT_EQ(GetPixel(frame, state.ScreenWidth, x, y), expected)
+          << x << ", " << y;
+    }
+  }
+}
+
+}  // namespace
+
+TEST(VirtualFramebuffer, ParsesSpecs) {
+  std::unique_ptr<Framebuffer> fb(
+      Framebuffer::Open("virtual:320x240@rgb565", 0, false));
+  ASSERT_NE(fb, nullptr);
+  EXPECT_EQ(fb->GetSize().Width, 320);
+  EXPECT_EQ(fb->GetSize().Height, 240);
+  EXPECT_EQ(fb->GetFormat()->GetDepth(), 2);
+  EXPECT_EQ(fb->GetFormat()->GetLayout(), PixelLayout::RGB565);
+
+  fb.reset(Framebuffer::Open("virtual:64x48", 90, false));
+  ASSERT_NE(fb, nullptr);
+  EXPECT_EQ(fb->GetSize().Width, 48);
+  EXPECT_EQ(fb->GetSize().Height, 64);
+  EXPECT_EQ(fb->GetFormat()->GetLayout(), PixelLayout::XRGB8888);
+
+  for (const char* spec :
+       {"", "320", "320x", "0x240", "-320x240", "320x240x", "320x240@",
+        "320x240@rgb555", "320x240@rgb565x"}) {
+    EXPECT_EQ(OpenVirtualFramebuffer(spec), nullptr) << spec;
+  }
+}
+
+TEST(VirtualFramebuffer, ReadsBackPixelsInEveryFormat) {
+  const uint8_t colors[][3] = {
+      {255, 0, 0}, {0, 255, 0}, {0, 0, 255}, {255, 255, 255}, {0, 0, 0}};
+  for (const char* format :
+       {"rgb565", "bgr565", "xrgb8888", "xbgr8888", "bgrx8888", "rgb888",
+        "bgr888"}) {
+    std::unique_ptr<VirtualFramebuffer> fb =
+        OpenVirtualFramebuffer(std::string("5x2@") + format);
+    ASSERT_NE(fb, nullptr) << format;
+    for (int i = 0; i < 5; ++i) {
+      fb->WritePixel(i, 1, colors[i][0], colors[i][1], colors[i][2]);
+    }
+    const std::vector<uint8_t> frame = fb->GetFrame();
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(
+          GetPixel(frame, 5, i, 1),
+          std::vector<uint8_t>(colors[i], colors[i] + 3))
+          << format << " " << i;
+      EXPECT_EQ(GetPixel(frame, 5, i, 0), std::vector<uint8_t>(3, 0))
+          << format << " " << i;
+    }
+  }
+
+  std::unique_ptr<VirtualFramebuffer> gray_fb =
+      OpenVirtualFramebuffer("2x1@gray8");
+  ASSERT_NE(gray_fb, nullptr);
+  gray_fb->WritePixel(0, 0, 255, 255, 255);
+  EXPECT_EQ(
+      gray_fb->GetFrame(), std::vector<uint8_t>({255, 255, 255, 0, 0, 0}));
+}
+
+TEST(VirtualFramebuffer, DrawsRotated) {
+  std::unique_ptr<VirtualFramebuffer> fb = OpenVirtualFramebuffer("4x3", 90);
+  ASSERT_NE(fb, nullptr);
+  fb->WritePixel(0, 0, 255, 255, 255);
+  EXPECT_EQ(
+      GetPixel(fb->GetFrame(), 4, 3, 0), std::vector<uint8_t>(3, UINT8_MAX));
+}
+
+TEST(VirtualFramebuffer, FlipsPagesWhenDoubleBuffered) {
+  std::unique_ptr<VirtualFramebuffer> fb =
+      OpenVirtualFramebuffer("4x3", 0, true);
+  ASSERT_NE(fb, nullptr);
+  EXPECT_TRUE(fb->IsDoubleBuffered());
+
+  // 1. Nothing drawn during a frame is shown before it ends.
+  fb->BeginFrame();
+  EXPECT_EQ(fb->GetBufferIndex(), 1);
+  fb->WritePixel(0, 0, 255, 255, 255);
+  EXPECT_EQ(GetPixel(fb->GetFrame(), 4, 0, 0), std::vector<uint8_t>(3, 0));
+  fb->EndFrame();
+  EXPECT_EQ(
+      GetPixel(fb->GetFrame(), 4, 0, 0), std::vector<uint8_t>(3, UINT8_MAX));
+
+  // 2. The next frame is drawn on the other page.
+  fb->BeginFrame();
+  EXPECT_EQ(fb->GetBufferIndex(), 0);
+  fb->EndFrame();
+  EXPECT_EQ(GetPixel(fb->GetFrame(), 4, 0, 0), std::vector<uint8_t>(3, 0));
+  EXPECT_EQ(fb->GetNumFrames(), 2);
+}
+
+TEST(VirtualFramebuffer, DumpsFrames) {
+  const std::string dir = MakeTempDir();
+  std::unique_ptr<Framebuffer> fb(Framebuffer::Open(
+      std::string(Framebuffer::VIRTUAL_FRAMEBUFFER_PREFIX) + "2x1@rgb565:" +
+          dir + "/frame%d.ppm",
+      0, false));
+  ASSERT_NE(fb, nullptr);
+  for (int i = 0; i < 2; ++i) {
+    fb->BeginFrame();
+    fb->WritePixel(i, 0, 255, 0, 0);
+    fb->EndFrame();
+  }
+
+  std::string contents;
+  ASSERT_TRUE(ReadFile(dir + "/frame0.ppm", &contents));
+  EXPECT_EQ(contents, std::string("P6\n2 1\n255\n\xff\0\0\0\0\0", 17));
+  ASSERT_TRUE(ReadFile(dir + "/frame1.ppm", &contents));
+  EXPECT_EQ(contents, std::string("P6\n2 1\n255\n\xff\0\0\xff\0\0", 17));
+}
+
+TEST(Viewer, RendersHeadless) {
+  for (bool double_buffered : {false, true}) {
+    std::unique_ptr<VirtualFramebuffer> fb =
+        OpenVirtualFramebuffer("320x240", 0, double_buffered);
+    ASSERT_NE(fb, nullptr);
+    TestDocument doc;
+    Viewer viewer(&doc, fb.get(), Viewer::State(0, 1.0f));
+
+    // 1. Show the top of the first page.
+    Viewer::State state;
+    viewer.Render();
+    viewer.GetState(&state);
+    EXPECT_EQ(state.PageWidth, 200);
+    EXPECT_EQ(state.PageHeight, 300);
+    ExpectShowsView(fb->GetFrame(), state);
+
+    // 2. Scroll down, which moves what is already on screen.
+    for (int y_offset : {17, 40}) {
+      state.YOffset = y_offset;
+      viewer.SetState(state);
+      viewer.Render();
+      viewer.GetState(&state);
+      ExpectShowsView(fb->GetFrame(), state);
+    }
+
+    // 3. Go to another page.
+    state.Page = 2;
+    state.YOffset = 0;
+    viewer.SetState(state);
+    viewer.Render();
+    viewer.GetState(&state);
+    ExpectShowsView(fb->GetFrame(), state);
+    EXPECT_EQ(fb->GetNumFrames(), 4);
+  }
+}
+
+TEST(Viewer, MovesScrolledViewWithoutRedrawing) {
+  std::unique_ptr<VirtualFramebuffer> fb = OpenVirtualFramebuffer("320x240");
+  ASSERT_NE(fb, nullptr);
+  TestDocument doc;
+  Viewer viewer(&doc, fb.get(), Viewer::State(0, 1.0f));
+  Viewer::State state;
+  viewer.Render();
+  viewer.GetState(&state);
+
+  // 1. Mark a pixel behind the viewer's back. A full redraw would paint over
+  // it, while moving the view carries it along.
+  const int marker_x = 100, marker_y = 150, dy = 17;
+  fb->WritePixel(marker_x, marker_y, 1, 2, 3);
+
+  // 2. Scroll down; the marker moves up with the rest of the view.
+  state.YOffset = dy;
+  viewer.SetState(state);
+  viewer.Render();
+  viewer.GetState(&state);
+  std::vector<uint8_t> frame = fb->GetFrame();
+  EXPECT_EQ(
+      GetPixel(frame, state.ScreenWidth, marker_x, marker_y - dy),
+      std::vector<uint8_t>({1, 2, 3}));
+
+  // 3. Everything else, including the newly exposed strip, shows the view.
+  // The page is centered horizontally and fills the screen vertically.
+  const int screen_x = (state.ScreenWidth - state.PageWidth) / 2;
+  uint8_t* marker =
+      &frame[((marker_y - dy) * state.ScreenWidth + marker_x) * 3];
+  marker[0] = static_cast<uint8_t>(marker_x - screen_x);
+  marker[1] = static_cast<uint8_t>(marker_y);
+  marker[2] = static_cast<uint8_t>(128 + state.Page);
+  ExpectShowsView(frame, state);
+}